@@ -0,0 +1,331 @@
+// HFFS (Help find files script)
+// Author: Michael O'Farrell
+
+#include "aio.h"
+
+#include "metrics.h"
+
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HFFS_IO_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+#endif
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+namespace {
+
+// A request as the backends track it.
+struct Request {
+  bool write;
+  int fd;
+  char* buffer;
+  size_t length;
+  uint64_t offset;
+  void* tag;
+  // How much has been transferred so far.
+  size_t done;
+};
+
+// Carries a request through with blocking calls.  Returns the bytes
+// transferred, or -errno.
+ssize_t transfer(Request& r) {
+  while (r.done < r.length) {
+    ssize_t bytes = r.write ?
+        pwrite(r.fd, r.buffer + r.done, r.length - r.done, r.offset + r.done) :
+        pread(r.fd, r.buffer + r.done, r.length - r.done, r.offset + r.done);
+    if (bytes < 0) {
+      if (errno == EINTR) continue;
+      return -errno;
+    }
+    if (bytes == 0) break;
+    r.done += bytes;
+  }
+  return r.done;
+}
+
+// Blocking reads and writes on a pool of threads, one per queue entry.
+class ThreadPoolIo : public AsyncIo {
+ public:
+  explicit ThreadPoolIo(size_t depth) : AsyncIo(depth), stopping_(false) {
+    for (size_t i = 0; i < depth; i++) {
+      threads_.emplace_back([this] { work(); });
+    }
+  }
+
+  ~ThreadPoolIo() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
+    }
+    requested_.notify_all();
+    for (auto& thread : threads_) {
+      thread.join();
+    }
+  }
+
+  const char* name() const { return "threads"; }
+
+ protected:
+  void start(bool write, int fd, char* buffer, size_t length,
+             uint64_t offset, void* tag) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      requests_.push_back({write, fd, buffer, length, offset, tag, 0});
+    }
+    requested_.notify_one();
+  }
+
+  IoCompletion next() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    completed_.wait(lock, [this] { return !completions_.empty(); });
+    IoCompletion completion = completions_.front();
+    completions_.pop_front();
+    return completion;
+  }
+
+ private:
+  void work() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+      requested_.wait(lock, [this] {
+        return stopping_ || !requests_.empty();
+      });
+      if (requests_.empty()) return;
+      Request r = requests_.front();
+      requests_.pop_front();
+      lock.unlock();
+      ssize_t result = transfer(r);
+      lock.lock();
+      completions_.push_back({r.tag, result});
+      completed_.notify_one();
+    }
+  }
+
+  std::mutex mutex_;
+  std::condition_variable requested_;
+  std::condition_variable completed_;
+  std::deque<Request> requests_;
+  std::deque<IoCompletion> completions_;
+  bool stopping_;
+  std::vector<std::thread> threads_;
+};
+
+#ifdef HFFS_IO_URING
+
+// The kernel's io_uring, driven through the raw system calls.  Reads and
+// writes are submitted as single vector requests, which every kernel with
+// io_uring supports.
+class UringIo : public AsyncIo {
+ public:
+  explicit UringIo(size_t depth)
+      : AsyncIo(depth), ring_(-1), sqRing_(MAP_FAILED), cqRing_(MAP_FAILED),
+        sqes_(MAP_FAILED), unsubmitted_(0), requests_(depth),
+        vectors_(depth) {
+    for (size_t i = 0; i < depth; i++) {
+      free_.push_back(i);
+    }
+  }
+
+  ~UringIo() {
+    if (sqes_ != MAP_FAILED) munmap(sqes_, sqesSize_);
+    if (cqRing_ != MAP_FAILED && cqRing_ != sqRing_) {
+      munmap(cqRing_, cqRingSize_);
+    }
+    if (sqRing_ != MAP_FAILED) munmap(sqRing_, sqRingSize_);
+    if (ring_ >= 0) close(ring_);
+  }
+
+  // Sets up the ring.  Returns false if the kernel won't.
+  bool open() {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring_ = syscall(__NR_io_uring_setup, (unsigned)depth(), &params);
+    if (ring_ < 0) return false;
+
+    sqRingSize_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cqRingSize_ = params.cq_off.cqes +
+                  params.cq_entries * sizeof(struct io_uring_cqe);
+    bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single) {
+      sqRingSize_ = cqRingSize_ = std::max(sqRingSize_, cqRingSize_);
+    }
+    sqRing_ = mmap(nullptr, sqRingSize_, PROT_READ|PROT_WRITE,
+                   MAP_SHARED|MAP_POPULATE, ring_, IORING_OFF_SQ_RING);
+    if (sqRing_ == MAP_FAILED) return false;
+    cqRing_ = single ? sqRing_ :
+        mmap(nullptr, cqRingSize_, PROT_READ|PROT_WRITE,
+             MAP_SHARED|MAP_POPULATE, ring_, IORING_OFF_CQ_RING);
+    if (cqRing_ == MAP_FAILED) return false;
+    sqesSize_ = params.sq_entries * sizeof(struct io_uring_sqe);
+    sqes_ = mmap(nullptr, sqesSize_, PROT_READ|PROT_WRITE,
+                 MAP_SHARED|MAP_POPULATE, ring_, IORING_OFF_SQES);
+    if (sqes_ == MAP_FAILED) return false;
+
+    char* sq = (char*)sqRing_;
+    sqTail_ = (unsigned*)(sq + params.sq_off.tail);
+    sqMask_ = *(unsigned*)(sq + params.sq_off.ring_mask);
+    sqArray_ = (unsigned*)(sq + params.sq_off.array);
+    char* cq = (char*)cqRing_;
+    cqHead_ = (unsigned*)(cq + params.cq_off.head);
+    cqTail_ = (unsigned*)(cq + params.cq_off.tail);
+    cqMask_ = *(unsigned*)(cq + params.cq_off.ring_mask);
+    cqes_ = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+    return true;
+  }
+
+  const char* name() const { return "io_uring"; }
+
+  void submit() {
+    if (unsubmitted_ > 0) enter(0);
+  }
+
+ protected:
+  void start(bool write, int fd, char* buffer, size_t length,
+             uint64_t offset, void* tag) {
+    size_t i = free_.back();
+    free_.pop_back();
+    requests_[i] = {write, fd, buffer, length, offset, tag, 0};
+    queue(i);
+  }
+
+  IoCompletion next() {
+    while (true) {
+      unsigned head = *cqHead_;
+      if (head == __atomic_load_n(cqTail_, __ATOMIC_ACQUIRE)) {
+        enter(1);
+        continue;
+      }
+      struct io_uring_cqe cqe = cqes_[head & cqMask_];
+      __atomic_store_n(cqHead_, head + 1, __ATOMIC_RELEASE);
+
+      size_t i = cqe.user_data;
+      Request& r = requests_[i];
+      if (cqe.res == -EINTR || cqe.res == -EAGAIN) {
+        queue(i);
+        continue;
+      }
+      if (cqe.res > 0) {
+        r.done += cqe.res;
+        if (r.done < r.length) {
+          queue(i);
+          continue;
+        }
+      }
+      free_.push_back(i);
+      return {r.tag, cqe.res < 0 ? (ssize_t)cqe.res : (ssize_t)r.done};
+    }
+  }
+
+ private:
+  // Puts request i, or what is left of it, on the submission queue.
+  void queue(size_t i) {
+    Request& r = requests_[i];
+    vectors_[i].iov_base = r.buffer + r.done;
+    vectors_[i].iov_len = r.length - r.done;
+
+    unsigned tail = *sqTail_;
+    unsigned index = tail & sqMask_;
+    struct io_uring_sqe& sqe = ((struct io_uring_sqe*)sqes_)[index];
+    memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = r.write ? IORING_OP_WRITEV : IORING_OP_READV;
+    sqe.fd = r.fd;
+    sqe.off = r.offset + r.done;
+    sqe.addr = (uint64_t)&vectors_[i];
+    sqe.len = 1;
+    sqe.user_data = i;
+    sqArray_[index] = index;
+    __atomic_store_n(sqTail_, tail + 1, __ATOMIC_RELEASE);
+    unsubmitted_++;
+  }
+
+  // Submits what has been queued and waits for at least minComplete
+  // completions.
+  void enter(unsigned minComplete) {
+    int submitted = syscall(__NR_io_uring_enter, ring_, unsubmitted_,
+                            minComplete, IORING_ENTER_GETEVENTS, nullptr, 0);
+    if (submitted < 0) {
+      if (errno == EINTR) return;
+      throw std::runtime_error("io_uring failed.");
+    }
+    unsubmitted_ -= submitted;
+  }
+
+  int ring_;
+  void* sqRing_;
+  size_t sqRingSize_;
+  void* cqRing_;
+  size_t cqRingSize_;
+  void* sqes_;
+  size_t sqesSize_;
+  unsigned* sqTail_;
+  unsigned sqMask_;
+  unsigned* sqArray_;
+  unsigned* cqHead_;
+  unsigned* cqTail_;
+  unsigned cqMask_;
+  struct io_uring_cqe* cqes_;
+  unsigned unsubmitted_;
+
+  std::vector<Request> requests_;
+  std::vector<struct iovec> vectors_;
+  std::vector<size_t> free_;
+};
+
+#endif
+
+}  // namespace
+///////////////////////////////////////////////////////////////////////////////
+
+void AsyncIo::timeReads(Histogram* latency) {
+  readLatency_ = latency;
+  reads_.resize(depth_);
+  freeReads_.clear();
+  for (size_t i = 0; i < depth_; i++) {
+    freeReads_.push_back(i);
+  }
+}
+
+void* AsyncIo::timeRead(void* tag) {
+  if (!readLatency_) return tag;
+  TimedRead& read = reads_[freeReads_.back()];
+  freeReads_.pop_back();
+  read.tag = tag;
+  read.start = std::chrono::steady_clock::now();
+  return &read;
+}
+
+void AsyncIo::endRead(IoCompletion& completion) {
+  // Writes, and reads started before timing was, keep their own tags.
+  TimedRead* read = (TimedRead*)completion.tag;
+  if (read < reads_.data() || read >= reads_.data() + reads_.size()) return;
+  readLatency_->add(std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now() - read->start).count());
+  completion.tag = read->tag;
+  freeReads_.push_back(read - reads_.data());
+}
+
+std::unique_ptr<AsyncIo> openAsyncIo(size_t depth, bool useUring) {
+  depth = std::max<size_t>(depth, 1);
+#ifdef HFFS_IO_URING
+  if (useUring) {
+    std::unique_ptr<UringIo> uring(new UringIo(depth));
+    if (uring->open()) return uring;
+  }
+#endif
+  return std::unique_ptr<AsyncIo>(new ThreadPoolIo(depth));
+}
@@ -0,0 +1,97 @@
+// HFFS (Help find files script)
+// Author: Michael O'Farrell
+
+#pragma once
+
+#include "trace.h"
+
+#include <sys/types.h>
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+class Histogram;
+
+// A read or write that has finished.
+struct IoCompletion {
+  void* tag;
+  // Bytes transferred, or -errno.  Short only if the file ended.
+  ssize_t result;
+};
+
+// Reads and writes with many requests in flight at once, so deep device
+// queues are kept busy.  Requests are always carried through to the end,
+// short transfers are resumed until done.  Belongs to a single thread.
+class AsyncIo {
+ public:
+  explicit AsyncIo(size_t depth)
+      : depth_(depth), outstanding_(0), readLatency_(nullptr) {}
+  virtual ~AsyncIo() {}
+
+  AsyncIo(const AsyncIo&) = delete;
+  AsyncIo& operator=(const AsyncIo&) = delete;
+
+  // Queue a request, which must fit in the queue.  tag comes back with the
+  // request's completion.  Requests may not start until submit() or wait().
+  void read(int fd, char* buffer, size_t length, uint64_t offset, void* tag) {
+    outstanding_++;
+    start(false, fd, buffer, length, offset, timeRead(tag));
+  }
+  void write(int fd, const char* buffer, size_t length, uint64_t offset,
+             void* tag) {
+    outstanding_++;
+    start(true, fd, (char*)buffer, length, offset, tag);
+  }
+
+  // Starts everything queued.
+  virtual void submit() {}
+
+  // Waits for one of the outstanding requests to finish.
+  IoCompletion wait() {
+    TraceSpan span("io-wait");
+    IoCompletion completion = next();
+    outstanding_--;
+    if (readLatency_) endRead(completion);
+    return completion;
+  }
+
+  // Adds how long each read takes to latency.  Has to be called before any
+  // requests are queued.
+  void timeReads(Histogram* latency);
+
+  // How many requests can be in flight, and how many are.
+  size_t depth() const { return depth_; }
+  size_t outstanding() const { return outstanding_; }
+  bool full() const { return outstanding_ >= depth_; }
+
+  // Which backend is in use, for reporting.
+  virtual const char* name() const = 0;
+
+ protected:
+  virtual void start(bool write, int fd, char* buffer, size_t length,
+                     uint64_t offset, void* tag) = 0;
+  virtual IoCompletion next() = 0;
+
+ private:
+  // A read being timed, whose slot stands in for its tag.
+  struct TimedRead {
+    void* tag;
+    std::chrono::steady_clock::time_point start;
+  };
+
+  void* timeRead(void* tag);
+  void endRead(IoCompletion& completion);
+
+  size_t depth_;
+  size_t outstanding_;
+  Histogram* readLatency_;
+  std::vector<TimedRead> reads_;
+  std::vector<size_t> freeReads_;
+};
+
+// Opens an io_uring of depth entries if useUring is set and the kernel allows
+// it.  Otherwise depth threads are started to pread and pwrite instead.
+std::unique_ptr<AsyncIo> openAsyncIo(size_t depth, bool useUring);
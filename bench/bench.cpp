@@ -0,0 +1,417 @@
+// HFFS (Help find files script)
+// Author: Michael O'Farrell
+
+// Benchmarks hffs end to end: generates a synthetic HFS+ image, recovers it
+// with an hffs binary a number of times, checks the bytes that came back and
+// writes a JSON report of how long verify, scan, defragment and save took.
+// The binary is run rather than linked in so reports from different
+// revisions can be compared, and given several binaries it runs them in turn
+// on the same image and compares their throughput.
+
+#include "imagegen.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// C includes
+#include <fcntl.h>
+#include <ftw.h>
+#include <getopt.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace {
+
+// The phases summarized from hffs's metrics.
+const char* const kPhases[] = {"verify", "scan", "defragment", "save"};
+constexpr size_t kNumPhases = sizeof(kPhases) / sizeof(kPhases[0]);
+
+// How the recovered files compared to what was generated.
+struct Verified {
+  // Files whose records survived, that should come back.
+  uint64_t intact;
+  // Of those, the ones that came back byte for byte.
+  uint64_t recovered;
+  uint64_t missing;
+  uint64_t corrupt;
+};
+
+struct Run {
+  // Which of the binaries ran.
+  size_t build;
+  int exitStatus;
+  double wall;
+  double cpu;
+  double phases[kNumPhases];
+  double scanMegabytesPerSecond;
+  Verified verified;
+  std::string metrics;
+};
+
+void help(const char* command) {
+  std::cerr << "Usage: " << command <<
+               " [--hffs <binary>=./hffs]..."
+               " [--workdir <folder>=bench/work]"
+               " [--size <bytes>=268435456]"
+               " [--files <count>=2000]"
+               " [--folders <count>=100]"
+               " [--max-file-size <bytes>=262144]"
+               " [--fragmentation <0-1>=0.1]"
+               " [--block-size <bytes>=4096]"
+               " [--node-size <bytes>=8192]"
+               " [--corrupt <0-1>=0]"
+               " [--corrupt-headers]"
+               " [--seed <seed>=1]"
+               " [--runs <runs>=3]"
+               " [--out <file>]"
+               " [-- <hffs options>...]" << std::endl;
+  exit(EXIT_FAILURE);
+}
+
+std::string quote(const std::string& s) {
+  std::string out = "\"";
+  for (char c : s) {
+    if (c == '"' || c == '\\') out += '\\';
+    out += c;
+  }
+  return out + "\"";
+}
+
+int removeEntry(const char* path, const struct stat*, int, struct FTW*) {
+  return remove(path);
+}
+
+void removeAll(const std::string& path) {
+  nftw(path.c_str(), removeEntry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+// The number after key, searching json from from, or 0 if there isn't one.
+double jsonNumber(const std::string& json, size_t from, const char* key) {
+  size_t at = json.find(std::string("\"") + key + "\":", from);
+  if (at == std::string::npos) return 0;
+  return strtod(json.c_str() + at + strlen(key) + 3, nullptr);
+}
+
+// Runs the binary with args, its output going to log.  Returns its exit
+// status, or -1 if it didn't exit by itself.
+int execute(const std::vector<std::string>& args, const std::string& log,
+            double* cpu) {
+  std::vector<char*> argv;
+  for (const auto& arg : args) argv.push_back((char*)arg.c_str());
+  argv.push_back(nullptr);
+  pid_t pid = fork();
+  if (pid < 0) throw std::runtime_error("Couldn't start hffs.");
+  if (pid == 0) {
+    int fd = open(log.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd >= 0) {
+      dup2(fd, STDOUT_FILENO);
+      dup2(fd, STDERR_FILENO);
+      close(fd);
+    }
+    execv(argv[0], argv.data());
+    perror(argv[0]);
+    _exit(127);
+  }
+  int status;
+  struct rusage usage;
+  if (wait4(pid, &status, 0, &usage) != pid) {
+    throw std::runtime_error("Lost track of hffs.");
+  }
+  *cpu = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 +
+         usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+  return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+// Checks the files that should have been recovered to outdir.
+Verified verify(const GeneratedImage& image, const ImageSpec& spec,
+                const std::string& outdir) {
+  Verified verified{0, 0, 0, 0};
+  std::vector<char> expected(1 << 20);
+  std::vector<char> actual(1 << 20);
+  for (const auto& file : image.files) {
+    if (!file.intact) continue;
+    verified.intact++;
+    std::ifstream in(outdir + "/" + file.path, std::ios::binary);
+    if (!in) {
+      verified.missing++;
+      continue;
+    }
+    bool same = true;
+    for (uint64_t offset = 0; same && offset < file.size;) {
+      size_t length = std::min<uint64_t>(file.size - offset, expected.size());
+      fileContents(spec.seed, file.fileID, offset, expected.data(), length);
+      same = in.read(actual.data(), length) &&
+             memcmp(expected.data(), actual.data(), length) == 0;
+      offset += length;
+    }
+    // Nothing past the end either.
+    same = same && in.peek() == std::char_traits<char>::eof();
+    if (same) {
+      verified.recovered++;
+    } else {
+      verified.corrupt++;
+    }
+  }
+  return verified;
+}
+
+// The best of each phase over runs, which is what is least disturbed by
+// everything else running, so it is what to compare.
+Run bestOf(const std::vector<Run>& runs, size_t build) {
+  Run best = Run();
+  bool first = true;
+  for (const auto& run : runs) {
+    if (run.build != build) continue;
+    if (first) {
+      best = run;
+      first = false;
+      continue;
+    }
+    for (size_t p = 0; p < kNumPhases; p++) {
+      best.phases[p] = std::min(best.phases[p], run.phases[p]);
+    }
+    best.wall = std::min(best.wall, run.wall);
+    best.cpu = std::min(best.cpu, run.cpu);
+    best.scanMegabytesPerSecond = std::max(best.scanMegabytesPerSecond,
+                                           run.scanMegabytesPerSecond);
+  }
+  return best;
+}
+
+// Megabytes of files saved per second by the best save.
+double saveMegabytesPerSecond(const GeneratedImage& image, const Run& best) {
+  const double save = best.phases[kNumPhases - 1];
+  return save > 0 ? image.dataBytes / 1e6 / save : 0;
+}
+
+void writeReport(std::ostream& out, const ImageSpec& spec,
+                 const GeneratedImage& image, const std::string& path,
+                 double generateSeconds,
+                 const std::vector<std::string>& binaries,
+                 const std::vector<Run>& runs) {
+  uint64_t intact = 0;
+  for (const auto& file : image.files) intact += file.intact;
+  out << "{" << std::endl
+      << "  \"spec\": {\"size\": " << spec.size
+      << ", \"files\": " << spec.files
+      << ", \"folders\": " << spec.folders
+      << ", \"maxFileSize\": " << spec.maxFileSize
+      << ", \"fragmentation\": " << spec.fragmentation
+      << ", \"blockSize\": " << spec.blockSize
+      << ", \"nodeSize\": " << spec.nodeSize
+      << ", \"corruption\": " << spec.corruption
+      << ", \"corruptHeaders\": " << (spec.corruptHeaders ? "true" : "false")
+      << ", \"seed\": " << spec.seed << "}," << std::endl
+      << "  \"image\": {\"path\": " << quote(path)
+      << ", \"bytes\": " << image.bytes
+      << ", \"dataBytes\": " << image.dataBytes
+      << ", \"files\": " << image.files.size()
+      << ", \"intactFiles\": " << intact
+      << ", \"catalogNodes\": " << image.catalogNodes
+      << ", \"extentNodes\": " << image.extentNodes
+      << ", \"corruptedNodes\": " << image.corruptedNodes
+      << ", \"overflowRecords\": " << image.overflowRecords
+      << ", \"generateSeconds\": " << generateSeconds << "}," << std::endl
+      << "  \"runs\": [";
+  for (size_t i = 0; i < runs.size(); i++) {
+    const Run& run = runs[i];
+    out << (i ? "," : "") << std::endl
+        << "    {\"hffs\": " << quote(binaries[run.build])
+        << ", \"exitStatus\": " << run.exitStatus
+        << ", \"wallSeconds\": " << run.wall
+        << ", \"cpuSeconds\": " << run.cpu << "," << std::endl
+        << "     \"phases\": {";
+    for (size_t p = 0; p < kNumPhases; p++) {
+      out << (p ? ", " : "") << quote(kPhases[p]) << ": " << run.phases[p];
+    }
+    out << "}," << std::endl
+        << "     \"scanMegabytesPerSecond\": " << run.scanMegabytesPerSecond
+        << "," << std::endl
+        << "     \"verified\": {\"intact\": " << run.verified.intact
+        << ", \"recovered\": " << run.verified.recovered
+        << ", \"missing\": " << run.verified.missing
+        << ", \"corrupt\": " << run.verified.corrupt << "}," << std::endl
+        << "     \"metrics\": "
+        << (run.metrics.empty() ? "null" : run.metrics) << "}";
+  }
+  // Speedups are against the first binary.
+  out << std::endl << "  ]," << std::endl
+      << "  \"builds\": [";
+  Run baseline = bestOf(runs, 0);
+  for (size_t b = 0; b < binaries.size(); b++) {
+    Run best = bestOf(runs, b);
+    out << (b ? "," : "") << std::endl
+        << "    {\"hffs\": " << quote(binaries[b])
+        << ", \"wallSeconds\": " << best.wall
+        << ", \"cpuSeconds\": " << best.cpu;
+    for (size_t p = 0; p < kNumPhases; p++) {
+      out << ", " << quote(kPhases[p]) << ": " << best.phases[p];
+    }
+    out << "," << std::endl
+        << "     \"scanMegabytesPerSecond\": " << best.scanMegabytesPerSecond
+        << ", \"saveMegabytesPerSecond\": "
+        << saveMegabytesPerSecond(image, best)
+        << ", \"scanSpeedup\": "
+        << (baseline.scanMegabytesPerSecond > 0 ?
+            best.scanMegabytesPerSecond / baseline.scanMegabytesPerSecond : 0)
+        << ", \"saveSpeedup\": "
+        << (saveMegabytesPerSecond(image, baseline) > 0 ?
+            saveMegabytesPerSecond(image, best) /
+            saveMegabytesPerSecond(image, baseline) : 0) << "}";
+  }
+  out << std::endl << "  ]" << std::endl << "}" << std::endl;
+}
+
+}  // namespace
+///////////////////////////////////////////////////////////////////////////////
+
+int main(int argc, char* argv[]) {
+  ImageSpec spec{256ull << 20, 2000, 100, 256 << 10, 0.1, 4096, 8192, 0,
+                 false, 1};
+  std::vector<std::string> binaries;
+  std::string workdir = "bench/work";
+  const char* out = nullptr;
+  int runs = 3;
+
+  while (1) {
+    int option_index = 0;
+    static struct option long_options[] = {
+      {"block-size",    required_argument, 0, 'b'},
+      {"corrupt",       required_argument, 0, 'c'},
+      {"corrupt-headers", no_argument,     0, 'C'},
+      {"files",         required_argument, 0, 'f'},
+      {"folders",       required_argument, 0, 'F'},
+      {"fragmentation", required_argument, 0, 'r'},
+      {"hffs",          required_argument, 0, 'h'},
+      {"max-file-size", required_argument, 0, 'm'},
+      {"node-size",     required_argument, 0, 'n'},
+      {"out",           required_argument, 0, 'o'},
+      {"runs",          required_argument, 0, 'R'},
+      {"seed",          required_argument, 0, 'e'},
+      {"size",          required_argument, 0, 's'},
+      {"workdir",       required_argument, 0, 'w'},
+      {0,               0,                 0,  0 }
+    };
+    int c = getopt_long(argc, argv, "", long_options, &option_index);
+    if (c == -1) break;
+    switch (c) {
+      case 'b': spec.blockSize = strtoul(optarg, nullptr, 0); break;
+      case 'c': spec.corruption = strtod(optarg, nullptr); break;
+      case 'C': spec.corruptHeaders = true; break;
+      case 'f': spec.files = strtoul(optarg, nullptr, 0); break;
+      case 'F': spec.folders = strtoul(optarg, nullptr, 0); break;
+      case 'r': spec.fragmentation = strtod(optarg, nullptr); break;
+      case 'h': binaries.push_back(optarg); break;
+      case 'm': spec.maxFileSize = strtoull(optarg, nullptr, 0); break;
+      case 'n': spec.nodeSize = strtoul(optarg, nullptr, 0); break;
+      case 'o': out = optarg; break;
+      case 'R': runs = atoi(optarg); break;
+      case 'e': spec.seed = strtoul(optarg, nullptr, 0); break;
+      case 's': spec.size = strtoull(optarg, nullptr, 0); break;
+      case 'w': workdir = optarg; break;
+      default: help(argv[0]);
+    }
+  }
+  if (runs < 1) help(argv[0]);
+  if (binaries.empty()) binaries.push_back("./hffs");
+
+  try {
+    mkdir(workdir.c_str(), 0755);
+    std::string image = workdir + "/image.hfs";
+    std::string outdir = workdir + "/out";
+    std::string metrics = workdir + "/metrics.json";
+
+    std::cerr << "Generating " << image << std::endl;
+    auto start = std::chrono::steady_clock::now();
+    GeneratedImage generated = generateImage(spec, image.c_str());
+    double generateSeconds = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start).count();
+
+    std::vector<std::string> args = {"", "--metrics", metrics};
+    // Without volume headers hffs has to be told the sizes.
+    if (spec.corruptHeaders) {
+      args.insert(args.end(), {
+          "--block-size", std::to_string(spec.blockSize),
+          "--catalog-node-size", std::to_string(spec.nodeSize),
+          "--extent-node-size", std::to_string(spec.nodeSize)});
+    }
+    args.insert(args.end(), argv + optind, argv + argc);
+    args.insert(args.end(), {"-o", outdir, image});
+
+    std::vector<Run> results;
+    bool failed = false;
+    // The binaries take turns, so whatever else is slowing the machine down
+    // slows them all down alike.
+    for (int i = 0; i < runs * (int)binaries.size(); i++) {
+      Run run;
+      run.build = i % binaries.size();
+      std::cerr << "Run " << i / binaries.size() + 1 << " of " << runs
+                << " of " << binaries[run.build] << std::endl;
+      removeAll(outdir);
+      remove(metrics.c_str());
+      args[0] = binaries[run.build];
+      start = std::chrono::steady_clock::now();
+      run.exitStatus = execute(args, workdir + "/run" + std::to_string(i + 1)
+                                     + ".log", &run.cpu);
+      run.wall = std::chrono::duration<double>(
+          std::chrono::steady_clock::now() - start).count();
+      std::ifstream in(metrics);
+      std::stringstream buffer;
+      buffer << in.rdbuf();
+      run.metrics = buffer.str();
+      while (!run.metrics.empty() && isspace(run.metrics.back())) {
+        run.metrics.pop_back();
+      }
+      size_t from = run.metrics.find("\"phases\":");
+      std::string phases = from == std::string::npos ? "" : run.metrics.substr(
+          from, run.metrics.find("\n  }", from) - from);
+      for (size_t p = 0; p < kNumPhases; p++) {
+        size_t at = phases.find(quote(kPhases[p]) + ":");
+        run.phases[p] = at == std::string::npos
+            ? 0 : jsonNumber(phases, at, "wallSeconds");
+      }
+      size_t scan = run.metrics.find("\"scan\": {");
+      run.scanMegabytesPerSecond = scan == std::string::npos
+          ? 0 : jsonNumber(run.metrics, scan, "megabytesPerSecond");
+      run.verified = verify(generated, spec, outdir);
+      failed = failed || run.exitStatus != 0 ||
+               run.verified.recovered != run.verified.intact;
+      results.push_back(run);
+    }
+
+    if (out) {
+      std::ofstream file(out, std::ios::out | std::ios::trunc);
+      writeReport(file, spec, generated, image, generateSeconds, binaries,
+                  results);
+      if (!file) throw std::runtime_error("Couldn't write the report.");
+    } else {
+      writeReport(std::cout, spec, generated, image, generateSeconds,
+                  binaries, results);
+    }
+    for (size_t b = 0; b < binaries.size(); b++) {
+      Run best = bestOf(results, b);
+      std::cerr << binaries[b] << ": scan " << best.scanMegabytesPerSecond
+                << " MB/s, save " << saveMegabytesPerSecond(generated, best)
+                << " MB/s, " << best.wall << " seconds" << std::endl;
+    }
+    if (failed) {
+      std::cerr << "Not every intact file was recovered, see "
+                << workdir << "/run*.log" << std::endl;
+      return EXIT_FAILURE;
+    }
+  } catch (const std::exception& err) {
+    std::cerr << err.what() << std::endl;
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
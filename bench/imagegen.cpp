@@ -0,0 +1,466 @@
+// HFFS (Help find files script)
+// Author: Michael O'Farrell
+
+#include "imagegen.h"
+
+#include "convert.h"
+#include "hfs/hfs_format.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <random>
+#include <stdexcept>
+
+namespace {
+
+// Every date in the volume, a while after the HFS+ epoch.
+constexpr uint32_t kDate = 3600000000u;
+// Where the volume headers are, from the start and the end of the volume.
+constexpr uint64_t kHeaderOffset = 1024;
+// Files' data is written through a buffer this big.
+constexpr size_t kWriteSize = 1 << 20;
+
+struct Folder {
+  uint32_t parent;
+  std::string name;
+};
+
+struct File {
+  uint32_t id;
+  uint32_t parent;
+  std::string name;
+  uint64_t size;
+  std::vector<HFSPlusExtentDescriptor> extents;
+};
+
+template<typename T>
+void storeBigEndian(char* p, T value) {
+  ConvertBigEndian(&value);
+  memcpy(p, &value, sizeof(value));
+}
+
+std::string catalogKey(uint32_t parent, const std::string& name) {
+  std::string key(2 + kHFSPlusCatalogKeyMinimumLength + 2 * name.size(), 0);
+  storeBigEndian<uint16_t>(&key[0], key.size() - 2);
+  storeBigEndian<uint32_t>(&key[2], parent);
+  storeBigEndian<uint16_t>(&key[6], name.size());
+  for (size_t i = 0; i < name.size(); i++) {
+    storeBigEndian<uint16_t>(&key[8 + 2 * i], (uint8_t)name[i]);
+  }
+  return key;
+}
+
+std::string folderRecord(uint32_t folderID) {
+  HFSPlusCatalogFolder folder;
+  memset(&folder, 0, sizeof(folder));
+  folder.recordType = kHFSPlusFolderRecord;
+  folder.folderID = folderID;
+  folder.createDate = folder.contentModDate = folder.accessDate = kDate;
+  ConvertBigEndian(&folder);
+  return std::string((const char*)&folder, sizeof(folder));
+}
+
+std::string fileRecord(const File& file, uint32_t blockSize) {
+  HFSPlusCatalogFile record;
+  memset(&record, 0, sizeof(record));
+  record.recordType = kHFSPlusFileRecord;
+  record.fileID = file.id;
+  record.createDate = record.contentModDate = record.accessDate = kDate;
+  record.dataFork.logicalSize = file.size;
+  record.dataFork.totalBlocks = (file.size + blockSize - 1) / blockSize;
+  for (size_t i = 0; i < file.extents.size() && i < kHFSPlusExtentDensity;
+       i++) {
+    record.dataFork.extents[i] = file.extents[i];
+  }
+  ConvertBigEndian(&record);
+  return std::string((const char*)&record, sizeof(record));
+}
+
+std::string threadRecord(int16_t type, uint32_t parent,
+                         const std::string& name) {
+  std::string record(10 + 2 * name.size(), 0);
+  storeBigEndian<uint16_t>(&record[0], type);
+  storeBigEndian<uint32_t>(&record[4], parent);
+  storeBigEndian<uint16_t>(&record[8], name.size());
+  for (size_t i = 0; i < name.size(); i++) {
+    storeBigEndian<uint16_t>(&record[10 + 2 * i], (uint8_t)name[i]);
+  }
+  return record;
+}
+
+// The overflow extents of file from its extent first on, up to a record's
+// worth, keyed by the file block they start at.
+std::string extentRecord(const File& file, size_t first, uint32_t block) {
+  HFSPlusExtentKey key;
+  memset(&key, 0, sizeof(key));
+  key.keyLength = kHFSPlusExtentKeyMaximumLength;
+  key.fileID = file.id;
+  key.startBlock = block;
+  ConvertBigEndian(&key);
+  HFSPlusExtentRecord extents;
+  memset(&extents, 0, sizeof(extents));
+  for (size_t i = 0; i < kHFSPlusExtentDensity &&
+                     first + i < file.extents.size(); i++) {
+    extents[i] = file.extents[first + i];
+  }
+  ConvertBigEndian(&extents);
+  return std::string((const char*)&key, sizeof(key)) +
+         std::string((const char*)&extents, sizeof(extents));
+}
+
+// Packs records into as few leaf nodes as they fit in, in order, noting the
+// node each record went in.  Nodes are numbered from 1, after the header.
+std::vector<std::string> packLeaves(const std::vector<std::string>& records,
+                                    uint32_t nodeSize,
+                                    std::vector<uint32_t>& nodeOf) {
+  std::vector<std::string> nodes;
+  std::vector<uint16_t> offsets;
+  auto finish = [&] {
+    std::string& node = nodes.back();
+    for (size_t i = 0; i < offsets.size(); i++) {
+      storeBigEndian<uint16_t>(&node[nodeSize - 2 * (i + 1)], offsets[i]);
+    }
+    node[offsetof(BTNodeDescriptor, kind)] = (char)kBTLeafNode;
+    node[offsetof(BTNodeDescriptor, height)] = 1;
+    storeBigEndian<uint16_t>(&node[offsetof(BTNodeDescriptor, numRecords)],
+                             offsets.size() - 1);
+  };
+  for (const auto& record : records) {
+    // The record, and an offset for it and for the free space after it.
+    if (nodes.empty() ||
+        offsets.back() + record.size() + 2 * (offsets.size() + 1) >
+        nodeSize) {
+      if (!nodes.empty()) finish();
+      nodes.push_back(std::string(nodeSize, 0));
+      offsets.assign(1, sizeof(BTNodeDescriptor));
+    }
+    memcpy(&nodes.back()[offsets.back()], record.data(), record.size());
+    offsets.push_back(offsets.back() + record.size());
+    nodeOf.push_back(nodes.size());
+  }
+  if (!nodes.empty()) finish();
+  for (size_t i = 0; i < nodes.size(); i++) {
+    storeBigEndian<uint32_t>(&nodes[i][offsetof(BTNodeDescriptor, fLink)],
+                             i + 1 < nodes.size() ? i + 2 : 0);
+    storeBigEndian<uint32_t>(&nodes[i][offsetof(BTNodeDescriptor, bLink)],
+                             i);
+  }
+  return nodes;
+}
+
+std::string headerNode(uint32_t nodeSize, uint32_t leaves, uint32_t records,
+                       uint16_t maxKeyLength, uint8_t keyCompareType) {
+  std::string node(nodeSize, 0);
+  node[offsetof(BTNodeDescriptor, kind)] = kBTHeaderNode;
+  storeBigEndian<uint16_t>(&node[offsetof(BTNodeDescriptor, numRecords)], 3);
+  BTHeaderRec header;
+  memset(&header, 0, sizeof(header));
+  header.treeDepth = leaves ? 1 : 0;
+  header.rootNode = leaves ? 1 : 0;
+  header.leafRecords = records;
+  header.firstLeafNode = leaves ? 1 : 0;
+  header.lastLeafNode = leaves;
+  header.nodeSize = nodeSize;
+  header.maxKeyLength = maxKeyLength;
+  header.totalNodes = leaves + 1;
+  header.keyCompareType = keyCompareType;
+  header.attributes = kBTBigKeysMask | kBTVariableIndexKeysMask;
+  ConvertBigEndian(&header);
+  memcpy(&node[sizeof(BTNodeDescriptor)], &header, sizeof(header));
+  // The header record, the user data record and the map record.
+  const uint16_t offsets[] = {
+    sizeof(BTNodeDescriptor), sizeof(BTNodeDescriptor) + sizeof(header),
+    sizeof(BTNodeDescriptor) + sizeof(header) + 128,
+    (uint16_t)(nodeSize - 8),
+  };
+  for (size_t i = 0; i < 4; i++) {
+    storeBigEndian<uint16_t>(&node[nodeSize - 2 * (i + 1)], offsets[i]);
+  }
+  // Every node is in use, as far as the map record reaches.
+  for (uint32_t i = 0; i <= leaves && i / 8 < offsets[3] - offsets[2]; i++) {
+    node[offsets[2] + i / 8] |= 0x80 >> (i % 8);
+  }
+  return node;
+}
+
+void fillFork(HFSPlusForkData& fork, uint64_t bytes, uint32_t blockSize,
+              uint32_t start) {
+  fork.logicalSize = bytes;
+  fork.totalBlocks = bytes / blockSize;
+  fork.extents[0].startBlock = start;
+  fork.extents[0].blockCount = fork.totalBlocks;
+}
+
+uint64_t mix(uint64_t x) {
+  x += 0x9E3779B97F4A7C15ull;
+  x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+  x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+  return x ^ (x >> 31);
+}
+
+void writeAt(int fd, const char* buffer, size_t length, uint64_t offset) {
+  if (pwrite(fd, buffer, length, offset) != (ssize_t)length) {
+    throw std::runtime_error("Couldn't write the image.");
+  }
+}
+
+}  // namespace
+///////////////////////////////////////////////////////////////////////////////
+
+void fileContents(uint32_t seed, uint32_t fileID, uint64_t offset, char* out,
+                  size_t length) {
+  uint64_t key = mix((uint64_t)seed << 32 | fileID);
+  for (size_t i = 0; i < length;) {
+    uint64_t word = mix(key ^ ((offset + i) / 8));
+    size_t byte = (offset + i) % 8;
+    for (; byte < 8 && i < length; byte++, i++) {
+      out[i] = (char)(word >> (8 * byte));
+    }
+  }
+}
+
+GeneratedImage generateImage(const ImageSpec& spec, const char* path) {
+  uint32_t blockSize = spec.blockSize;
+  uint32_t nodeSize = spec.nodeSize;
+  if (blockSize < 512 || (blockSize & (blockSize - 1)) || nodeSize < 512 ||
+      nodeSize > 32768 || (nodeSize & (nodeSize - 1))) {
+    throw std::runtime_error(
+        "Block and node sizes have to be powers of two, nodes from 512 to "
+        "32768 bytes.");
+  }
+  std::mt19937 random(spec.seed);
+  auto chance = [&](double p) {
+    return std::uniform_real_distribution<double>(0, 1)(random) < p;
+  };
+  auto pick = [&](uint64_t low, uint64_t high) {
+    return std::uniform_int_distribution<uint64_t>(low, high)(random);
+  };
+
+  // The folders hang off the root or earlier folders, the files off any.
+  std::vector<Folder> folders;
+  for (uint32_t i = 0; i < spec.folders; i++) {
+    uint64_t parent = pick(0, folders.size());
+    folders.push_back({parent ? kHFSFirstUserCatalogNodeID + (uint32_t)parent
+                                - 1 : kHFSRootFolderID,
+                       "dir" + std::to_string(i)});
+  }
+  uint32_t nextID = kHFSFirstUserCatalogNodeID + spec.folders;
+  std::vector<File> files;
+  for (uint32_t i = 0; i < spec.files; i++) {
+    uint64_t parent = pick(0, folders.size());
+    files.push_back({nextID++,
+                     parent ? kHFSFirstUserCatalogNodeID + (uint32_t)parent
+                              - 1 : kHFSRootFolderID,
+                     "file" + std::to_string(i) + ".bin",
+                     pick(1, std::max<uint64_t>(spec.maxFileSize, 1)), {}});
+  }
+
+  // Files are cut into pieces, which are spread over the data area in a
+  // random order with small gaps between them.
+  struct Piece {
+    size_t file;
+    size_t extent;
+  };
+  std::vector<Piece> pieces;
+  for (size_t f = 0; f < files.size(); f++) {
+    uint64_t blocks = (files[f].size + blockSize - 1) / blockSize;
+    while (blocks > 0) {
+      uint64_t count = blocks;
+      if (blocks > 1 && chance(spec.fragmentation)) {
+        count = pick(1, blocks - 1);
+      }
+      files[f].extents.push_back({0, (uint32_t)count});
+      pieces.push_back({f, files[f].extents.size() - 1});
+      blocks -= count;
+    }
+  }
+  std::shuffle(pieces.begin(), pieces.end(), random);
+
+  std::vector<std::string> catalog;
+  // What each catalog record is of: the folder or file, or nothing.
+  std::vector<std::pair<bool, size_t>> recordOf;
+  catalog.push_back(catalogKey(kHFSRootParentID, "Volume") +
+                    folderRecord(kHFSRootFolderID));
+  catalog.push_back(catalogKey(kHFSRootFolderID, "") +
+                    threadRecord(kHFSPlusFolderThreadRecord,
+                                 kHFSRootParentID, "Volume"));
+  recordOf.assign(2, {false, SIZE_MAX});
+  for (size_t i = 0; i < folders.size(); i++) {
+    uint32_t id = kHFSFirstUserCatalogNodeID + i;
+    catalog.push_back(catalogKey(folders[i].parent, folders[i].name) +
+                      folderRecord(id));
+    catalog.push_back(catalogKey(id, "") +
+                      threadRecord(kHFSPlusFolderThreadRecord,
+                                   folders[i].parent, folders[i].name));
+    recordOf.push_back({false, i});
+    recordOf.push_back({false, SIZE_MAX});
+  }
+  std::vector<std::string> overflow;
+  for (size_t i = 0; i < files.size(); i++) {
+    // Placeholders, the extents aren't placed yet but records don't change
+    // size.
+    catalog.push_back(catalogKey(files[i].parent, files[i].name) +
+                      fileRecord(files[i], blockSize));
+    catalog.push_back(catalogKey(files[i].id, "") +
+                      threadRecord(kHFSPlusFileThreadRecord,
+                                   files[i].parent, files[i].name));
+    recordOf.push_back({true, i});
+    recordOf.push_back({false, SIZE_MAX});
+    for (size_t e = kHFSPlusExtentDensity; e < files[i].extents.size();
+         e += kHFSPlusExtentDensity) {
+      overflow.push_back(extentRecord(files[i], e, 0));
+    }
+  }
+  std::vector<uint32_t> nodeOf;
+  uint32_t catalogNodes = packLeaves(catalog, nodeSize, nodeOf).size() + 1;
+  std::vector<uint32_t> extentNodeOf;
+  uint32_t extentNodes =
+      packLeaves(overflow, nodeSize, extentNodeOf).size() + 1;
+
+  // The B-trees start past the volume header, lined up on nodes and blocks.
+  uint64_t align = std::max(nodeSize, blockSize);
+  auto roundUp = [&](uint64_t bytes) {
+    return (bytes + align - 1) / align * align;
+  };
+  uint64_t catalogStart = roundUp(kHeaderOffset + sizeof(HFSPlusVolumeHeader));
+  uint64_t catalogBytes = roundUp((uint64_t)catalogNodes * nodeSize);
+  uint64_t extentsStart = catalogStart + catalogBytes;
+  uint64_t extentsBytes = roundUp((uint64_t)extentNodes * nodeSize);
+  uint64_t cursor = (extentsStart + extentsBytes) / blockSize;
+  for (const auto& piece : pieces) {
+    cursor += pick(0, 2);
+    HFSPlusExtentDescriptor& extent = files[piece.file].extents[piece.extent];
+    extent.startBlock = cursor;
+    cursor += extent.blockCount;
+  }
+  uint64_t totalBlocks = std::max(
+      (spec.size + blockSize - 1) / blockSize,
+      cursor + (kHeaderOffset + blockSize - 1) / blockSize + 1);
+  if (totalBlocks > UINT32_MAX) {
+    throw std::runtime_error("The volume has too many blocks.");
+  }
+
+  // Now the records can be made for real.
+  size_t record = 2 + 2 * folders.size();
+  overflow.clear();
+  for (const auto& file : files) {
+    catalog[record] = catalogKey(file.parent, file.name) +
+                      fileRecord(file, blockSize);
+    record += 2;
+    uint32_t block = 0;
+    for (size_t e = 0; e < file.extents.size(); e++) {
+      if (e >= kHFSPlusExtentDensity && e % kHFSPlusExtentDensity == 0) {
+        overflow.push_back(extentRecord(file, e, block));
+      }
+      block += file.extents[e].blockCount;
+    }
+  }
+  nodeOf.clear();
+  extentNodeOf.clear();
+  std::vector<std::string> leaves = packLeaves(catalog, nodeSize, nodeOf);
+  std::vector<std::string> extentLeaves =
+      packLeaves(overflow, nodeSize, extentNodeOf);
+
+  GeneratedImage image;
+  image.bytes = totalBlocks * blockSize;
+  image.dataBytes = 0;
+  image.catalogNodes = catalogNodes;
+  image.extentNodes = extentNodes;
+  image.corruptedNodes = 0;
+  image.overflowRecords = overflow.size();
+
+  // Damaged leaves lose the records in them, and with a folder's record
+  // everything under it loses its place.
+  std::vector<bool> corrupt(leaves.size() + 1);
+  for (size_t i = 0; i < leaves.size(); i++) {
+    if (spec.corruption > 0 && chance(spec.corruption)) {
+      corrupt[i + 1] = true;
+      image.corruptedNodes++;
+      for (auto& c : leaves[i]) c = (char)pick(0, 255);
+    }
+  }
+  std::vector<bool> folderLost(folders.size());
+  std::vector<bool> fileLost(files.size());
+  for (size_t r = 0; r < catalog.size(); r++) {
+    if (!corrupt[nodeOf[r]] || recordOf[r].second == SIZE_MAX) continue;
+    if (recordOf[r].first) {
+      fileLost[recordOf[r].second] = true;
+    } else {
+      folderLost[recordOf[r].second] = true;
+    }
+  }
+  auto folderIndex = [](uint32_t id) {
+    return id - kHFSFirstUserCatalogNodeID;
+  };
+  for (size_t i = 0; i < files.size(); i++) {
+    const File& file = files[i];
+    std::string path = file.name;
+    bool intact = !fileLost[i];
+    for (uint32_t parent = file.parent; parent != kHFSRootFolderID;
+         parent = folders[folderIndex(parent)].parent) {
+      const Folder& folder = folders[folderIndex(parent)];
+      intact = intact && !folderLost[folderIndex(parent)];
+      path = folder.name + "/" + path;
+    }
+    image.files.push_back({path, file.id, file.size, intact});
+    image.dataBytes += file.size;
+  }
+
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) throw std::runtime_error("Couldn't create the image.");
+  if (ftruncate(fd, image.bytes) != 0) {
+    close(fd);
+    throw std::runtime_error("Couldn't size the image.");
+  }
+  std::string tree = headerNode(nodeSize, leaves.size(), catalog.size(),
+                                kHFSPlusCatalogKeyMaximumLength,
+                                kHFSCaseFolding);
+  for (const auto& leaf : leaves) tree += leaf;
+  writeAt(fd, tree.data(), tree.size(), catalogStart);
+  tree = headerNode(nodeSize, extentLeaves.size(), overflow.size(),
+                    kHFSPlusExtentKeyMaximumLength, 0);
+  for (const auto& leaf : extentLeaves) tree += leaf;
+  writeAt(fd, tree.data(), tree.size(), extentsStart);
+
+  std::vector<char> buffer(kWriteSize);
+  for (const auto& file : spec.skipData ? std::vector<File>() : files) {
+    uint64_t offset = 0;
+    for (const auto& extent : file.extents) {
+      uint64_t end = std::min<uint64_t>(
+          file.size, offset + (uint64_t)extent.blockCount * blockSize);
+      uint64_t at = (uint64_t)extent.startBlock * blockSize;
+      for (; offset < end; ) {
+        size_t length = std::min<uint64_t>(end - offset, buffer.size());
+        fileContents(spec.seed, file.id, offset, buffer.data(), length);
+        writeAt(fd, buffer.data(), length, at);
+        offset += length;
+        at += length;
+      }
+      offset = end;
+    }
+  }
+
+  HFSPlusVolumeHeader header;
+  memset(&header, 0, sizeof(header));
+  header.signature = spec.corruptHeaders ? 0 : kHFSPlusSigWord;
+  header.version = kHFSPlusVersion;
+  header.createDate = header.modifyDate = kDate;
+  header.fileCount = files.size();
+  header.folderCount = folders.size();
+  header.blockSize = blockSize;
+  header.totalBlocks = totalBlocks;
+  header.nextCatalogID = nextID;
+  fillFork(header.extentsFile, extentsBytes, blockSize,
+           extentsStart / blockSize);
+  fillFork(header.catalogFile, catalogBytes, blockSize,
+           catalogStart / blockSize);
+  ConvertBigEndian(&header);
+  writeAt(fd, (const char*)&header, sizeof(header), kHeaderOffset);
+  writeAt(fd, (const char*)&header, sizeof(header),
+          image.bytes - kHeaderOffset);
+  if (close(fd) != 0) throw std::runtime_error("Couldn't write the image.");
+  return image;
+}
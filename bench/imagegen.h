@@ -0,0 +1,67 @@
+// HFFS (Help find files script)
+// Author: Michael O'Farrell
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Builds synthetic HFS+ volume images to benchmark recoveries on.  The
+// volume has both volume headers, a catalog B-tree of folders, files and
+// their threads, an extents overflow B-tree for files in more than eight
+// pieces, and the files' data, which is made up from the file's ID so it can
+// be checked without being stored.  Space no file uses is left as a hole in
+// the image file.
+
+struct ImageSpec {
+  // The smallest the volume should be, it grows to fit the files.
+  uint64_t size;
+  uint32_t files;
+  uint32_t folders;
+  uint64_t maxFileSize;
+  // The chance of each piece of a file being split in two, from 0 to 1.
+  double fragmentation;
+  uint32_t blockSize;
+  // Of both the catalog and the extents B-trees.
+  uint32_t nodeSize;
+  // The share of catalog leaf nodes overwritten with garbage, from 0 to 1.
+  double corruption;
+  // Whether both volume headers lose their signature.
+  bool corruptHeaders;
+  uint32_t seed;
+  // Whether the files' contents are left out as holes, when only the B-trees
+  // matter.
+  bool skipData;
+};
+
+// A file in the generated volume.
+struct GeneratedFile {
+  // Where it should be recovered to, relative to the output folder.
+  std::string path;
+  uint32_t fileID;
+  uint64_t size;
+  // Whether its record, and those of the folders above it, survived the
+  // corruption.
+  bool intact;
+};
+
+struct GeneratedImage {
+  uint64_t bytes;
+  uint64_t dataBytes;
+  uint32_t catalogNodes;
+  uint32_t extentNodes;
+  uint32_t corruptedNodes;
+  uint32_t overflowRecords;
+  std::vector<GeneratedFile> files;
+};
+
+// Writes the volume spec describes to path.  Throws std::runtime_error if the
+// spec doesn't make sense or the image can't be written.
+GeneratedImage generateImage(const ImageSpec& spec, const char* path);
+
+// The length bytes at offset of file fileID's contents in images generated
+// with seed.
+void fileContents(uint32_t seed, uint32_t fileID, uint64_t offset, char* out,
+                  size_t length);
@@ -0,0 +1,356 @@
+// HFFS (Help find files script)
+// Author: Michael O'Farrell
+
+// Microbenchmarks of the node parsers, on their own rather than as part of a
+// recovery.  The nodes are the catalog and extents leaf nodes of a generated
+// image, read into memory, and each benchmark runs over them again and again
+// for a while.  Results are written as JSON: nodes and records per second for
+// the parsers, names per second for the name and byte swapping routines.
+
+#include "imagegen.h"
+
+#include "convert.h"
+#include "hfs/hfs_format.h"
+#include "nodes.h"
+#include "rgs.h"
+
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// C includes
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+// Leaf nodes one after another, with room to spare past the last for the
+// parsers to read into.
+struct Nodes {
+  uint32_t nodeSize;
+  std::vector<char> bytes;
+  size_t count;
+
+  const char* node(size_t i) const { return &bytes[i * nodeSize]; }
+};
+
+struct Result {
+  std::string name;
+  double seconds;
+  uint64_t iterations;
+  // Per iteration.
+  uint64_t nodes;
+  uint64_t records;
+  uint64_t names;
+};
+
+// Keeps the results of the benchmarked code from being optimized away.
+volatile uint64_t sink;
+
+void help(const char* command) {
+  std::cerr << "Usage: " << command <<
+               " [--workdir <folder>=bench/work]"
+               " [--files <count>=20000]"
+               " [--max-file-size <bytes>=4194304]"
+               " [--fragmentation <0-1>=0.9]"
+               " [--block-size <bytes>=4096]"
+               " [--node-size <bytes>=8192]"
+               " [--seed <seed>=1]"
+               " [--seconds <seconds>=1]"
+               " [--out <file>]" << std::endl;
+  exit(EXIT_FAILURE);
+}
+
+void readAt(int fd, char* buffer, size_t length, uint64_t offset) {
+  if (pread(fd, buffer, length, offset) != (ssize_t)length) {
+    throw std::runtime_error("Couldn't read the image.");
+  }
+}
+
+// Reads the leaf nodes of the B-tree in fork.
+Nodes readLeaves(int fd, uint32_t blockSize, const HFSPlusForkData& fork) {
+  uint64_t start = (uint64_t)fork.extents[0].startBlock * blockSize;
+  std::vector<char> header(sizeof(BTNodeDescriptor) + sizeof(BTHeaderRec));
+  readAt(fd, header.data(), header.size(), start);
+  BTHeaderRec rec;
+  memcpy(&rec, &header[sizeof(BTNodeDescriptor)], sizeof(rec));
+  ConvertBigEndian(&rec);
+
+  Nodes nodes;
+  nodes.nodeSize = rec.nodeSize;
+  nodes.count = 0;
+  std::vector<char> node(rec.nodeSize);
+  for (uint32_t i = 1; i < rec.totalNodes; i++) {
+    readAt(fd, node.data(), node.size(), start + (uint64_t)i * rec.nodeSize);
+    if (BTNodeDescriptorView(node.data()).kind() != kBTLeafNode) continue;
+    nodes.bytes.insert(nodes.bytes.end(), node.begin(), node.end());
+    nodes.count++;
+  }
+  nodes.bytes.resize(nodes.bytes.size() + kNodeSlack);
+  return nodes;
+}
+
+// Runs body, which does one iteration, until seconds have passed.
+Result measure(const char* name, double seconds,
+               const std::function<void()>& body) {
+  Result result{name, 0, 0, 0, 0, 0};
+  auto start = std::chrono::steady_clock::now();
+  do {
+    body();
+    result.iterations++;
+    result.seconds = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start).count();
+  } while (result.seconds < seconds);
+  std::cerr << name << ": " << result.iterations << " iterations"
+            << std::endl;
+  return result;
+}
+
+double rate(uint64_t count, const Result& result) {
+  return result.seconds > 0 ? count * result.iterations / result.seconds : 0;
+}
+
+void writeReport(std::ostream& out, const ImageSpec& spec,
+                 const Nodes& catalog, const Nodes& extents,
+                 const std::vector<Result>& results) {
+  out << "{" << std::endl
+      << "  \"spec\": {\"files\": " << spec.files
+      << ", \"maxFileSize\": " << spec.maxFileSize
+      << ", \"fragmentation\": " << spec.fragmentation
+      << ", \"blockSize\": " << spec.blockSize
+      << ", \"nodeSize\": " << spec.nodeSize
+      << ", \"seed\": " << spec.seed << "}," << std::endl
+      << "  \"catalogLeaves\": " << catalog.count << "," << std::endl
+      << "  \"extentLeaves\": " << extents.count << "," << std::endl
+      << "  \"benchmarks\": {";
+  for (size_t i = 0; i < results.size(); i++) {
+    const Result& result = results[i];
+    out << (i ? "," : "") << std::endl
+        << "    \"" << result.name << "\": {\"iterations\": "
+        << result.iterations << ", \"seconds\": " << result.seconds;
+    if (result.nodes) {
+      out << ", \"nodesPerSecond\": " << rate(result.nodes, result)
+          << ", \"nanosecondsPerNode\": "
+          << 1e9 / rate(result.nodes, result);
+    }
+    if (result.records) {
+      out << ", \"recordsPerSecond\": " << rate(result.records, result);
+    }
+    if (result.names) {
+      out << ", \"namesPerSecond\": " << rate(result.names, result);
+    }
+    out << "}";
+  }
+  out << std::endl << "  }" << std::endl << "}" << std::endl;
+}
+
+}  // namespace
+///////////////////////////////////////////////////////////////////////////////
+
+int main(int argc, char* argv[]) {
+  ImageSpec spec{0, 20000, 500, 4 << 20, 0.9, 4096, 8192, 0, false, 1,
+                 true};
+  std::string workdir = "bench/work";
+  const char* out = nullptr;
+  double seconds = 1;
+
+  while (1) {
+    int option_index = 0;
+    static struct option long_options[] = {
+      {"block-size",    required_argument, 0, 'b'},
+      {"files",         required_argument, 0, 'f'},
+      {"fragmentation", required_argument, 0, 'r'},
+      {"max-file-size", required_argument, 0, 'm'},
+      {"node-size",     required_argument, 0, 'n'},
+      {"out",           required_argument, 0, 'o'},
+      {"seconds",       required_argument, 0, 't'},
+      {"seed",          required_argument, 0, 'e'},
+      {"workdir",       required_argument, 0, 'w'},
+      {0,               0,                 0,  0 }
+    };
+    int c = getopt_long(argc, argv, "", long_options, &option_index);
+    if (c == -1) break;
+    switch (c) {
+      case 'b': spec.blockSize = strtoul(optarg, nullptr, 0); break;
+      case 'f': spec.files = strtoul(optarg, nullptr, 0); break;
+      case 'r': spec.fragmentation = strtod(optarg, nullptr); break;
+      case 'm': spec.maxFileSize = strtoull(optarg, nullptr, 0); break;
+      case 'n': spec.nodeSize = strtoul(optarg, nullptr, 0); break;
+      case 'o': out = optarg; break;
+      case 't': seconds = strtod(optarg, nullptr); break;
+      case 'e': spec.seed = strtoul(optarg, nullptr, 0); break;
+      case 'w': workdir = optarg; break;
+      default: help(argv[0]);
+    }
+  }
+  if (optind != argc) help(argv[0]);
+  spec.folders = spec.files / 40;
+
+  try {
+    mkdir(workdir.c_str(), 0755);
+    std::string image = workdir + "/nodes.hfs";
+    std::cerr << "Generating " << image << std::endl;
+    generateImage(spec, image.c_str());
+
+    int fd = open(image.c_str(), O_RDONLY);
+    if (fd < 0) throw std::runtime_error("Couldn't open the image.");
+    HFSPlusVolumeHeader header;
+    readAt(fd, (char*)&header, sizeof(header), 1024);
+    ConvertBigEndian(&header);
+    Nodes catalog = readLeaves(fd, header.blockSize, header.catalogFile);
+    Nodes extents = readLeaves(fd, header.blockSize, header.extentsFile);
+    close(fd);
+
+    Options options;
+    memset(&options, 0, sizeof(options));
+    options.blockSize = header.blockSize;
+    options.catalogNodeSize = catalog.nodeSize;
+    options.extentNodeSize = extents.nodeSize;
+
+    // The records the parsers find, to decode on their own.
+    std::vector<const char*> catalogRecords;
+    std::vector<const char*> extentRecords;
+    for (size_t i = 0; i < catalog.count; i++) {
+      findCatalogRecords(options, catalog.node(i), catalog.nodeSize,
+                         catalogRecords);
+    }
+    for (size_t i = 0; i < extents.count; i++) {
+      findExtentRecords(options, extents.node(i), extents.nodeSize,
+                        extentRecords);
+    }
+    uint64_t catalogRecordCount = 0;
+    for (size_t i = 0; i < catalog.count; i++) {
+      catalogRecordCount += BTNodeDescriptorView(catalog.node(i)).numRecords();
+    }
+
+    // Most positions a scan parses are file data, which the parsers turn
+    // down.
+    Nodes data;
+    data.nodeSize = catalog.nodeSize;
+    data.count = catalog.count;
+    data.bytes.resize(catalog.bytes.size());
+    std::mt19937 random(spec.seed);
+    for (auto& c : data.bytes) c = (char)random();
+
+    // Names as they are in keys, and in host order.
+    std::vector<uint16_t> names;
+    for (const char* key : catalogRecords) {
+      CatalogKeyView ck(key);
+      std::vector<uint16_t> name(ck.nameLength());
+      memcpy(name.data(), key + offsetof(HFSPlusCatalogKey, nodeName.unicode),
+             name.size() * sizeof(uint16_t));
+      names.push_back(name.size());
+      names.insert(names.end(), name.begin(), name.end());
+    }
+    std::vector<uint16_t> swapped = names;
+
+    std::vector<Result> results;
+    std::vector<const char*> found;
+    results.push_back(measure("findCatalogRecords", seconds, [&] {
+      for (size_t i = 0; i < catalog.count; i++) {
+        found.clear();
+        findCatalogRecords(options, catalog.node(i), catalog.nodeSize, found);
+        sink = sink + found.size();
+      }
+    }));
+    results.back().nodes = catalog.count;
+    results.back().records = catalogRecordCount;
+
+    results.push_back(measure("findExtentRecords", seconds, [&] {
+      for (size_t i = 0; i < extents.count; i++) {
+        found.clear();
+        findExtentRecords(options, extents.node(i), extents.nodeSize, found);
+        sink = sink + found.size();
+      }
+    }));
+    results.back().nodes = extents.count;
+    results.back().records = extentRecords.size();
+
+    results.push_back(measure("rejectData", seconds, [&] {
+      for (size_t i = 0; i < data.count; i++) {
+        found.clear();
+        sink = sink + findCatalogRecords(options, data.node(i), data.nodeSize,
+                                         found);
+      }
+    }));
+    results.back().nodes = data.count;
+
+    CatalogRecord record;
+    results.push_back(measure("decodeCatalogRecord", seconds, [&] {
+      for (const char* key : catalogRecords) {
+        sink = sink + decodeCatalogRecord(options, key, record);
+      }
+    }));
+    results.back().records = catalogRecords.size();
+
+    ExtentRecord eds;
+    results.push_back(measure("decodeExtentRecord", seconds, [&] {
+      for (const char* key : extentRecords) {
+        sink = sink + decodeExtentRecord(key, eds);
+      }
+    }));
+    results.back().records = extentRecords.size();
+
+    // The whole of what the scan does with a node, into a fresh index each
+    // time.
+    results.push_back(measure("indexCatalogNode", seconds, [&] {
+      RGS env{options};
+      for (size_t i = 0; i < catalog.count; i++) {
+        indexCatalogNode(env, catalog.node(i), catalog.nodeSize);
+      }
+      sink = sink + env.files.size();
+    }));
+    results.back().nodes = catalog.count;
+    results.back().records = catalogRecords.size();
+
+    results.push_back(measure("indexExtentNode", seconds, [&] {
+      RGS env{options};
+      for (size_t i = 0; i < extents.count; i++) {
+        indexExtentNode(env, extents.node(i), extents.nodeSize);
+      }
+      sink = sink + env.extents.size();
+    }));
+    results.back().nodes = extents.count;
+    results.back().records = extentRecords.size();
+
+    char decoded[kHFSPlusMaxFileNameChars + 1];
+    results.push_back(measure("DecodeBigEndianU16", seconds, [&] {
+      for (size_t i = 0; i < names.size(); i += names[i] + 1) {
+        DecodeBigEndianU16((const char*)&names[i + 1], decoded, names[i]);
+        sink = sink + decoded[0];
+      }
+    }));
+    results.back().names = catalogRecords.size();
+
+    results.push_back(measure("ConvertBigEndianDecodeU16", seconds, [&] {
+      for (size_t i = 0; i < swapped.size(); i += names[i] + 1) {
+        memcpy(&swapped[i + 1], &names[i + 1], names[i] * sizeof(uint16_t));
+        ConvertBigEndian(&swapped[i + 1], names[i]);
+        DecodeU16(&swapped[i + 1], decoded, names[i]);
+        sink = sink + decoded[0];
+      }
+    }));
+    results.back().names = catalogRecords.size();
+
+    if (out) {
+      std::ofstream file(out, std::ios::out | std::ios::trunc);
+      writeReport(file, spec, catalog, extents, results);
+      if (!file) throw std::runtime_error("Couldn't write the report.");
+    } else {
+      writeReport(std::cout, spec, catalog, extents, results);
+    }
+  } catch (const std::exception& err) {
+    std::cerr << err.what() << std::endl;
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,64 @@
+// HFFS (Help find files script)
+// Author: Michael O'Farrell
+
+#include "claims.h"
+
+#include <algorithm>
+
+ClaimedRanges::ClaimedRanges(const Options& options)
+    : blockSize_(options.blockSize),
+      blocks_(options.volumeSize / options.blockSize),
+      origin_(options.volumeOffset), step_(scanStride(options)),
+      skipped_(0) {}
+
+void ClaimedRanges::protect(uint64_t begin, uint64_t end) {
+  if (begin >= end) return;
+  protected_.emplace_back(begin, end);
+  std::sort(protected_.begin(), protected_.end());
+}
+
+void ClaimedRanges::claim(const HFSPlusExtentDescriptor& ed) {
+  uint64_t startBlock = ed.startBlock;
+  uint64_t blockCount = ed.blockCount;
+  if (blockCount == 0 || startBlock + blockCount > blocks_) return;
+  uint64_t begin = origin_ + startBlock * blockSize_;
+  uint64_t end = origin_ + (startBlock + blockCount) * blockSize_;
+
+  // Join any ranges this touches into one.
+  auto it = claimed_.upper_bound(begin);
+  if (it != claimed_.begin()) {
+    auto before = std::prev(it);
+    if (before->second >= begin) {
+      if (before->second >= end) return;
+      begin = before->first;
+      it = before;
+    }
+  }
+  while (it != claimed_.end() && it->first <= end) {
+    end = std::max(end, it->second);
+    it = claimed_.erase(it);
+  }
+  claimed_.emplace(begin, end);
+}
+
+uint64_t ClaimedRanges::next(uint64_t pos) {
+  auto it = claimed_.upper_bound(pos);
+  if (it == claimed_.begin()) return pos;
+  --it;
+  if (it->second <= pos) return pos;
+
+  // Carry on from the first step at or past the end of the file data, unless
+  // a protected range starts before then.
+  uint64_t target = origin_ +
+                    (it->second - origin_ + step_ - 1) / step_ * step_;
+  for (const auto& range : protected_) {
+    if (range.second <= pos) continue;
+    if (range.first <= pos) return pos;
+    target = std::min(target,
+                      origin_ + (range.first - origin_) / step_ * step_);
+    break;
+  }
+  if (target <= pos) return pos;
+  skipped_ += target - pos;
+  return target;
+}
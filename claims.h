@@ -0,0 +1,50 @@
+// HFFS (Help find files script)
+// Author: Michael O'Farrell
+
+#pragma once
+
+#include "rgs.h"
+
+#include <cstdint>
+#include <map>
+#include <utility>
+#include <vector>
+
+// The parts of the image known to hold file data, claimed by the extents of
+// the files found so far.  A scan can step over them rather than look for
+// nodes in every file's contents.  Protected ranges are never stepped over,
+// whatever claims them.
+class ClaimedRanges {
+ public:
+  // For a scan of the volume options describes, in steps of scanStride().
+  explicit ClaimedRanges(const Options& options);
+
+  ClaimedRanges(const ClaimedRanges&) = delete;
+  ClaimedRanges& operator=(const ClaimedRanges&) = delete;
+
+  // Keep scanning bytes [begin, end).
+  void protect(uint64_t begin, uint64_t end);
+
+  // Marks the blocks of ed as file data.  Extents that run off the end of
+  // the image are ignored, they come from damaged records.
+  void claim(const HFSPlusExtentDescriptor& ed);
+
+  // Where a scan at pos should carry on from: past the file data pos is in,
+  // or pos itself if it isn't claimed.
+  uint64_t next(uint64_t pos);
+
+  // Bytes stepped over so far.
+  uint64_t skipped() const { return skipped_; }
+
+ private:
+  uint64_t blockSize_;
+  uint64_t blocks_;
+  // Where the volume starts, steps are counted from here.
+  uint64_t origin_;
+  uint64_t step_;
+  // Disjoint claimed ranges, end by begin, with neighbours joined.
+  std::map<uint64_t, uint64_t> claimed_;
+  // Sorted protected ranges [first, second).
+  std::vector<std::pair<uint64_t, uint64_t>> protected_;
+  uint64_t skipped_;
+};
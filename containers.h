@@ -0,0 +1,205 @@
+// HFFS (Help find files script)
+// Author: Michael O'Farrell
+
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+// A name kept in a StringArena.
+struct Name {
+  uint64_t offset : 48;
+  uint64_t length : 16;
+};
+
+// Names stored back to back in large chunks, so that millions of them don't
+// each need their own allocation.  Names don't span chunks.
+class StringArena {
+ public:
+  StringArena() : used_(0) {}
+
+  Name add(const char* data, size_t length) {
+    // A new chunk is needed once the last is full, which it is exactly when
+    // a name or assign() ended on its end, or if the name doesn't fit in it.
+    uint64_t end = chunks_.size() * kChunkSize;
+    if (used_ == end || (used_ & kChunkMask) + length > kChunkSize) {
+      // The gap left at the end of the last chunk is written out with it in
+      // snapshots, so it is zeroed rather than left as whatever was there.
+      if (used_ != end) memset(at(used_), 0, end - used_);
+      used_ = end;
+      chunks_.emplace_back(new char[kChunkSize]);
+    }
+    memcpy(at(used_), data, length);
+    Name name = {used_, length};
+    used_ += length;
+    return name;
+  }
+  Name add(const std::string& s) { return add(s.data(), s.size()); }
+
+  std::string get(Name name) const {
+    return std::string(at(name.offset), name.length);
+  }
+
+  // Bytes held, for reporting.
+  size_t capacity() const { return chunks_.size() * kChunkSize; }
+
+  // The names as laid out in memory, for writing out.  visit(data, length) is
+  // called on each chunk in turn.  Together they make up size() bytes, which
+  // assign() takes back.
+  uint64_t size() const { return used_; }
+  template<typename Visit>
+  void forEachChunk(Visit visit) const {
+    for (size_t i = 0; i < chunks_.size(); i++) {
+      uint64_t left = used_ - i * kChunkSize;
+      visit(chunks_[i].get(), left < kChunkSize ? left : kChunkSize);
+    }
+  }
+  void assign(const char* data, uint64_t size) {
+    chunks_.clear();
+    for (uint64_t offset = 0; offset < size; offset += kChunkSize) {
+      chunks_.emplace_back(new char[kChunkSize]);
+      uint64_t left = size - offset;
+      memcpy(chunks_.back().get(), data + offset,
+             left < kChunkSize ? left : kChunkSize);
+    }
+    used_ = size;
+  }
+
+ private:
+  // Large enough for any name, which is at most 255 UTF-16 code units.
+  static constexpr uint64_t kChunkSize = 1 << 20;
+  static constexpr uint64_t kChunkMask = kChunkSize - 1;
+
+  char* at(uint64_t offset) const {
+    return chunks_[offset / kChunkSize].get() + (offset & kChunkMask);
+  }
+
+  std::vector<std::unique_ptr<char[]>> chunks_;
+  uint64_t used_;
+};
+
+// An open addressing hash table from integer keys to small values, laid out
+// in a single array.  Probes are linear and the table doubles when it gets
+// three quarters full.  Entries are only ever added.
+template<typename Key, typename Value>
+class FlatHashMap {
+ public:
+  struct Slot {
+    Key key;
+    Value value;
+  };
+
+  FlatHashMap() : size_(0), hasEmptyKey_(false) {}
+
+  size_t size() const { return size_; }
+
+  // Adds key unless it's already there.  Returns false if it was, leaving the
+  // first value in place.
+  bool emplace(Key key, const Value& value) {
+    if (key == kEmpty) {
+      if (hasEmptyKey_) return false;
+      hasEmptyKey_ = true;
+      emptyKeySlot_ = {key, value};
+      size_++;
+      return true;
+    }
+    if ((size_ + 1) * 4 > slots_.size() * 3) {
+      grow();
+    }
+    Slot& slot = probe(key);
+    if (slot.key == key) return false;
+    slot = {key, value};
+    size_++;
+    return true;
+  }
+
+  // The value for key, or null if there is none.
+  Value* find(Key key) {
+    if (key == kEmpty) {
+      return hasEmptyKey_ ? &emptyKeySlot_.value : nullptr;
+    }
+    if (slots_.empty()) return nullptr;
+    Slot& slot = probe(key);
+    return slot.key == key ? &slot.value : nullptr;
+  }
+  const Value* find(Key key) const {
+    return const_cast<FlatHashMap*>(this)->find(key);
+  }
+
+  // Bytes held, for reporting.
+  size_t capacity() const { return slots_.size() * sizeof(Slot); }
+
+  // The table as laid out in memory, for writing out.  The entry for key 0
+  // isn't in it, that is emptyKeySlot() if there is one.
+  const Slot* slots() const { return slots_.data(); }
+  size_t slotCount() const { return slots_.size(); }
+  const Slot* emptyKeySlot() const {
+    return hasEmptyKey_ ? &emptyKeySlot_ : nullptr;
+  }
+  // Takes back a table of count slots, holding size entries, written out from
+  // the above.  count must be zero or a power of two of at least 16.  Returns
+  // false, leaving the map as it was, if no slot is empty, as probes would
+  // never end.
+  bool assign(const Slot* slots, size_t count, size_t size,
+              const Slot* emptyKeySlot) {
+    if (count > 0 &&
+        std::none_of(slots, slots + count,
+                     [](const Slot& slot) { return slot.key == kEmpty; })) {
+      return false;
+    }
+    slots_.assign(slots, slots + count);
+    shift_ = 64;
+    while (count > 1) {
+      count /= 2;
+      shift_--;
+    }
+    size_ = size;
+    hasEmptyKey_ = emptyKeySlot != nullptr;
+    if (hasEmptyKey_) emptyKeySlot_ = *emptyKeySlot;
+    return true;
+  }
+
+ private:
+  // Marks unused slots.  A key that happens to equal it is kept on the side.
+  static constexpr Key kEmpty = 0;
+
+  size_t bucket(Key key) const {
+    // Fibonacci hashing spreads sequential IDs over the table.
+    return (uint64_t)key * 0x9E3779B97F4A7C15ull >> shift_;
+  }
+
+  // The slot holding key, or the empty one it would go in.
+  Slot& probe(Key key) {
+    size_t mask = slots_.size() - 1;
+    for (size_t i = bucket(key);; i = (i + 1) & mask) {
+      if (slots_[i].key == key || slots_[i].key == kEmpty) return slots_[i];
+    }
+  }
+
+  void grow() {
+    std::vector<Slot> old;
+    old.swap(slots_);
+    size_t capacity = old.empty() ? 16 : old.size() * 2;
+    slots_.assign(capacity, Slot{kEmpty, Value()});
+    shift_ = 64;
+    while (capacity > 1) {
+      capacity /= 2;
+      shift_--;
+    }
+    for (const auto& slot : old) {
+      if (slot.key != kEmpty) probe(slot.key) = slot;
+    }
+  }
+
+  std::vector<Slot> slots_;
+  unsigned shift_;
+  size_t size_;
+  bool hasEmptyKey_;
+  Slot emptyKeySlot_;
+};
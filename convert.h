@@ -5,6 +5,10 @@
 
 #include "hfs/hfs_format.h"
 
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
 #ifdef __APPLE__
 
 #include <libkern/OSByteOrder.h>
@@ -234,5 +238,232 @@ inline void DecodeU16(uint16_t* str, char* out, size_t len) {
   *out = '\0';
 }
 
+///////////////////////////////////////////////////////////////////////////////
+// Loading from the on disk bytes rather than converting them in place.  These
+// leave the bytes untouched, so they work on read only or shared memory, and
+// don't care about alignment.
+
+inline uint16_t LoadBigEndian16(const char* p) {
+  uint16_t x;
+  memcpy(&x, p, sizeof(x));
+  ConvertBigEndian(&x);
+  return x;
+}
+inline uint32_t LoadBigEndian32(const char* p) {
+  uint32_t x;
+  memcpy(&x, p, sizeof(x));
+  ConvertBigEndian(&x);
+  return x;
+}
+inline uint64_t LoadBigEndian64(const char* p) {
+  uint64_t x;
+  memcpy(&x, p, sizeof(x));
+  ConvertBigEndian(&x);
+  return x;
+}
+
+// Like DecodeU16, for a name still in HFSPlus byte order.
+inline void DecodeBigEndianU16(const char* str, char* out, size_t len) {
+  while (len > 0) {
+    *out = str[1];
+    str += sizeof(uint16_t);
+    out++;
+    len--;
+  }
+  *out = '\0';
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Views over on disk structures.  Each wraps a pointer to the raw bytes and
+// swaps fields to host order as they are read.
+
+#define HFFS_FIELD(type, name) (p_ + offsetof(type, name))
+
+class BTNodeDescriptorView {
+ public:
+  explicit BTNodeDescriptorView(const char* p) : p_(p) {}
+
+  uint32_t fLink() const {
+    return LoadBigEndian32(HFFS_FIELD(BTNodeDescriptor, fLink));
+  }
+  uint32_t bLink() const {
+    return LoadBigEndian32(HFFS_FIELD(BTNodeDescriptor, bLink));
+  }
+  int8_t kind() const {
+    return *HFFS_FIELD(BTNodeDescriptor, kind);
+  }
+  uint8_t height() const {
+    return *HFFS_FIELD(BTNodeDescriptor, height);
+  }
+  uint16_t numRecords() const {
+    return LoadBigEndian16(HFFS_FIELD(BTNodeDescriptor, numRecords));
+  }
+
+ private:
+  const char* p_;
+};
+
+class BTHeaderRecView {
+ public:
+  explicit BTHeaderRecView(const char* p) : p_(p) {}
+
+  uint16_t treeDepth() const {
+    return LoadBigEndian16(HFFS_FIELD(BTHeaderRec, treeDepth));
+  }
+  uint32_t leafRecords() const {
+    return LoadBigEndian32(HFFS_FIELD(BTHeaderRec, leafRecords));
+  }
+  uint32_t firstLeafNode() const {
+    return LoadBigEndian32(HFFS_FIELD(BTHeaderRec, firstLeafNode));
+  }
+  uint32_t lastLeafNode() const {
+    return LoadBigEndian32(HFFS_FIELD(BTHeaderRec, lastLeafNode));
+  }
+  uint16_t nodeSize() const {
+    return LoadBigEndian16(HFFS_FIELD(BTHeaderRec, nodeSize));
+  }
+  uint16_t maxKeyLength() const {
+    return LoadBigEndian16(HFFS_FIELD(BTHeaderRec, maxKeyLength));
+  }
+  uint32_t totalNodes() const {
+    return LoadBigEndian32(HFFS_FIELD(BTHeaderRec, totalNodes));
+  }
+  uint32_t freeNodes() const {
+    return LoadBigEndian32(HFFS_FIELD(BTHeaderRec, freeNodes));
+  }
+
+ private:
+  const char* p_;
+};
+
+class ExtentDescriptorsView {
+ public:
+  explicit ExtentDescriptorsView(const char* p) : p_(p) {}
+
+  HFSPlusExtentDescriptor operator[](size_t i) const {
+    const char* ed = p_ + i * sizeof(HFSPlusExtentDescriptor);
+    HFSPlusExtentDescriptor result;
+    result.startBlock = LoadBigEndian32(
+        ed + offsetof(HFSPlusExtentDescriptor, startBlock));
+    result.blockCount = LoadBigEndian32(
+        ed + offsetof(HFSPlusExtentDescriptor, blockCount));
+    return result;
+  }
+
+ private:
+  const char* p_;
+};
+
+class ForkDataView {
+ public:
+  explicit ForkDataView(const char* p) : p_(p) {}
+
+  uint64_t logicalSize() const {
+    return LoadBigEndian64(HFFS_FIELD(HFSPlusForkData, logicalSize));
+  }
+  uint32_t totalBlocks() const {
+    return LoadBigEndian32(HFFS_FIELD(HFSPlusForkData, totalBlocks));
+  }
+  ExtentDescriptorsView extents() const {
+    return ExtentDescriptorsView(HFFS_FIELD(HFSPlusForkData, extents));
+  }
+
+ private:
+  const char* p_;
+};
+
+class CatalogKeyView {
+ public:
+  explicit CatalogKeyView(const char* p) : p_(p) {}
+
+  uint16_t keyLength() const {
+    return LoadBigEndian16(HFFS_FIELD(HFSPlusCatalogKey, keyLength));
+  }
+  uint32_t parentID() const {
+    return LoadBigEndian32(HFFS_FIELD(HFSPlusCatalogKey, parentID));
+  }
+  uint16_t nameLength() const {
+    return LoadBigEndian16(HFFS_FIELD(HFSPlusCatalogKey, nodeName.length));
+  }
+  // Writes the name into out, which needs room for nameLength() + 1 chars.
+  void decodeName(char* out) const {
+    DecodeBigEndianU16(HFFS_FIELD(HFSPlusCatalogKey, nodeName.unicode), out,
+                       nameLength());
+  }
+  // The record following the key.
+  const char* record() const {
+    return p_ + keyLength() + sizeof(uint16_t);
+  }
+
+ private:
+  const char* p_;
+};
+
+class CatalogFolderView {
+ public:
+  explicit CatalogFolderView(const char* p) : p_(p) {}
+
+  int16_t recordType() const {
+    return LoadBigEndian16(HFFS_FIELD(HFSPlusCatalogFolder, recordType));
+  }
+  uint32_t folderID() const {
+    return LoadBigEndian32(HFFS_FIELD(HFSPlusCatalogFolder, folderID));
+  }
+  uint32_t contentModDate() const {
+    return LoadBigEndian32(HFFS_FIELD(HFSPlusCatalogFolder, contentModDate));
+  }
+
+ private:
+  const char* p_;
+};
+
+class CatalogFileView {
+ public:
+  explicit CatalogFileView(const char* p) : p_(p) {}
+
+  int16_t recordType() const {
+    return LoadBigEndian16(HFFS_FIELD(HFSPlusCatalogFile, recordType));
+  }
+  uint32_t fileID() const {
+    return LoadBigEndian32(HFFS_FIELD(HFSPlusCatalogFile, fileID));
+  }
+  uint32_t contentModDate() const {
+    return LoadBigEndian32(HFFS_FIELD(HFSPlusCatalogFile, contentModDate));
+  }
+  ForkDataView dataFork() const {
+    return ForkDataView(HFFS_FIELD(HFSPlusCatalogFile, dataFork));
+  }
+
+ private:
+  const char* p_;
+};
+
+class ExtentKeyView {
+ public:
+  explicit ExtentKeyView(const char* p) : p_(p) {}
+
+  uint16_t keyLength() const {
+    return LoadBigEndian16(HFFS_FIELD(HFSPlusExtentKey, keyLength));
+  }
+  uint8_t forkType() const {
+    return *HFFS_FIELD(HFSPlusExtentKey, forkType);
+  }
+  uint32_t fileID() const {
+    return LoadBigEndian32(HFFS_FIELD(HFSPlusExtentKey, fileID));
+  }
+  uint32_t startBlock() const {
+    return LoadBigEndian32(HFFS_FIELD(HFSPlusExtentKey, startBlock));
+  }
+  // The extent record following the key.
+  ExtentDescriptorsView record() const {
+    return ExtentDescriptorsView(p_ + sizeof(HFSPlusExtentKey));
+  }
+
+ private:
+  const char* p_;
+};
+
+#undef HFFS_FIELD
+
 #pragma clang diagnostic pop
 
@@ -0,0 +1,212 @@
+// HFFS (Help find files script)
+// Author: Michael O'Farrell
+
+#include "copy.h"
+
+#include "trace.h"
+
+#include <errno.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+#include <algorithm>
+#include <stdexcept>
+
+namespace {
+
+// Errors meaning the engine can't be used for these files at all, rather than
+// that this particular copy went wrong.  The engine is given up on for the
+// rest of the run.
+bool unsupported(int error) {
+  return error == EOPNOTSUPP || error == ENOTTY || error == EXDEV ||
+         error == ENOSYS;
+}
+
+// Errors meaning the engine won't take this particular copy, such as a range
+// it doesn't like.  Unless the engine was picked, only this copy falls back
+// to another engine.
+bool unsuitable(int error) {
+  return error == EINVAL;
+}
+
+}  // namespace
+///////////////////////////////////////////////////////////////////////////////
+
+FileCopier::FileCopier(CopyEngine engine)
+    : engine_(engine),
+      tryReflink_(engine == kCopyAuto || engine == kCopyReflink),
+      tryCopyRange_(engine == kCopyAuto || engine == kCopyRange),
+      reflinked_(0), copiedInKernel_(0), copiedThroughBuffer_(0) {}
+
+uint64_t FileCopier::copyInKernel(int infd, uint64_t inOffset, int outfd,
+                                  uint64_t outOffset, uint64_t length) {
+  TraceSpan span("copy-in-kernel");
+  uint64_t copied = 0;
+  if (tryReflink_) {
+    copied = reflink(infd, inOffset, outfd, outOffset, length);
+  }
+  if (copied < length && tryCopyRange_) {
+    copied += copyRange(infd, inOffset + copied, outfd, outOffset + copied,
+                        length - copied);
+  }
+  return copied;
+}
+
+// Reflinks as much of the range as lines up with the output's blocks, and
+// returns how much that was.  The unaligned tail of a file is left for the
+// other engines.
+uint64_t FileCopier::reflink(int infd, uint64_t inOffset, int outfd,
+                             uint64_t outOffset, uint64_t length) {
+#ifdef FICLONERANGE
+  struct stat st;
+  if (fstat(outfd, &st) < 0 || st.st_blksize <= 0) return 0;
+  uint64_t align = st.st_blksize;
+  if (inOffset % align != 0 || outOffset % align != 0) return 0;
+  length -= length % align;
+  if (length == 0) return 0;
+
+  struct file_clone_range range;
+  range.src_fd = infd;
+  range.src_offset = inOffset;
+  range.src_length = length;
+  range.dest_offset = outOffset;
+  if (ioctl(outfd, FICLONERANGE, &range) == 0) {
+    reflinked_ += length;
+    return length;
+  }
+  if (unsuitable(errno) && engine_ == kCopyAuto) return 0;
+  if (!unsupported(errno)) {
+    throw std::runtime_error("Failed to reflink.");
+  }
+#endif
+  if (engine_ == kCopyReflink) {
+    throw std::runtime_error(
+        "Couldn't reflink, the image and output folder need to be on the "
+        "same btrfs or XFS filesystem.");
+  }
+  tryReflink_ = false;
+  return 0;
+}
+
+// Has the kernel copy the range, and returns how much it copied.  Returns
+// short if the kernel can't copy between these files, or won't take this
+// range.
+uint64_t FileCopier::copyRange(int infd, uint64_t inOffset, int outfd,
+                               uint64_t outOffset, uint64_t length) {
+  uint64_t copied = 0;
+#ifdef SYS_copy_file_range
+  bool supported = true;
+  while (copied < length) {
+    loff_t in = inOffset + copied;
+    loff_t out = outOffset + copied;
+    ssize_t bytes = syscall(SYS_copy_file_range, infd, &in, outfd, &out,
+                            (size_t)(length - copied), 0u);
+    if (bytes > 0) {
+      copied += bytes;
+      continue;
+    }
+    if (bytes == 0) {
+      throw std::runtime_error("Failed to read.");
+    }
+    if (unsuitable(errno) && engine_ == kCopyAuto) break;
+    if (copied > 0 || !unsupported(errno)) {
+      throw std::runtime_error("Failed to write.");
+    }
+    supported = false;
+    break;
+  }
+  copiedInKernel_ += copied;
+  if (supported) return copied;
+#endif
+  if (engine_ == kCopyRange) {
+    throw std::runtime_error(
+        "Couldn't copy in the kernel, copy_file_range isn't supported here.");
+  }
+  tryCopyRange_ = false;
+  return copied;
+}
+
+CopyQueue::CopyQueue(FileCopier& copier, const Options& options,
+                     Histogram* readLatency)
+    : copier_(copier), options_(options), readLatency_(readLatency) {}
+
+CopyQueue::~CopyQueue() {
+  // The buffers can't go while the kernel might still use them.
+  while (io_ && io_->outstanding() > 0) {
+    io_->wait();
+  }
+}
+
+void CopyQueue::copy(int infd, uint64_t inOffset, int outfd,
+                     uint64_t outOffset, uint64_t length,
+                     std::function<void()> done) {
+  uint64_t copied = copier_.copyInKernel(infd, inOffset, outfd, outOffset,
+                                         length);
+  if (copied == length) {
+    done();
+    return;
+  }
+  inOffset += copied;
+  outOffset += copied;
+  length -= copied;
+
+  if (!io_) {
+    io_ = openAsyncIo(options_.queueDepth, options_.ioUring);
+    if (readLatency_) io_->timeReads(readLatency_);
+    pieces_.resize(io_->depth());
+    for (size_t i = 0; i < io_->depth(); i++) {
+      buffers_.emplace_back(new IoBuffer(options_.ioSize));
+      free_.push_back(i);
+    }
+  }
+
+  std::shared_ptr<Copy> c(new Copy{std::move(done), 0});
+  c->pieces = (length + options_.ioSize - 1) / options_.ioSize;
+  for (uint64_t offset = 0; offset < length; offset += options_.ioSize) {
+    while (free_.empty()) {
+      complete();
+    }
+    size_t i = free_.back();
+    free_.pop_back();
+    size_t pieceLength = std::min<uint64_t>(options_.ioSize, length - offset);
+    pieces_[i] = {c, outfd, outOffset + offset, pieceLength, false};
+    io_->read(infd, buffers_[i]->data(), pieceLength, inOffset + offset,
+              &pieces_[i]);
+    io_->submit();
+  }
+}
+
+void CopyQueue::finish() {
+  while (io_ && io_->outstanding() > 0) {
+    complete();
+  }
+}
+
+void CopyQueue::complete() {
+  IoCompletion completion = io_->wait();
+  Piece& piece = *(Piece*)completion.tag;
+  size_t i = &piece - pieces_.data();
+  if (completion.result != (ssize_t)piece.length) {
+    throw std::runtime_error(piece.written ? "Failed to write." :
+                                             "Failed to read.");
+  }
+  if (!piece.written) {
+    piece.written = true;
+    io_->write(piece.outfd, buffers_[i]->data(), piece.length,
+               piece.outOffset, &piece);
+    io_->submit();
+    return;
+  }
+  copier_.addCopiedThroughBuffer(piece.length);
+  std::shared_ptr<Copy> c = std::move(piece.copy);
+  free_.push_back(i);
+  if (--c->pieces == 0) {
+    c->done();
+  }
+}
@@ -0,0 +1,99 @@
+// HFFS (Help find files script)
+// Author: Michael O'Farrell
+
+#pragma once
+
+#include "aio.h"
+#include "image.h"
+#include "rgs.h"
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <vector>
+
+// Copies ranges of the image into output files.  Where the kernel can, it
+// does the copy itself: reflinking the blocks (btrfs, XFS) shares them with
+// the image without copying at all, and copy_file_range() copies without the
+// data passing through user space.  Whatever the kernel can't copy is left to
+// a CopyQueue.  Safe to use from several threads at once.
+class FileCopier {
+ public:
+  explicit FileCopier(CopyEngine engine);
+
+  // Has the kernel copy as much as it can of the length bytes at inOffset in
+  // infd to outOffset in outfd.  Returns how many bytes from the start of the
+  // range were copied.
+  uint64_t copyInKernel(int infd, uint64_t inOffset, int outfd,
+                        uint64_t outOffset, uint64_t length);
+
+  // Bytes copied by each engine so far.
+  uint64_t reflinked() const { return reflinked_; }
+  uint64_t copiedInKernel() const { return copiedInKernel_; }
+  uint64_t copiedThroughBuffer() const { return copiedThroughBuffer_; }
+  void addCopiedThroughBuffer(uint64_t bytes) { copiedThroughBuffer_ += bytes; }
+
+ private:
+  uint64_t reflink(int infd, uint64_t inOffset, int outfd, uint64_t outOffset,
+                   uint64_t length);
+  uint64_t copyRange(int infd, uint64_t inOffset, int outfd,
+                     uint64_t outOffset, uint64_t length);
+
+  CopyEngine engine_;
+  // Cleared for good the first time the kernel refuses.
+  std::atomic<bool> tryReflink_;
+  std::atomic<bool> tryCopyRange_;
+  std::atomic<uint64_t> reflinked_;
+  std::atomic<uint64_t> copiedInKernel_;
+  std::atomic<uint64_t> copiedThroughBuffer_;
+};
+
+// A save thread's copies.  The kernel is asked first, and what it can't copy
+// is read and written in pieces of up to --io-size bytes, with up to
+// --queue-depth pieces in flight at once.
+class CopyQueue {
+ public:
+  // Reads are timed into readLatency, if given.
+  CopyQueue(FileCopier& copier, const Options& options,
+            Histogram* readLatency);
+  ~CopyQueue();
+
+  CopyQueue(const CopyQueue&) = delete;
+  CopyQueue& operator=(const CopyQueue&) = delete;
+
+  // Copies length bytes at inOffset in infd to outOffset in outfd.  done is
+  // called once it has all been written, which may be during a later call.
+  void copy(int infd, uint64_t inOffset, int outfd, uint64_t outOffset,
+            uint64_t length, std::function<void()> done);
+
+  // Waits for every copy to be written.
+  void finish();
+
+ private:
+  struct Copy {
+    std::function<void()> done;
+    size_t pieces;
+  };
+
+  // A piece of a copy being read into, or written from, its buffer.
+  struct Piece {
+    std::shared_ptr<Copy> copy;
+    int outfd;
+    uint64_t outOffset;
+    size_t length;
+    bool written;
+  };
+
+  // Handles the next read or write to finish.
+  void complete();
+
+  FileCopier& copier_;
+  const Options& options_;
+  Histogram* readLatency_;
+  // Opened when first needed, most copies are done by the kernel.
+  std::unique_ptr<AsyncIo> io_;
+  std::vector<Piece> pieces_;
+  std::vector<std::unique_ptr<IoBuffer>> buffers_;
+  std::vector<size_t> free_;
+};
@@ -0,0 +1,487 @@
+// HFFS (Help find files script)
+// Author: Michael O'Farrell
+
+#include "detect.h"
+
+#include "convert.h"
+#include "hfs/hfs_format.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <initializer_list>
+#include <iostream>
+#include <set>
+#include <string>
+#include <vector>
+
+namespace {
+
+// Node sizes are powers of two from 512 bytes to 32KiB.
+constexpr uint64_t kMinNodeSize = 512;
+constexpr uint64_t kMaxNodeSize = 32768;
+
+// The block sizes file records can vote for, as powers of two.
+constexpr unsigned kMinBlockShift = 9;
+constexpr unsigned kMaxBlockShift = 16;
+// The sizes nearly every volume has: 4KiB blocks, 8KiB catalog nodes and 4KiB
+// extents nodes.  When the votes fit other sizes as well as these, these are
+// picked.
+constexpr unsigned kUsualBlockShift = 12;
+constexpr unsigned kUsualCatalogNodeShift = 13;
+constexpr unsigned kUsualExtentNodeShift = 12;
+
+// Samples are read kSampleSize bytes at a time.  The catalog usually starts
+// near the front of the volume, behind the allocation file, and copies of it
+// turn up near the end, so each of those gets kEdgeSamples spread over its
+// first and last kEdgeSize bytes.  kSpreadSamples more are spread over the
+// whole volume.
+constexpr uint64_t kSampleSize = 256 << 10;
+constexpr uint64_t kEdgeSize = 2ull << 30;
+constexpr uint64_t kEdgeSamples = 64;
+constexpr uint64_t kSpreadSamples = 128;
+
+// Sampling stops once every size being looked for has this many votes.
+constexpr size_t kEnoughVotes = 64;
+
+enum Confidence { kGuessed, kLow, kMedium, kHigh, kGiven };
+
+const char* confidenceName(Confidence confidence) {
+  switch (confidence) {
+    case kGuessed: return "guessed";
+    case kLow: return "low confidence";
+    case kMedium: return "medium confidence";
+    case kHigh: return "high confidence";
+    case kGiven: return "given";
+  }
+  return "";
+}
+
+// A size, how sure we are of it and why.
+struct Found {
+  uint64_t size;
+  Confidence confidence;
+  std::string why;
+};
+
+bool isPowerOfTwo(uint64_t x) {
+  return x != 0 && (x & (x - 1)) == 0;
+}
+
+// Votes for powers of two, by shift.  Each voter votes for every size it
+// fits.
+struct Votes {
+  size_t counts[64];
+  size_t total;
+
+  Votes() : total(0) {
+    std::fill(counts, counts + 64, 0);
+  }
+
+  void add(unsigned first, unsigned last) {
+    for (unsigned shift = first; shift <= last; shift++) counts[shift]++;
+    total++;
+  }
+  void add(unsigned shift) { add(shift, shift); }
+
+  // Fills in found with the size most voters fit, going with preferred
+  // among sizes that fit as many.  Returns false if nobody voted.
+  bool decide(Found& found, const char* voters, unsigned preferred) const {
+    if (total == 0) return false;
+    unsigned shift = std::max_element(counts, counts + 64) - counts;
+    size_t count = counts[shift];
+    if (counts[preferred] == count) shift = preferred;
+    size_t runnerUp = 0;
+    for (unsigned i = 0; i < 64; i++) {
+      if (i != shift) runnerUp = std::max(runnerUp, counts[i]);
+    }
+    found.size = 1ull << shift;
+    if (runnerUp == count) {
+      found.confidence = kLow;
+    } else if (count >= 16 && count * 10 >= total * 9 &&
+               runnerUp * 10 < count * 9) {
+      found.confidence = kHigh;
+    } else if (count >= 4 && count * 4 >= total * 3) {
+      found.confidence = kMedium;
+    } else {
+      found.confidence = kLow;
+    }
+    found.why = std::to_string(count) + " of " + std::to_string(total) +
+                " " + voters;
+    if (runnerUp == count) found.why += ", other sizes fit as many";
+    return true;
+  }
+};
+
+unsigned shiftOf(uint64_t x) {
+  unsigned shift = 0;
+  while ((1ull << shift) < x) shift++;
+  return shift;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// The volume headers.
+
+// The node size from the B-tree header node at the start of fork, or 0 if
+// there isn't a plausible one there.
+uint64_t headerNodeSize(int fd, const Options& options, uint64_t blockSize,
+                        const HFSPlusForkData& fork, uint16_t maxKeyLength) {
+  const HFSPlusExtentDescriptor& first = fork.extents[0];
+  uint64_t offset = options.volumeOffset + first.startBlock * blockSize;
+  char header[sizeof(BTNodeDescriptor) + sizeof(BTHeaderRec)];
+  if (first.blockCount == 0 ||
+      offset + sizeof(header) > volumeEnd(options) ||
+      pread(fd, header, sizeof(header), offset) != (ssize_t)sizeof(header)) {
+    return 0;
+  }
+  BTNodeDescriptorView descriptor(header);
+  BTHeaderRecView rec(header + sizeof(BTNodeDescriptor));
+  uint64_t nodeSize = rec.nodeSize();
+  if (descriptor.kind() != kBTHeaderNode || descriptor.height() != 0 ||
+      nodeSize < kMinNodeSize || nodeSize > kMaxNodeSize ||
+      !isPowerOfTwo(nodeSize) || rec.maxKeyLength() != maxKeyLength ||
+      (uint64_t)rec.totalNodes() * nodeSize > fork.logicalSize) {
+    return 0;
+  }
+  return nodeSize;
+}
+
+bool usableHeader(const HFSPlusVolumeHeader& header) {
+  return (header.signature == kHFSPlusSigWord ||
+          header.signature == kHFSXSigWord) &&
+         header.blockSize >= kMinNodeSize && isPowerOfTwo(header.blockSize);
+}
+
+const char* headerName(int i) {
+  return i == 0 ? "main volume header" : "alternate volume header";
+}
+
+// Takes the block size from the volume headers.  A header the other agrees
+// with, or whose catalog header node is where it says, is believed.
+bool blockSizeFromHeaders(int fd, const Options& options,
+                          const HFSPlusVolumeHeader* headers,
+                          const bool* usable, Found& found) {
+  if (usable[0] && usable[1] &&
+      headers[0].blockSize == headers[1].blockSize) {
+    found = {headers[0].blockSize, kHigh, "both volume headers"};
+    return true;
+  }
+  for (int i = 0; i < 2; i++) {
+    if (usable[i] &&
+        headerNodeSize(fd, options, headers[i].blockSize,
+                       headers[i].catalogFile,
+                       kHFSPlusCatalogKeyMaximumLength) != 0) {
+      found = {headers[i].blockSize, kMedium,
+               std::string(headerName(i)) + " and its catalog header node"};
+      return true;
+    }
+  }
+  for (int i = 0; i < 2; i++) {
+    if (usable[i]) {
+      found = {headers[i].blockSize, kLow, headerName(i)};
+      return true;
+    }
+  }
+  return false;
+}
+
+// Takes a node size from the header nodes of one of the B-tree files.
+bool nodeSizeFromHeaders(int fd, const Options& options, uint64_t blockSize,
+                         const HFSPlusVolumeHeader* headers,
+                         const bool* usable, bool catalog, Found& found) {
+  uint64_t nodeSizes[2] = {0, 0};
+  for (int i = 0; i < 2; i++) {
+    if (!usable[i]) continue;
+    nodeSizes[i] = catalog ?
+        headerNodeSize(fd, options, blockSize, headers[i].catalogFile,
+                       kHFSPlusCatalogKeyMaximumLength) :
+        headerNodeSize(fd, options, blockSize, headers[i].extentsFile,
+                       kHFSPlusExtentKeyMaximumLength);
+  }
+  std::string node = catalog ? "catalog" : "extents";
+  if (nodeSizes[0] != 0 && nodeSizes[0] == nodeSizes[1]) {
+    found = {nodeSizes[0], kHigh,
+             node + " header node, through both volume headers"};
+    return true;
+  }
+  for (int i = 0; i < 2; i++) {
+    if (nodeSizes[i] != 0) {
+      // Header nodes that disagree leave some doubt.
+      found = {nodeSizes[i], nodeSizes[1 - i] != 0 ? kMedium : kHigh,
+               node + " header node, through the " + headerName(i)};
+      return true;
+    }
+  }
+  return false;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Sampling the volume.
+
+// Checks the offset table at the end of a leaf node of nodeSize bytes: the
+// first record starts just past the descriptor, each record starts after the
+// one before, and the free space is in front of the table.
+bool leafFits(const char* node, uint64_t nodeSize, uint16_t numRecords) {
+  uint64_t tableSize = sizeof(uint16_t) * (numRecords + 1);
+  if (sizeof(BTNodeDescriptor) + tableSize > nodeSize) return false;
+  const char* table = node + nodeSize;
+  uint16_t previous = LoadBigEndian16(table - sizeof(uint16_t));
+  if (previous != sizeof(BTNodeDescriptor)) return false;
+  for (uint16_t i = 1; i <= numRecords; i++) {
+    uint16_t offset = LoadBigEndian16(table - sizeof(uint16_t) * (i + 1));
+    if (offset <= previous) return false;
+    previous = offset;
+  }
+  return previous <= nodeSize - tableSize;
+}
+
+// Record i of a leaf node that leafFits(), as [begin, end) offsets.
+uint16_t recordBegin(const char* node, uint64_t nodeSize, uint16_t i) {
+  return LoadBigEndian16(node + nodeSize - sizeof(uint16_t) * (i + 1));
+}
+
+enum Tree { kNoTree, kCatalogTree, kExtentsTree };
+
+// Which tree a leaf node belongs to, going by its first record.
+Tree leafTree(const char* node, uint64_t nodeSize) {
+  uint16_t begin = recordBegin(node, nodeSize, 0);
+  uint16_t length = recordBegin(node, nodeSize, 1) - begin;
+  const char* key = node + begin;
+  uint16_t keyLength = LoadBigEndian16(key);
+  if (keyLength == kHFSPlusExtentKeyMaximumLength &&
+      length == sizeof(HFSPlusExtentKey) + sizeof(HFSPlusExtentRecord)) {
+    return kExtentsTree;
+  }
+  if (keyLength >= kHFSPlusCatalogKeyMinimumLength &&
+      keyLength <= kHFSPlusCatalogKeyMaximumLength &&
+      length >= sizeof(uint16_t) + keyLength + sizeof(int16_t)) {
+    int16_t recordType = LoadBigEndian16(CatalogKeyView(key).record());
+    if (recordType >= kHFSPlusFolderRecord &&
+        recordType <= kHFSPlusFileThreadRecord) {
+      return kCatalogTree;
+    }
+  }
+  return kNoTree;
+}
+
+// A file's data fork votes for the block sizes that fit it: its blocks hold
+// its bytes with less than a block to spare, and its extents lie within the
+// volume of size bytes.
+void voteBlockSize(const ForkDataView& fork, uint64_t size, Votes& votes) {
+  uint64_t logicalSize = fork.logicalSize();
+  uint64_t totalBlocks = fork.totalBlocks();
+  if (logicalSize == 0 || totalBlocks == 0) return;
+  uint64_t end = 0;
+  for (size_t i = 0; i < kHFSPlusExtentDensity; i++) {
+    HFSPlusExtentDescriptor ed = fork.extents()[i];
+    if (ed.blockCount == 0) continue;
+    end = std::max(end, (uint64_t)ed.startBlock + ed.blockCount);
+  }
+  unsigned first = 0;
+  unsigned last = 0;
+  for (unsigned shift = kMinBlockShift; shift <= kMaxBlockShift; shift++) {
+    uint64_t blockSize = 1ull << shift;
+    if ((totalBlocks - 1) * blockSize < logicalSize &&
+        logicalSize <= totalBlocks * blockSize && end * blockSize <= size) {
+      if (first == 0) first = shift;
+      last = shift;
+    }
+  }
+  if (first != 0) votes.add(first, last);
+}
+
+void voteBlockSizes(const char* node, uint64_t nodeSize, uint16_t numRecords,
+                    uint64_t size, Votes& votes) {
+  for (uint16_t i = 0; i < numRecords; i++) {
+    uint16_t begin = recordBegin(node, nodeSize, i);
+    uint16_t end = recordBegin(node, nodeSize, i + 1);
+    CatalogKeyView key(node + begin);
+    const char* record = key.record();
+    if (record + sizeof(HFSPlusCatalogFile) > node + end) continue;
+    CatalogFileView file(record);
+    if (file.recordType() != kHFSPlusFileRecord) continue;
+    voteBlockSize(file.dataFork(), size, votes);
+  }
+}
+
+struct Sampled {
+  Votes catalogNodes;
+  Votes extentNodes;
+  Votes blocks;
+  uint64_t bytes = 0;
+};
+
+// Where in a volume of size bytes the samples are read from, the front of it
+// first.
+std::vector<uint64_t> sampleOffsets(uint64_t size) {
+  std::vector<uint64_t> offsets;
+  std::set<uint64_t> seen;
+  auto spread = [&](uint64_t begin, uint64_t end, uint64_t count) {
+    for (uint64_t i = 0; i < count; i++) {
+      uint64_t offset = (begin + (end - begin) / count * i) / kSampleSize *
+                        kSampleSize;
+      if (offset < size && seen.insert(offset).second) {
+        offsets.push_back(offset);
+      }
+    }
+  };
+  uint64_t edge = std::min(size, kEdgeSize);
+  spread(0, edge, kEdgeSamples);
+  spread(size - edge, size, kEdgeSamples);
+  spread(0, size, kSpreadSamples);
+  return offsets;
+}
+
+// Reads samples of the volume and has every leaf node in them vote.  want
+// says which of the block size, catalog and extents node sizes are needed.
+void sampleVolume(int fd, const Options& options, const bool* want,
+                  Sampled& sampled) {
+  uint64_t size = options.volumeSize;
+  std::vector<char> buffer(kSampleSize + kMaxNodeSize);
+  for (uint64_t offset : sampleOffsets(size)) {
+    if ((!want[0] || sampled.blocks.total >= kEnoughVotes) &&
+        (!want[1] || sampled.catalogNodes.total >= kEnoughVotes) &&
+        (!want[2] || sampled.extentNodes.total >= kEnoughVotes)) {
+      break;
+    }
+    uint64_t length = std::min<uint64_t>(buffer.size(), size - offset);
+    ssize_t got = pread(fd, buffer.data(), length,
+                        options.volumeOffset + offset);
+    if (got <= 0) continue;
+    sampled.bytes += std::min((uint64_t)got, kSampleSize);
+
+    for (uint64_t pos = 0;
+         pos < kSampleSize && pos + kMinNodeSize <= (uint64_t)got;
+         pos += kMinNodeSize) {
+      const char* node = buffer.data() + pos;
+      BTNodeDescriptorView descriptor(node);
+      if (descriptor.kind() != kBTLeafNode || descriptor.height() != 1) {
+        continue;
+      }
+      uint16_t numRecords = descriptor.numRecords();
+      if (numRecords == 0) continue;
+      for (uint64_t nodeSize = kMinNodeSize;
+           nodeSize <= kMaxNodeSize && pos + nodeSize <= (uint64_t)got;
+           nodeSize <<= 1) {
+        if (!leafFits(node, nodeSize, numRecords)) continue;
+        switch (leafTree(node, nodeSize)) {
+          case kCatalogTree:
+            sampled.catalogNodes.add(shiftOf(nodeSize));
+            voteBlockSizes(node, nodeSize, numRecords, size,
+                           sampled.blocks);
+            break;
+          case kExtentsTree:
+            sampled.extentNodes.add(shiftOf(nodeSize));
+            break;
+          case kNoTree:
+            break;
+        }
+        // Nodes that follow on from this one fit twice its size, and
+        // four times, just as well.
+        break;
+      }
+    }
+  }
+}
+
+void printFound(const char* name, const Found& found) {
+  std::cout << "  " << name << ": ";
+  if (found.size == 0) {
+    std::cout << "unknown" << std::endl;
+    return;
+  }
+  std::cout << found.size << " (" << confidenceName(found.confidence);
+  if (!found.why.empty()) std::cout << ", " << found.why;
+  std::cout << ")" << std::endl;
+}
+
+}  // namespace
+///////////////////////////////////////////////////////////////////////////////
+
+bool detectSizes(Options& options) {
+  auto start = std::chrono::steady_clock::now();
+  int fd = open(options.infile, O_RDONLY);
+  if (fd < 0) {
+    std::cerr << "Failed to open image " << options.infile << std::endl;
+    return options.blockSize != 0;
+  }
+
+  Found blockSize{0, kGiven, ""};
+  Found catalogNodeSize{0, kGiven, ""};
+  Found extentNodeSize{0, kGiven, ""};
+  blockSize.size = options.blockSize;
+  catalogNodeSize.size = options.catalogNodeSize;
+  extentNodeSize.size = options.extentNodeSize;
+
+  HFSPlusVolumeHeader headers[2];
+  bool usable[2] = {false, false};
+  uint64_t headerOffsets[2] = {
+      options.volumeOffset + 2 * options.sectorSize,
+      volumeEnd(options) - 2 * options.sectorSize};
+  for (int i = 0; i < 2 && options.volumeSize >= 4 * options.sectorSize;
+       i++) {
+    if (pread(fd, &headers[i], sizeof(HFSPlusVolumeHeader),
+              headerOffsets[i]) != (ssize_t)sizeof(HFSPlusVolumeHeader)) {
+      continue;
+    }
+    ConvertBigEndian(&headers[i]);
+    usable[i] = usableHeader(headers[i]);
+  }
+
+  if (blockSize.size == 0) {
+    blockSizeFromHeaders(fd, options, headers, usable, blockSize);
+  }
+  if (catalogNodeSize.size == 0 && blockSize.size != 0) {
+    nodeSizeFromHeaders(fd, options, blockSize.size, headers, usable, true,
+                        catalogNodeSize);
+  }
+  if (extentNodeSize.size == 0 && blockSize.size != 0) {
+    nodeSizeFromHeaders(fd, options, blockSize.size, headers, usable, false,
+                        extentNodeSize);
+  }
+
+  // Whatever the headers couldn't tell us, the leaf nodes might.
+  bool want[3] = {blockSize.size == 0, catalogNodeSize.size == 0,
+                  extentNodeSize.size == 0};
+  if (want[0] || want[1] || want[2]) {
+    Sampled sampled;
+    sampleVolume(fd, options, want, sampled);
+    std::cout << "Sampled " << sampled.bytes << " bytes of the volume."
+              << std::endl;
+    if (want[0]) {
+      sampled.blocks.decide(blockSize, "sampled file records",
+                            kUsualBlockShift);
+    }
+    if (want[1]) {
+      sampled.catalogNodes.decide(catalogNodeSize, "sampled catalog leaves",
+                                  kUsualCatalogNodeShift);
+    }
+    if (want[2]) {
+      sampled.extentNodes.decide(extentNodeSize, "sampled extents leaves",
+                                 kUsualExtentNodeShift);
+    }
+  }
+  close(fd);
+
+  // The node sizes used to be taken to be the block size, and still are
+  // when there is nothing better to go on.
+  for (Found* nodeSize : {&catalogNodeSize, &extentNodeSize}) {
+    if (nodeSize->size == 0 && blockSize.size != 0) {
+      *nodeSize = {blockSize.size, kGuessed, "the block size"};
+    }
+  }
+
+  auto took = std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::steady_clock::now() - start);
+  std::cout << "Detected sizes in " << took.count() << "ms:" << std::endl;
+  printFound("blockSize", blockSize);
+  printFound("catalogNodeSize", catalogNodeSize);
+  printFound("extentNodeSize", extentNodeSize);
+
+  options.blockSize = blockSize.size;
+  options.catalogNodeSize = catalogNodeSize.size;
+  options.extentNodeSize = extentNodeSize.size;
+  return options.blockSize != 0;
+}
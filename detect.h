@@ -0,0 +1,20 @@
+// HFFS (Help find files script)
+// Author: Michael O'Farrell
+
+#pragma once
+
+#include "rgs.h"
+
+// Works out the sizes a recovery needs without being told them.  The volume
+// headers give the block size, and the B-tree header nodes at the start of the
+// catalog and extents files give their node sizes.  When the headers are
+// damaged, samples of the volume are read instead and the leaf nodes in them
+// vote: the node sizes their offset tables fit, and the block sizes the file
+// records in them fit.  Only a few headers, or a few tens of megabytes of
+// samples, are read whatever the size of the image.
+
+// Fills in whichever of the block size and the catalog and extents node sizes
+// are still zero in options, printing each size, where it came from and how
+// sure we are of it.  A node size that can't be found is taken to be the
+// block size.  Returns false if the block size couldn't be found.
+bool detectSizes(Options& options);
@@ -1,18 +1,34 @@
 // HFFS (Help find files script)
 // Author: Michael O'Farrell
 
+#include "detect.h"
+#include "image.h"
+#include "metrics.h"
+#include "partitions.h"
 #include "recover.h"
 #include "rgs.h"
+#include "trace.h"
 
+#include <algorithm>
 #include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
 
 // C includes
+#include <fcntl.h>
+#include <errno.h>
 #include <getopt.h>
 #include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 namespace {
 
 constexpr uint64_t kDefaultSectorSize = 512;
+constexpr uint64_t kDefaultMmapWindow = 1ull << 30;
+constexpr uint64_t kDefaultIoSize = 4ull << 20;
+constexpr uint64_t kDefaultQueueDepth = 8;
 
 // Prints the help message for launching the utility.
 void help(char* command) {
@@ -21,12 +37,178 @@ void help(char* command) {
                " [--block-size <block-size>]"
                " [--stop-block <block-number>]"
                " [--buffer-size <buffer-size>=<block-size>]"
-               " [--catalog-node-size <node-size>=<block-size>]"
-               " [--extent-node-size <node-size>=<block-size>]"
+               " [--catalog-node-size <node-size>]"
+               " [--extent-node-size <node-size>]"
+               " [--no-mmap]"
+               " [--mmap-window <bytes>=1073741824]"
+               " [--threads <threads>=1]"
+               " [--prefilter | --no-prefilter]"
+               " [--fast]"
+               " [--io-size <bytes>=4194304]"
+               " [--copy-engine auto|reflink|copy-range|buffered]"
+               " [--queue-depth <requests>=8]"
+               " [--no-io-uring]"
+               " [--skip-claimed]"
+               " [--scan-ranges auto|<first>-[<last>][,...]]"
+               " [--save-index <file>]"
+               " [--load-index <file>]"
+               " [--volume-offset <bytes>]"
+               " [--scan-stride <bytes>]"
+               " [--all-volumes]"
+               " [--metrics <file>]"
+               " [--progress <file>]"
+               " [--trace <file>]"
                " [-o <outfile>] <infile>" << std::endl;
   exit(EXIT_FAILURE);
 }
 
+// Parses the name of a copy engine, or prints help if there is no such engine.
+CopyEngine copyEngine(char* command, const char* name) {
+  std::string engine = name;
+  if (engine == "auto") return kCopyAuto;
+  if (engine == "reflink") return kCopyReflink;
+  if (engine == "copy-range") return kCopyRange;
+  if (engine == "buffered") return kCopyBuffered;
+  help(command);
+  return kCopyAuto;
+}
+
+// Points options at the volume to recover: the one at offset if given, or
+// else the first volume found with an HFS+ signature.
+void selectVolume(Options& options, const char* offset) {
+  std::vector<Volume> volumes = findVolumes(options);
+  if (volumes.size() > 1 || volumes[0].offset != 0) {
+    std::cout << "Volumes found:" << std::endl;
+    for (const auto& volume : volumes) {
+      std::cout << "  " << volume.source << ": " << volume.size
+                << " bytes at " << volume.offset
+                << (volume.signature ? "" : ", no HFS+ signature")
+                << std::endl;
+    }
+  }
+
+  if (offset) {
+    // A volume the partition map doesn't know of runs to the end of the
+    // image.
+    options.volumeOffset = std::stoull(offset);
+    int fd = open(options.infile, O_RDONLY);
+    uint64_t size = fd < 0 ? 0 : imageSize(fd);
+    if (fd >= 0) close(fd);
+    if (options.volumeOffset >= size) {
+      throw std::runtime_error("--volume-offset is past the end of the image.");
+    }
+    options.volumeSize = size - options.volumeOffset;
+    for (const auto& volume : volumes) {
+      if (volume.offset == options.volumeOffset) {
+        options.volumeSize = volume.size;
+      }
+    }
+    return;
+  }
+  const Volume* chosen = &volumes[0];
+  for (const auto& volume : volumes) {
+    if (volume.signature) {
+      chosen = &volume;
+      break;
+    }
+  }
+  options.volumeOffset = chosen->offset;
+  options.volumeSize = chosen->size;
+  if (volumes.size() > 1) {
+    std::cout << "Recovering the volume at " << chosen->offset
+              << ", --volume-offset picks another." << std::endl;
+  }
+}
+
+// Checks the volume options point at, and fills in the sizes not given.
+void prepare(RGS& rgs) {
+  // Lets find the main block record and print info.
+  {
+    Metrics::Phase phase(rgs.metrics, "verify");
+    verify(rgs);
+  }
+
+  // Whichever sizes weren't given are read off the image.  A snapshot
+  // brings its own block size, and doesn't scan with the node sizes.
+  Options& options = rgs.options;
+  if (!options.loadIndex && (!options.blockSize || !options.catalogNodeSize ||
+                             !options.extentNodeSize)) {
+    Metrics::Phase phase(rgs.metrics, "detect");
+    if (!detectSizes(options) && options.outdir) {
+      throw std::runtime_error(
+          "Couldn't detect the block size, give it with --block-size.");
+    }
+  }
+  uint64_t blockSize = options.blockSize;
+  if (!options.bufferSize) options.bufferSize = blockSize;
+  uint64_t stride = options.scanStride;
+  if (stride && !options.loadIndex &&
+      (stride < 512 || (stride & (stride - 1)) ||
+       stride > std::min(options.catalogNodeSize, options.extentNodeSize))) {
+    throw std::runtime_error(
+        "--scan-stride has to be a power of two from 512 bytes up to the "
+        "node sizes.");
+  }
+
+  // Reads while saving start on block boundaries, keep them that way.
+  if (blockSize) {
+    options.ioSize = std::max(
+        (options.ioSize + blockSize - 1) / blockSize * blockSize,
+        blockSize);
+  }
+}
+
+// Recovers every volume found in the image, each into a folder of the output
+// folder named after it.  The sizes are worked out for each volume on its
+// own, and a volume they can't be worked out for is left out.  All of them
+// report to metrics.
+void recoverAllVolumes(const Options& base, Metrics* metrics) {
+  std::vector<Volume> volumes = findVolumes(base);
+  if (base.outdir && mkdir(base.outdir, 0777) < 0 && errno != EEXIST) {
+    throw std::runtime_error("Couldn't create the output folder.");
+  }
+  // Options only point at their output folder, these hold the paths.
+  std::vector<std::string> outdirs;
+  for (const auto& volume : volumes) {
+    outdirs.push_back(base.outdir ?
+                      std::string(base.outdir) + "/" + volume.name : "");
+  }
+
+  std::vector<std::unique_ptr<RGS>> envs;
+  std::vector<RGS*> recovering;
+  for (size_t v = 0; v < volumes.size(); v++) {
+    const Volume& volume = volumes[v];
+    std::cout << std::endl << volume.source << ": " << volume.size
+              << " bytes at " << volume.offset
+              << (volume.signature ? "" : ", no HFS+ signature") << std::endl;
+    Options options = base;
+    options.volumeOffset = volume.offset;
+    options.volumeSize = volume.size;
+    options.outdir = base.outdir ? &outdirs[v][0] : nullptr;
+    envs.emplace_back(new RGS{options});
+    envs.back()->metrics = metrics;
+    try {
+      prepare(*envs.back());
+    } catch (std::runtime_error err) {
+      std::cerr << "Skipping " << volume.source << ": " << err.what()
+                << std::endl;
+      continue;
+    }
+    recovering.push_back(envs.back().get());
+  }
+
+  if (base.outdir) {
+    if (recovering.empty()) {
+      throw std::runtime_error("No volume could be recovered.");
+    }
+    for (const RGS* env : recovering) {
+      std::cout << "Recovering the volume at " << env->options.volumeOffset
+                << " into " << env->options.outdir << std::endl;
+    }
+    recoverVolumes(recovering);
+  }
+}
+
 } // namespace
 ///////////////////////////////////////////////////////////////////////////////
 
@@ -41,20 +223,60 @@ int main(int argc, char* argv[]) {
   char* extentNodeSize = nullptr;
   char* outdir = nullptr;
   char* infile = nullptr;
+  char* mmapWindow = nullptr;
+  char* threads = nullptr;
+  char* ioSize = nullptr;
+  char* queueDepth = nullptr;
+  char* saveIndex = nullptr;
+  char* loadIndex = nullptr;
+  char* scanRanges = nullptr;
+  char* volumeOffset = nullptr;
+  char* scanStride = nullptr;
+  char* metricsFile = nullptr;
+  char* progressFile = nullptr;
+  char* traceFile = nullptr;
+  CopyEngine engine = kCopyAuto;
   bool permissive = false;
+  bool mmap = true;
+  bool ioUring = true;
+  bool followBTrees = false;
+  bool skipClaimed = false;
+  bool allVolumes = false;
+  // The prefilter defaults to on unless we are being permissive.
+  int prefilter = -1;
 
   while (1) {
     int this_option_optind = optind ? optind : 1;
     int option_index = 0;
     static struct option long_options[] = {
+      {"all-volumes", no_argument,               0, 20  },
       {"block-size",  required_argument,         0, 'b' },
       {"buffer-size",  required_argument,        0,  0  },
       {"catalog-node-size", required_argument,   0,  1  },
+      {"copy-engine", required_argument,         0, 11  },
       {"extent-node-size", required_argument,    0,  2  },
+      {"fast",        no_argument,               0,  9  },
+      {"io-size",     required_argument,         0, 10  },
+      {"load-index",  required_argument,         0, 15  },
+      {"metrics",     required_argument,         0, 21  },
+      {"mmap-window", required_argument,         0,  5  },
+      {"no-io-uring", no_argument,               0, 13  },
+      {"no-mmap",     no_argument,               0,  4  },
       {"outdir",      required_argument,         0, 'o' },
+      {"no-prefilter", no_argument,              0,  8  },
       {"permissive",  no_argument,               0, 'p' },
+      {"prefilter",   no_argument,               0,  7  },
+      {"progress",    required_argument,         0, 22  },
+      {"queue-depth", required_argument,         0, 12  },
+      {"save-index",  required_argument,         0, 14  },
+      {"scan-ranges", required_argument,         0, 17  },
+      {"scan-stride", required_argument,         0, 19  },
       {"sector-size", required_argument,         0, 's' },
+      {"skip-claimed", no_argument,              0, 16  },
       {"stop-block", required_argument,          0,  3  },
+      {"threads",    required_argument,          0,  6  },
+      {"trace",       required_argument,         0, 23  },
+      {"volume-offset", required_argument,       0, 18  },
       {0,             0,                         0,  0  }
     };
 
@@ -75,6 +297,66 @@ int main(int argc, char* argv[]) {
       case 3:
         stopBlock = optarg;
         break;
+      case 4:
+        mmap = false;
+        break;
+      case 5:
+        mmapWindow = optarg;
+        break;
+      case 6:
+        threads = optarg;
+        break;
+      case 7:
+        prefilter = 1;
+        break;
+      case 8:
+        prefilter = 0;
+        break;
+      case 9:
+        followBTrees = true;
+        break;
+      case 10:
+        ioSize = optarg;
+        break;
+      case 11:
+        engine = copyEngine(argv[0], optarg);
+        break;
+      case 12:
+        queueDepth = optarg;
+        break;
+      case 13:
+        ioUring = false;
+        break;
+      case 14:
+        saveIndex = optarg;
+        break;
+      case 15:
+        loadIndex = optarg;
+        break;
+      case 16:
+        skipClaimed = true;
+        break;
+      case 17:
+        scanRanges = optarg;
+        break;
+      case 18:
+        volumeOffset = optarg;
+        break;
+      case 19:
+        scanStride = optarg;
+        break;
+      case 20:
+        allVolumes = true;
+        break;
+      case 21:
+        metricsFile = optarg;
+        break;
+      case 22:
+        progressFile = optarg;
+        break;
+      case 23:
+        traceFile = optarg;
+        break;
       case 'b':
         bs = optarg;
         break;
@@ -107,22 +389,57 @@ int main(int argc, char* argv[]) {
     ss ? std::stoul(ss) : kDefaultSectorSize,
     blockSize,
     stopBlock ? std::stoul(stopBlock) : 0,
-    bufferSize ? std::stoul(bufferSize) : blockSize,
-    catalogNodeSize ? std::stoul(catalogNodeSize) : blockSize,
-    extentNodeSize ? std::stoul(extentNodeSize) : blockSize,
+    bufferSize ? std::stoul(bufferSize) : 0,
+    catalogNodeSize ? std::stoul(catalogNodeSize) : 0,
+    extentNodeSize ? std::stoul(extentNodeSize) : 0,
+    mmap,
+    mmapWindow ? std::stoul(mmapWindow) : kDefaultMmapWindow,
+    threads ? std::max(std::stoul(threads), 1ul) : 1,
+    prefilter < 0 ? !permissive : prefilter == 1,
+    followBTrees,
+    ioSize ? std::stoul(ioSize) : kDefaultIoSize,
+    engine,
+    queueDepth ? std::max(std::stoul(queueDepth), 1ul) : kDefaultQueueDepth,
+    ioUring,
+    skipClaimed,
+    scanRanges,
+    saveIndex,
+    loadIndex,
+    0,
+    0,
+    scanStride ? std::stoul(scanStride) : 0,
   }};
 
+  // Tracing has to start before any other thread does.
+  if (traceFile) Trace::start();
+  Metrics metrics;
+  rgs.metrics = &metrics;
   try {
-    // Lets find the main block record and print info.
-    verify(rgs);
-    if (outdir && bs) {
-      // We have the arguments to hunt for files.
-      recover(rgs);
+    metrics.open(infile, metricsFile, progressFile);
+    if (allVolumes) {
+      if (saveIndex || loadIndex || volumeOffset) {
+        throw std::runtime_error(
+            "--all-volumes can't be used with --save-index, --load-index or "
+            "--volume-offset.");
+      }
+      recoverAllVolumes(rgs.options, &metrics);
+    } else {
+      selectVolume(rgs.options, volumeOffset);
+      prepare(rgs);
+      if (outdir) {
+        // We have the arguments to hunt for files, or have already found
+        // them.
+        recover(rgs);
+      }
     }
   } catch (std::runtime_error err) {
     std::cerr << "Error: " << err.what() << std::endl;
+    metrics.report(err.what());
+    if (traceFile) Trace::write(traceFile);
     exit(EXIT_FAILURE);
   }
+  metrics.report(nullptr);
+  if (traceFile) Trace::write(traceFile);
 
   exit(EXIT_SUCCESS);
 }
@@ -0,0 +1,169 @@
+// HFFS (Help find files script)
+// Author: Michael O'Farrell
+
+#include "image.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <new>
+
+namespace {
+
+uint64_t pageSize() {
+  static const uint64_t size = sysconf(_SC_PAGESIZE);
+  return size;
+}
+
+// Reads ahead are split into pieces no smaller than this.
+constexpr uint64_t kMinReadPiece = 64 << 10;
+
+}  // namespace
+///////////////////////////////////////////////////////////////////////////////
+
+uint64_t imageSize(int fd) {
+  struct stat st;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+    return st.st_size;
+  }
+  // Block devices report no size through stat, ask for the end instead.
+  off_t end = lseek(fd, 0, SEEK_END);
+  return end < 0 ? 0 : end;
+}
+
+MappedWindow::MappedWindow(int fd)
+    : fd_(fd), mapping_(nullptr), mappedLength_(0), base_(nullptr),
+      begin_(0), end_(0) {}
+
+MappedWindow::~MappedWindow() {
+  unmap();
+}
+
+bool MappedWindow::map(uint64_t begin, uint64_t end) {
+  unmap();
+  // Mappings have to start on a page boundary.
+  uint64_t mapBegin = begin - begin % pageSize();
+  size_t length = end - mapBegin;
+  void* mapping = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd_, mapBegin);
+  if (mapping == MAP_FAILED) {
+    return false;
+  }
+  mapping_ = (char*)mapping;
+  mappedLength_ = length;
+  base_ = mapping_ + (begin - mapBegin);
+  begin_ = begin;
+  end_ = end;
+  return true;
+}
+
+void MappedWindow::unmap() {
+  if (mapping_) {
+    munmap(mapping_, mappedLength_);
+  }
+  mapping_ = nullptr;
+  mappedLength_ = 0;
+  base_ = nullptr;
+  begin_ = end_ = 0;
+}
+
+void MappedWindow::adviseSequential() {
+  if (mapping_) {
+    madvise(mapping_, mappedLength_, MADV_SEQUENTIAL);
+  }
+}
+
+void MappedWindow::prefetch(uint64_t begin, uint64_t end) {
+  begin = std::max(begin, begin_);
+  end = std::min(end, end_);
+  if (!mapping_ || begin >= end) return;
+  // madvise also wants page aligned addresses.
+  const char* from = at(begin);
+  char* aligned = mapping_ + ((from - mapping_) / pageSize()) * pageSize();
+  madvise(aligned, at(end) - aligned, MADV_WILLNEED);
+}
+
+IoBuffer::IoBuffer(size_t size) : data_(nullptr), size_(size) {
+  void* data;
+  if (posix_memalign(&data, pageSize(), size) != 0) {
+    throw std::bad_alloc();
+  }
+  data_ = (char*)data;
+}
+
+IoBuffer::~IoBuffer() {
+  free(data_);
+}
+
+ReadWindow::ReadWindow(int fd, uint64_t size, AsyncIo& io, uint64_t capacity,
+                       uint64_t overlap)
+    : fd_(fd), size_(size), io_(io), capacity_(capacity), overlap_(overlap),
+      current_(new IoBuffer(capacity)), ahead_(new IoBuffer(capacity)),
+      currentBegin_(0), aheadBegin_(0), aheadEnd_(0), base_(nullptr),
+      begin_(0), end_(0) {
+  pieces_.reserve(io.depth());
+}
+
+ReadWindow::~ReadWindow() {
+  waitReads();
+}
+
+bool ReadWindow::map(uint64_t begin, uint64_t end) {
+  if (waitReads() && aheadBegin_ <= begin && end <= aheadEnd_) {
+    std::swap(current_, ahead_);
+    currentBegin_ = aheadBegin_;
+  } else {
+    if (end - begin > capacity_) return false;
+    startReads(*current_, begin, end);
+    if (!waitReads()) return false;
+    currentBegin_ = begin;
+  }
+  aheadBegin_ = aheadEnd_ = 0;
+  base_ = current_->data() + (begin - currentBegin_);
+  begin_ = begin;
+  end_ = end;
+
+  if (end < size_ && end - begin > overlap_) {
+    aheadBegin_ = end - overlap_;
+    aheadEnd_ = std::min(size_, aheadBegin_ + capacity_);
+    startReads(*ahead_, aheadBegin_, aheadEnd_);
+  }
+  return true;
+}
+
+void ReadWindow::unmap() {
+  waitReads();
+  aheadBegin_ = aheadEnd_ = 0;
+  base_ = nullptr;
+  begin_ = end_ = 0;
+}
+
+void ReadWindow::startReads(IoBuffer& buffer, uint64_t begin, uint64_t end) {
+  // Enough pieces to fill the queue.
+  uint64_t piece = (end - begin + io_.depth() - 1) / io_.depth();
+  piece = std::max(piece, kMinReadPiece);
+  piece = (piece + pageSize() - 1) / pageSize() * pageSize();
+  pieces_.clear();
+  for (uint64_t offset = begin; offset < end; offset += piece) {
+    pieces_.push_back(std::min(piece, end - offset));
+  }
+  for (size_t i = 0; i < pieces_.size(); i++) {
+    io_.read(fd_, buffer.data() + i * piece, pieces_[i], begin + i * piece,
+             &pieces_[i]);
+  }
+  io_.submit();
+}
+
+bool ReadWindow::waitReads() {
+  bool read = true;
+  while (io_.outstanding() > 0) {
+    IoCompletion completion = io_.wait();
+    if (completion.result != (ssize_t)*(size_t*)completion.tag) {
+      read = false;
+    }
+  }
+  if (!read) aheadBegin_ = aheadEnd_ = 0;
+  return read;
+}
@@ -0,0 +1,123 @@
+// HFFS (Help find files script)
+// Author: Michael O'Farrell
+
+#pragma once
+
+#include "aio.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// Returns the size of the image behind fd in bytes.  Works for regular files
+// as well as block devices.
+uint64_t imageSize(int fd);
+
+// A read only window of the image mapped into memory.  Remapping moves the
+// window, so huge images can be walked without mapping them all at once.
+class MappedWindow {
+ public:
+  explicit MappedWindow(int fd);
+  ~MappedWindow();
+
+  MappedWindow(const MappedWindow&) = delete;
+  MappedWindow& operator=(const MappedWindow&) = delete;
+
+  // Map at least [begin, end) of the image, which must lie within the image.
+  // Returns false if the kernel refuses the mapping.
+  bool map(uint64_t begin, uint64_t end);
+  void unmap();
+
+  // Hint that the window will be read front to back.
+  void adviseSequential();
+  // Ask the kernel to start reading [begin, end) of the window in now.
+  void prefetch(uint64_t begin, uint64_t end);
+
+  // Pointer to the byte at image offset, which must be inside the window.
+  const char* at(uint64_t offset) const {
+    return base_ + (offset - begin_);
+  }
+  uint64_t begin() const { return begin_; }
+  uint64_t end() const { return end_; }
+
+ private:
+  int fd_;
+  char* mapping_;
+  size_t mappedLength_;
+  char* base_;
+  uint64_t begin_;
+  uint64_t end_;
+};
+
+// A heap buffer aligned to the page size, for reading and writing large runs
+// of the image.  Allocate one up front and reuse it.
+class IoBuffer {
+ public:
+  explicit IoBuffer(size_t size);
+  ~IoBuffer();
+
+  IoBuffer(const IoBuffer&) = delete;
+  IoBuffer& operator=(const IoBuffer&) = delete;
+
+  char* data() { return data_; }
+  size_t size() const { return size_; }
+
+ private:
+  char* data_;
+  size_t size_;
+};
+
+// The image read into memory a window at a time, for when it can't be mapped.
+// Has the same interface as MappedWindow.  While one window is walked the
+// next is read ahead through io, split into pieces so that many reads are in
+// flight at once.
+class ReadWindow {
+ public:
+  // Windows hold up to capacity bytes.  Read ahead starts overlap bytes
+  // before the end of the current window, where the next one is expected to
+  // begin.
+  ReadWindow(int fd, uint64_t size, AsyncIo& io, uint64_t capacity,
+             uint64_t overlap);
+  ~ReadWindow();
+
+  ReadWindow(const ReadWindow&) = delete;
+  ReadWindow& operator=(const ReadWindow&) = delete;
+
+  // Read [begin, end) of the image, which must lie within the image and fit
+  // in the capacity.  Returns false if it can't be read.
+  bool map(uint64_t begin, uint64_t end);
+  void unmap();
+
+  // Reads are already sequential and ahead of the walk.
+  void adviseSequential() {}
+  void prefetch(uint64_t begin, uint64_t end) {}
+
+  const char* at(uint64_t offset) const {
+    return base_ + (offset - begin_);
+  }
+  uint64_t begin() const { return begin_; }
+  uint64_t end() const { return end_; }
+
+ private:
+  // Starts reading [begin, end) of the image into buffer.
+  void startReads(IoBuffer& buffer, uint64_t begin, uint64_t end);
+  // Waits for the reads started.  Returns false if any failed.
+  bool waitReads();
+
+  int fd_;
+  uint64_t size_;
+  AsyncIo& io_;
+  uint64_t capacity_;
+  uint64_t overlap_;
+  std::unique_ptr<IoBuffer> current_;
+  std::unique_ptr<IoBuffer> ahead_;
+  uint64_t currentBegin_;
+  uint64_t aheadBegin_;
+  uint64_t aheadEnd_;
+  // The length of each read in flight, so short ones can be spotted.
+  std::vector<size_t> pieces_;
+  const char* base_;
+  uint64_t begin_;
+  uint64_t end_;
+};
@@ -0,0 +1,294 @@
+// HFFS (Help find files script)
+// Author: Michael O'Farrell
+
+#include "metrics.h"
+
+#include "rgs.h"
+
+#include <sys/resource.h>
+#include <time.h>
+
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+
+namespace {
+
+// How often progress is shown.
+constexpr int64_t kProgressNanos = 5000000000ll;
+
+// s as a JSON string.
+std::string quote(const std::string& s) {
+  std::ostringstream out;
+  out << '"';
+  for (unsigned char c : s) {
+    if (c == '"' || c == '\\') {
+      out << '\\' << c;
+    } else if (c < 0x20) {
+      out << "\\u" << std::hex << std::setw(4) << std::setfill('0') << (int)c
+          << std::dec;
+    } else {
+      out << c;
+    }
+  }
+  out << '"';
+  return out.str();
+}
+
+// a / b, or 0 when there is nothing to divide by.
+double ratio(double a, double b) {
+  return b > 0 ? a / b : 0;
+}
+
+}  // namespace
+///////////////////////////////////////////////////////////////////////////////
+
+Histogram::Histogram() : count_(0), total_(0) {
+  for (auto& bucket : buckets_) bucket = 0;
+}
+
+void Histogram::add(uint64_t micros) {
+  size_t i = 0;
+  while (i + 1 < kBuckets && micros >= (1ull << i)) i++;
+  buckets_[i]++;
+  count_++;
+  total_ += micros;
+}
+
+uint64_t Histogram::percentile(double fraction) const {
+  if (count_ == 0) return 0;
+  uint64_t wanted = (uint64_t)(fraction * count_);
+  uint64_t seen = 0;
+  for (size_t i = 0; i < kBuckets; i++) {
+    seen += buckets_[i];
+    if (seen > wanted) return 1ull << i;
+  }
+  return 1ull << (kBuckets - 1);
+}
+
+Metrics::Phase::Phase(Metrics* metrics, const char* name)
+    : metrics_(metrics), name_(name), outer_(nullptr), span_(name) {
+  if (!metrics_) return;
+  outer_ = metrics_->phase_.exchange(name_);
+  wall_ = std::chrono::steady_clock::now();
+  cpu_ = cpuSeconds();
+}
+
+Metrics::Phase::~Phase() {
+  if (!metrics_) return;
+  std::chrono::duration<double> wall =
+      std::chrono::steady_clock::now() - wall_;
+  metrics_->endPhase(name_, wall.count(), cpuSeconds() - cpu_);
+  metrics_->phase_ = outer_;
+}
+
+Metrics::Metrics()
+    : start_(std::chrono::steady_clock::now()), lastProgress_(0),
+      phase_("start"), scanBytes_(0), scanPositions_(0), scanParsed_(0),
+      reflinked_(0), inKernel_(0), buffered_(0) {}
+
+Metrics::~Metrics() {}
+
+void Metrics::open(const char* infile, const char* reportPath,
+                   const char* progressPath) {
+  infile_ = infile;
+  if (reportPath) reportPath_ = reportPath;
+  if (progressPath) {
+    progress_.open(progressPath, std::ios::out | std::ios::app);
+    if (!progress_) {
+      throw std::runtime_error("Couldn't open the progress file.");
+    }
+  }
+}
+
+bool Metrics::due() {
+  int64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now() - start_).count();
+  int64_t last = lastProgress_;
+  if (now - last < kProgressNanos) return false;
+  // Of the threads that get here together, only one reports.
+  return lastProgress_.compare_exchange_strong(last, now);
+}
+
+void Metrics::progress(const RGS& env) {
+  traceCounter("files", env.files.size());
+  traceCounter("folders", env.folders.size());
+  traceCounter("extents", env.extents.size());
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (!progress_.is_open()) return;
+  progress_ << "{\"elapsedSeconds\": " << elapsed()
+            << ", \"phase\": " << quote(phase_.load())
+            << ", \"volumeOffset\": " << env.options.volumeOffset
+            << ", \"files\": " << env.files.size()
+            << ", \"folders\": " << env.folders.size()
+            << ", \"extents\": " << env.extents.size()
+            << ", \"scannedBytes\": " << scanBytes_
+            << ", \"reads\": " << readLatency_.count()
+            << ", \"peakResidentBytes\": " << peakResidentBytes() << "}"
+            << std::endl;
+}
+
+void Metrics::addScan(uint64_t bytes, uint64_t positions, uint64_t parsed) {
+  traceCounter("scanned-bytes", scanBytes_ += bytes);
+  scanPositions_ += positions;
+  scanParsed_ += parsed;
+}
+
+void Metrics::noteSizes(const RGS& env) {
+  Sizes sizes{
+    env.files.size(),
+    env.folders.size(),
+    env.extents.size(),
+    env.overflowExtents.size(),
+    env.files.capacity() * sizeof(FileInfo) + env.fileIndex.capacity() +
+        env.folders.capacity() + env.extents.capacity() +
+        env.overflowExtents.capacity() * sizeof(HFSPlusExtentDescriptor) +
+        env.names.capacity(),
+  };
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto inserted = sizes_.insert({env.options.volumeOffset, sizes});
+  Sizes& kept = inserted.first->second;
+  kept.files = std::max(kept.files, sizes.files);
+  kept.folders = std::max(kept.folders, sizes.folders);
+  kept.extents = std::max(kept.extents, sizes.extents);
+  kept.overflowExtents = std::max(kept.overflowExtents,
+                                  sizes.overflowExtents);
+  kept.bytes = std::max(kept.bytes, sizes.bytes);
+}
+
+void Metrics::addSaved(uint64_t reflinked, uint64_t inKernel,
+                       uint64_t buffered) {
+  reflinked_ += reflinked;
+  inKernel_ += inKernel;
+  buffered_ += buffered;
+}
+
+void Metrics::endPhase(const char* name, double wall, double cpu) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  PhaseTotals* totals = nullptr;
+  for (auto& phase : phases_) {
+    if (phase.first == name) totals = &phase.second;
+  }
+  if (!totals) {
+    phases_.push_back({name, {0, 0, 0}});
+    totals = &phases_.back().second;
+  }
+  totals->runs++;
+  totals->wall += wall;
+  totals->cpu += cpu;
+  if (progress_.is_open()) {
+    progress_ << "{\"elapsedSeconds\": " << elapsed()
+              << ", \"phaseDone\": " << quote(name)
+              << ", \"wallSeconds\": " << wall
+              << ", \"cpuSeconds\": " << cpu << "}" << std::endl;
+  }
+}
+
+double Metrics::elapsed() const {
+  std::chrono::duration<double> diff =
+      std::chrono::steady_clock::now() - start_;
+  return diff.count();
+}
+
+void Metrics::report(const char* error) {
+  if (reportPath_.empty()) return;
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::ofstream out(reportPath_, std::ios::out | std::ios::trunc);
+  if (!out) {
+    std::cerr << "Failed to write " << reportPath_ << std::endl;
+    return;
+  }
+
+  PhaseTotals scan{0, 0, 0};
+  out << "{" << std::endl
+      << "  \"image\": " << quote(infile_) << "," << std::endl
+      << "  \"error\": " << (error ? quote(error) : "null") << ","
+      << std::endl
+      << "  \"wallSeconds\": " << elapsed() << "," << std::endl
+      << "  \"cpuSeconds\": " << cpuSeconds() << "," << std::endl
+      << "  \"peakResidentBytes\": " << peakResidentBytes() << ","
+      << std::endl
+      << "  \"phases\": {";
+  for (size_t i = 0; i < phases_.size(); i++) {
+    const PhaseTotals& totals = phases_[i].second;
+    if (phases_[i].first == "scan") scan = totals;
+    out << (i ? "," : "") << std::endl
+        << "    " << quote(phases_[i].first) << ": {\"runs\": "
+        << totals.runs << ", \"wallSeconds\": " << totals.wall
+        << ", \"cpuSeconds\": " << totals.cpu << "}";
+  }
+  out << std::endl << "  }," << std::endl;
+
+  // Rates are of the scan phase as a whole, per node costs of the CPU time
+  // it took on every thread.
+  out << "  \"scan\": {" << std::endl
+      << "    \"bytes\": " << scanBytes_ << "," << std::endl
+      << "    \"positions\": " << scanPositions_ << "," << std::endl
+      << "    \"parsedNodes\": " << scanParsed_ << "," << std::endl
+      << "    \"megabytesPerSecond\": "
+      << ratio(scanBytes_ / 1e6, scan.wall) << "," << std::endl
+      << "    \"nanosecondsPerPosition\": "
+      << ratio(scan.cpu * 1e9, scanPositions_) << "," << std::endl
+      << "    \"nanosecondsPerParsedNode\": "
+      << ratio(scan.cpu * 1e9, scanParsed_) << std::endl
+      << "  }," << std::endl;
+
+  out << "  \"reads\": {" << std::endl
+      << "    \"count\": " << readLatency_.count() << "," << std::endl
+      << "    \"meanMicroseconds\": "
+      << ratio(readLatency_.totalMicros(), readLatency_.count()) << ","
+      << std::endl
+      << "    \"p50Microseconds\": " << readLatency_.percentile(0.5) << ","
+      << std::endl
+      << "    \"p99Microseconds\": " << readLatency_.percentile(0.99) << ","
+      << std::endl
+      << "    \"histogram\": [";
+  bool first = true;
+  for (size_t i = 0; i < Histogram::kBuckets; i++) {
+    if (!readLatency_.bucket(i)) continue;
+    out << (first ? "" : ", ") << "{\"underMicroseconds\": " << (1ull << i)
+        << ", \"count\": " << readLatency_.bucket(i) << "}";
+    first = false;
+  }
+  out << "]" << std::endl << "  }," << std::endl;
+
+  out << "  \"save\": {" << std::endl
+      << "    \"reflinkedBytes\": " << reflinked_ << "," << std::endl
+      << "    \"copiedInKernelBytes\": " << inKernel_ << "," << std::endl
+      << "    \"copiedThroughBufferBytes\": " << buffered_ << std::endl
+      << "  }," << std::endl;
+
+  out << "  \"volumes\": [";
+  first = true;
+  for (const auto& volume : sizes_) {
+    const Sizes& sizes = volume.second;
+    out << (first ? "" : ",") << std::endl
+        << "    {\"volumeOffset\": " << volume.first
+        << ", \"files\": " << sizes.files
+        << ", \"folders\": " << sizes.folders
+        << ", \"extents\": " << sizes.extents
+        << ", \"overflowExtents\": " << sizes.overflowExtents
+        << ", \"indexBytes\": " << sizes.bytes << "}";
+    first = false;
+  }
+  out << std::endl << "  ]" << std::endl << "}" << std::endl;
+}
+
+double cpuSeconds() {
+  timespec ts;
+  if (clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts) != 0) return 0;
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+uint64_t peakResidentBytes() {
+  rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+#ifdef __APPLE__
+  return usage.ru_maxrss;
+#else
+  // Linux counts in kilobytes.
+  return (uint64_t)usage.ru_maxrss * 1024;
+#endif
+}
@@ -0,0 +1,147 @@
+// HFFS (Help find files script)
+// Author: Michael O'Farrell
+
+#pragma once
+
+#include "trace.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+struct RGS;
+
+// Measures how a recovery went: how long each phase took, how fast the scan
+// went, how long reads took and how much memory the index needed.  At the end
+// it is written out as a JSON report (--metrics), and while the recovery runs
+// progress is appended to a file (--progress) as a JSON object per line.
+// Counting is cheap enough to always be on, only the files are optional.
+
+// How many of something took how many microseconds, in power of two buckets:
+// bucket i counts those under 2^i microseconds.  Safe to add to from several
+// threads at once.
+class Histogram {
+ public:
+  enum { kBuckets = 32 };
+
+  Histogram();
+
+  void add(uint64_t micros);
+
+  uint64_t count() const { return count_; }
+  uint64_t totalMicros() const { return total_; }
+  uint64_t bucket(size_t i) const { return buckets_[i]; }
+  // The bucket limit under which fraction of the samples are, 0 if there are
+  // none.
+  uint64_t percentile(double fraction) const;
+
+ private:
+  std::atomic<uint64_t> buckets_[kBuckets];
+  std::atomic<uint64_t> count_;
+  std::atomic<uint64_t> total_;
+};
+
+class Metrics {
+ public:
+  // Times a phase from construction to destruction, adding its wall and CPU
+  // time to the phase's totals.  Does nothing without metrics, apart from
+  // tracing the phase as a span.
+  class Phase {
+   public:
+    Phase(Metrics* metrics, const char* name);
+    ~Phase();
+
+    Phase(const Phase&) = delete;
+    Phase& operator=(const Phase&) = delete;
+
+   private:
+    Metrics* metrics_;
+    const char* name_;
+    const char* outer_;
+    std::chrono::steady_clock::time_point wall_;
+    double cpu_;
+    TraceSpan span_;
+  };
+
+  Metrics();
+  ~Metrics();
+
+  Metrics(const Metrics&) = delete;
+  Metrics& operator=(const Metrics&) = delete;
+
+  // Where the report and the progress go, either may be null.
+  void open(const char* infile, const char* reportPath,
+            const char* progressPath);
+
+  // Whether it has been long enough since progress was last shown.  Shared
+  // by everything reporting progress, from any thread.
+  bool due();
+
+  // Appends a line of progress on env to the progress file.
+  void progress(const RGS& env);
+
+  // Notes how many nodes a scan of bytes of the image visited, and parsed.
+  void addScan(uint64_t bytes, uint64_t positions, uint64_t parsed);
+
+  // Notes how much the index of env holds, keeping the largest seen for
+  // each volume.
+  void noteSizes(const RGS& env);
+
+  // Notes how many bytes each copy engine saved.
+  void addSaved(uint64_t reflinked, uint64_t inKernel, uint64_t buffered);
+
+  // How long reads of the image took once started.
+  Histogram& readLatency() { return readLatency_; }
+
+  // Writes the report, with error if the recovery failed.  Nothing is
+  // written without a report path.
+  void report(const char* error);
+
+ private:
+  struct PhaseTotals {
+    uint64_t runs;
+    double wall;
+    double cpu;
+  };
+  struct Sizes {
+    uint64_t files;
+    uint64_t folders;
+    uint64_t extents;
+    uint64_t overflowExtents;
+    uint64_t bytes;
+  };
+
+  void endPhase(const char* name, double wall, double cpu);
+  double elapsed() const;
+
+  std::string infile_;
+  std::string reportPath_;
+  std::chrono::steady_clock::time_point start_;
+  std::atomic<int64_t> lastProgress_;
+  std::atomic<const char*> phase_;
+
+  std::atomic<uint64_t> scanBytes_;
+  std::atomic<uint64_t> scanPositions_;
+  std::atomic<uint64_t> scanParsed_;
+  std::atomic<uint64_t> reflinked_;
+  std::atomic<uint64_t> inKernel_;
+  std::atomic<uint64_t> buffered_;
+  Histogram readLatency_;
+
+  // Guards the phases, sizes and progress file.
+  std::mutex mutex_;
+  std::vector<std::pair<std::string, PhaseTotals>> phases_;
+  std::map<uint64_t, Sizes> sizes_;
+  std::ofstream progress_;
+};
+
+// The CPU time used by the whole process so far, in seconds.
+double cpuSeconds();
+
+// The most memory the process has had resident, in bytes.
+uint64_t peakResidentBytes();
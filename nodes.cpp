@@ -0,0 +1,116 @@
+// HFFS (Help find files script)
+// Author: Michael O'Farrell
+
+#include "nodes.h"
+
+#include <iostream>
+#include <stdexcept>
+
+namespace nodes {
+void warning(const char* msg) {
+  std::cerr << "Warning:" << msg << std::endl;
+}
+}  // namespace nodes
+
+bool findCatalogRecords(const Options& options, const char* buffer,
+                        size_t nodeSize, std::vector<const char*>& records) {
+  return processNode(options, nodeSize, buffer,
+                     [&](const char* btkey, const char* record) -> size_t {
+    size_t size = catalogRecordSize(btkey, record);
+    // Only folders and files are indexed, threads are stepped over.
+    if (size) {
+      uint16_t recordType = LoadBigEndian16(record);
+      if (recordType == kHFSPlusFolderRecord ||
+          recordType == kHFSPlusFileRecord) {
+        records.emplace_back(btkey);
+      }
+    }
+    return size;
+  });
+}
+
+bool findExtentRecords(const Options& options, const char* buffer,
+                       size_t nodeSize, std::vector<const char*>& records) {
+  return processNode(options, nodeSize, buffer,
+                     [&](const char* btkey, const char*) -> size_t {
+    size_t size = extentRecordSize(btkey);
+    // Only data forks are saved, resource fork records are stepped over.
+    if (size && ExtentKeyView(btkey).forkType() == kDataForkType) {
+      records.emplace_back(btkey);
+    }
+    return size;
+  });
+}
+
+bool decodeCatalogRecord(const Options& options, const char* key,
+                         CatalogRecord& out) {
+  CatalogKeyView ck(key);
+  const char* record = ck.record();
+  out.recordType = LoadBigEndian16(record);
+  ck.decodeName(out.name);
+
+  switch (out.recordType) {
+    case kHFSPlusFolderRecord: {
+      CatalogFolderView folder(record);
+      out.folderID = folder.folderID();
+      out.folder.parentID = ck.parentID();
+      out.folder.contentModDate = folder.contentModDate();
+      return true;
+    }
+    case kHFSPlusFileRecord: {
+      FileInfo& fi = out.file;
+      fi.parentID = ck.parentID();
+
+      CatalogFileView file(record);
+      ForkDataView dataFork = file.dataFork();
+
+      fi.fileID = file.fileID();
+      fi.contentModDate = file.contentModDate();
+      fi.logicalSize = dataFork.logicalSize();
+      fi.totalBlocks = dataFork.totalBlocks();
+      if (fi.logicalSize != 0 && fi.totalBlocks != 0 &&
+          (fi.totalBlocks * options.blockSize < fi.logicalSize ||
+           (fi.totalBlocks - 1) * options.blockSize >= fi.logicalSize)) {
+        if (options.permissive) {
+          nodes::warning("Block size appears wrong.");
+        } else {
+          std::cout << "File " << out.name << " Size " << fi.logicalSize
+                    << " Blocks " << fi.totalBlocks << std::endl;
+          return false;
+          // throw std::runtime_error("Block size appears wrong.");
+        }
+      }
+      if (fi.logicalSize == 0) {
+        return false;
+      }
+      fi.foundBlocks = 0;
+      fi.extentCount = 0;
+      fi.overflow = 0;
+
+      ExtentDescriptorsView extents = dataFork.extents();
+      for (uint32_t i = 0;
+             i < kHFSPlusExtentDensity && fi.foundBlocks < fi.totalBlocks;
+           i++) {
+        fi.extents[fi.extentCount++] = extents[i];
+        fi.foundBlocks += extents[i].blockCount;
+      }
+      return true;
+    }
+    default:
+      throw std::logic_error("Shouldn't have non folder/file records here.");
+  }
+}
+
+uint64_t decodeExtentRecord(const char* key, ExtentRecord& extents) {
+  ExtentKeyView ek(key);
+
+  ExtentKey extentKey;
+  extentKey.fileID = ek.fileID();
+  extentKey.startBlock = ek.startBlock();
+
+  ExtentDescriptorsView er = ek.record();
+  for (size_t i = 0; i < kHFSPlusExtentDensity; i++) {
+    extents[i] = er[i];
+  }
+  return extentKey.key;
+}
@@ -0,0 +1,188 @@
+// HFFS (Help find files script)
+// Author: Michael O'Farrell
+
+#pragma once
+
+#include "convert.h"
+#include "hfs/hfs_format.h"
+#include "rgs.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <vector>
+
+// Parsing of the B-tree leaf nodes the recovery finds.  Nodes are raw bytes in
+// HFSPlus byte order and are only read.  This is internal to the recovery, it
+// is kept apart so the parsers can be benchmarked without a whole recovery.
+
+// The node parsers can read past the end of a node by up to a key and a
+// record.  Any buffer handed to them needs this much to spare.
+constexpr uint64_t kNodeSlack = sizeof(BTreeKey) + sizeof(HFSPlusCatalogFile);
+
+namespace nodes {
+// Warns of something odd in a node, on std::cerr.
+void warning(const char* msg);
+}  // namespace nodes
+
+inline bool accessIsSafe(size_t length, size_t access) {
+  if (access >= length) return false;
+  return true;
+}
+
+// Walks the records of the leaf node of nodeSize bytes at buffer.  lambda is
+// given each record's key and record, and returns the size of both, or 0 if
+// it isn't a record.  Returns whether the node held any records.
+template<typename Lambda>
+bool processNode(const Options& options, size_t nodeSize, const char* buffer,
+                 Lambda lambda) {
+  // Get the first records offset if it is a catalogNode.
+  size_t reverseCursor = nodeSize - sizeof(uint16_t);
+  uint16_t nodeEndOffset = LoadBigEndian16(&buffer[reverseCursor]);
+  reverseCursor -= sizeof(uint16_t);
+
+  if (options.permissive || nodeEndOffset == sizeof(BTNodeDescriptor)) {
+    size_t cursor = sizeof(BTNodeDescriptor);
+    uint16_t numRead = 0;
+    while (cursor < nodeSize) {
+      // Get the key length for the BTree key.
+      const char* btkey = &buffer[cursor];
+      uint16_t length = LoadBigEndian16(btkey);
+
+      // Get the records end offset.
+      nodeEndOffset = LoadBigEndian16(&buffer[reverseCursor]);
+      reverseCursor -= sizeof(uint16_t);
+
+      if (!accessIsSafe(kMaxKeyLength, length)) break;
+      const char* record = &buffer[cursor + length + sizeof(uint16_t)];
+
+      size_t cursorUpdate = lambda(btkey, record);
+      if (cursorUpdate == 0) break;
+      numRead++;
+
+      if (nodeEndOffset != cursor + cursorUpdate) {
+        if (!options.permissive) {
+          break;
+        } else {
+          nodes::warning("Read record with incorrect offset label.");
+        }
+      }
+
+      cursor += cursorUpdate;
+    }
+
+    if (numRead == 0) return false;
+    if (numRead != BTNodeDescriptorView(buffer).numRecords()) {
+      std::cerr << "Read some from block." << std::endl;
+    }
+
+    return true;
+  }
+  return false;
+}
+
+// The size of the catalog record at record with the key btkey, key included,
+// or 0 if it doesn't look like a catalog record.
+inline size_t catalogRecordSize(const char* btkey, const char* record) {
+  CatalogKeyView ck(btkey);
+  uint16_t length = ck.keyLength();
+
+  // Find the name length if this is a catalogue key.
+  uint16_t strLen = ck.nameLength();
+
+  // Find the record type if this is a catalog key.
+  uint16_t recordType = LoadBigEndian16(record);
+
+  if (  // Check the two lengths stored in catalog keys line up.
+      length == strLen * sizeof(uint16_t)
+      + kHFSPlusCatalogKeyMinimumLength
+      && (  // Check the record type looks correct.
+        recordType == kHFSPlusFolderRecord
+        || recordType == kHFSPlusFileRecord
+        || recordType == kHFSPlusFolderThreadRecord
+        || recordType == kHFSPlusFileThreadRecord
+        )
+     ) {
+    // It is highly likely that we have found a catalog record.
+
+    size_t cursorUpdate = length + sizeof(uint16_t);
+
+    switch(recordType) {
+      case kHFSPlusFolderRecord:
+        cursorUpdate += sizeof(HFSPlusCatalogFolder);
+        break;
+      case kHFSPlusFileRecord:
+        cursorUpdate += sizeof(HFSPlusCatalogFile);
+        break;
+      case kHFSPlusFolderThreadRecord:  // Falltrough
+      case kHFSPlusFileThreadRecord: {
+        cursorUpdate += sizeof(HFSPlusCatalogThread);
+        cursorUpdate -= sizeof(HFSUniStr255);
+        uint16_t threadNameLength = LoadBigEndian16(btkey + cursorUpdate);
+        cursorUpdate += sizeof(uint16_t) * (threadNameLength + 1);
+        break;
+      }
+      default:
+        return 0;
+    }
+    return cursorUpdate;
+  }
+  return 0;
+}
+
+// Fork types of extent keys.
+constexpr uint8_t kDataForkType = 0x00;
+constexpr uint8_t kResourceForkType = 0xFF;
+
+// The size of the extent record with the key btkey, key included, or 0 if it
+// doesn't look like an extent record.  Records of either fork have the same
+// fixed size.
+inline size_t extentRecordSize(const char* btkey) {
+  ExtentKeyView ek(btkey);
+
+  if (ek.keyLength() == kHFSPlusExtentKeyMaximumLength // Only length.
+      && (ek.forkType() == kDataForkType ||
+          ek.forkType() == kResourceForkType)
+      ) {
+    return sizeof(HFSPlusExtentKey) + sizeof(HFSPlusExtentRecord);
+  }
+  return 0;
+}
+
+// Reads buffer as a catalog leaf node of nodeSize bytes, appending the keys of
+// its folder and file records to records.  Returns false if it doesn't look
+// like one.
+bool findCatalogRecords(const Options& options, const char* buffer,
+                        size_t nodeSize, std::vector<const char*>& records);
+
+// Reads buffer as an extent leaf node of nodeSize bytes, appending the keys of
+// its data fork records to records.  Resource fork records are stepped over.
+// Returns false if it doesn't look like one.
+bool findExtentRecords(const Options& options, const char* buffer,
+                       size_t nodeSize, std::vector<const char*>& records);
+
+// A folder or file record found, in host byte order.
+struct CatalogRecord {
+  uint16_t recordType;
+  // For folders.
+  uint32_t folderID;
+  FolderInfo folder;
+  // For files.
+  FileInfo file;
+  char name[kHFSPlusMaxFileNameChars + 1];
+};
+
+// Decodes the folder or file record keyed by key.  Returns false if it
+// shouldn't be indexed: files that are empty, or whose size doesn't fit the
+// block size.
+bool decodeCatalogRecord(const Options& options, const char* key,
+                         CatalogRecord& record);
+
+// Decodes the extent record keyed by key into extents, returning its
+// ExtentKey.
+uint64_t decodeExtentRecord(const char* key, ExtentRecord& extents);
+
+// Parses buffer as a catalog or extent leaf node of nodeSize bytes and indexes
+// what is in it, as the scan does.  These are with the index, in recover.cpp.
+bool indexCatalogNode(RGS& env, const char* buffer, size_t nodeSize);
+bool indexExtentNode(RGS& env, const char* buffer, size_t nodeSize);
@@ -0,0 +1,188 @@
+// HFFS (Help find files script)
+// Author: Michael O'Farrell
+
+#include "partitions.h"
+
+#include "convert.h"
+#include "hfs/hfs_format.h"
+#include "image.h"
+
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <stdexcept>
+
+namespace {
+
+// GPT headers are at the second logical block, which is one of these sizes.
+constexpr uint64_t kGptBlockSizes[] = {512, 4096};
+constexpr char kGptSignature[8] = {'E', 'F', 'I', ' ', 'P', 'A', 'R', 'T'};
+// The GPT type of HFS+ partitions, 48465300-0000-11AA-AA11-00306543ECAC, as
+// laid out on disk.
+constexpr unsigned char kGptHfsPlus[16] = {
+  0x00, 0x53, 0x46, 0x48, 0x00, 0x00, 0xAA, 0x11,
+  0xAA, 0x11, 0x00, 0x30, 0x65, 0x43, 0xEC, 0xAC,
+};
+// More entries than any real map has, to bound what a damaged one reads.
+constexpr uint32_t kMaxGptEntries = 4096;
+
+// Apple Partition Map signatures: "ER" starts the driver descriptor in the
+// first block, "PM" each map entry after it.
+constexpr uint16_t kApmDriverSignature = 0x4552;
+constexpr uint16_t kApmEntrySignature = 0x504D;
+constexpr uint32_t kMaxApmEntries = 256;
+
+constexpr uint8_t kMbrHfsPlus = 0xAF;
+constexpr uint8_t kMbrProtective = 0xEE;
+
+uint32_t loadLittleEndian32(const char* p) {
+  const unsigned char* b = (const unsigned char*)p;
+  return (uint32_t)b[0] | (uint32_t)b[1] << 8 | (uint32_t)b[2] << 16 |
+         (uint32_t)b[3] << 24;
+}
+
+uint64_t loadLittleEndian64(const char* p) {
+  return loadLittleEndian32(p) | (uint64_t)loadLittleEndian32(p + 4) << 32;
+}
+
+bool readAt(int fd, uint64_t offset, char* buffer, size_t length) {
+  return pread(fd, buffer, length, offset) == (ssize_t)length;
+}
+
+// Where partition entries are checked and collected.
+struct Scanner {
+  int fd;
+  const Options& options;
+  uint64_t imageSize;
+  std::vector<Volume> volumes;
+
+  // Whether the volume header at offset says HFS+.
+  bool hasHeader(uint64_t offset) {
+    char signature[sizeof(uint16_t)];
+    if (!readAt(fd, offset, signature, sizeof(signature))) return false;
+    uint16_t word = LoadBigEndian16(signature);
+    return word == kHFSPlusSigWord || word == kHFSXSigWord;
+  }
+
+  // Whether either volume header of the volume in [offset, offset + size)
+  // says HFS+.
+  bool hasSignature(uint64_t offset, uint64_t size) {
+    if (size < 4 * options.sectorSize) return false;
+    return hasHeader(offset + 2 * options.sectorSize) ||
+           hasHeader(offset + size - 2 * options.sectorSize);
+  }
+
+  // Keeps the partition if it is typed HFS+ or its headers say it is.
+  void add(uint64_t offset, uint64_t size, bool typed,
+           const std::string& source, const std::string& name) {
+    if (offset >= imageSize || size == 0) return;
+    size = std::min(size, imageSize - offset);
+    bool signature = hasSignature(offset, size);
+    if (typed || signature) {
+      volumes.push_back({offset, size, source, name, signature});
+    }
+  }
+
+  bool readGpt() {
+    for (uint64_t blockSize : kGptBlockSizes) {
+      char header[92];
+      if (!readAt(fd, blockSize, header, sizeof(header)) ||
+          memcmp(header, kGptSignature, sizeof(kGptSignature)) != 0) {
+        continue;
+      }
+      uint64_t entriesBlock = loadLittleEndian64(header + 72);
+      uint32_t count = loadLittleEndian32(header + 80);
+      uint32_t entrySize = loadLittleEndian32(header + 84);
+      if (entrySize < 128 || entrySize > 4096 || count > kMaxGptEntries) {
+        continue;
+      }
+      std::vector<char> entries((size_t)count * entrySize);
+      if (!readAt(fd, entriesBlock * blockSize, entries.data(),
+                  entries.size())) {
+        continue;
+      }
+      for (uint32_t i = 0; i < count; i++) {
+        const char* entry = &entries[(size_t)i * entrySize];
+        uint64_t first = loadLittleEndian64(entry + 32);
+        uint64_t last = loadLittleEndian64(entry + 40);
+        if (last < first) continue;
+        add(first * blockSize, (last - first + 1) * blockSize,
+            memcmp(entry, kGptHfsPlus, sizeof(kGptHfsPlus)) == 0,
+            "GPT partition " + std::to_string(i + 1),
+            "gpt-" + std::to_string(i + 1));
+      }
+      return true;
+    }
+    return false;
+  }
+
+  bool readApm() {
+    char block[512];
+    if (!readAt(fd, 0, block, sizeof(block)) ||
+        LoadBigEndian16(block) != kApmDriverSignature) {
+      return false;
+    }
+    // Entries and partitions are counted in blocks of the map's size.
+    uint64_t blockSize = LoadBigEndian16(block + 2);
+    if (blockSize < 512 || (blockSize & (blockSize - 1)) != 0) {
+      blockSize = 512;
+    }
+    uint32_t count = 1;
+    for (uint32_t i = 1; i <= count && i <= kMaxApmEntries; i++) {
+      if (!readAt(fd, i * blockSize, block, sizeof(block)) ||
+          LoadBigEndian16(block) != kApmEntrySignature) {
+        break;
+      }
+      count = LoadBigEndian32(block + 4);
+      std::string type(block + 48, strnlen(block + 48, 32));
+      add(LoadBigEndian32(block + 8) * blockSize,
+          LoadBigEndian32(block + 12) * blockSize,
+          type == "Apple_HFS" || type == "Apple_HFSX",
+          "APM partition " + std::to_string(i) + " (" + type + ")",
+          "apm-" + std::to_string(i));
+    }
+    return true;
+  }
+
+  bool readMbr() {
+    char sector[512];
+    if (!readAt(fd, 0, sector, sizeof(sector)) ||
+        (uint8_t)sector[510] != 0x55 || (uint8_t)sector[511] != 0xAA) {
+      return false;
+    }
+    for (int i = 0; i < 4; i++) {
+      const char* entry = sector + 446 + 16 * i;
+      uint8_t type = entry[4];
+      if (type == 0 || type == kMbrProtective) continue;
+      add(loadLittleEndian32(entry + 8) * options.sectorSize,
+          loadLittleEndian32(entry + 12) * options.sectorSize,
+          type == kMbrHfsPlus, "MBR partition " + std::to_string(i + 1),
+          "mbr-" + std::to_string(i + 1));
+    }
+    return true;
+  }
+};
+
+}  // namespace
+///////////////////////////////////////////////////////////////////////////////
+
+std::vector<Volume> findVolumes(const Options& options) {
+  int fd = open(options.infile, O_RDONLY);
+  if (fd < 0) throw std::runtime_error("Couldn't open image.");
+  Scanner scanner{fd, options, imageSize(fd), {}};
+
+  // A bare volume has no partition map, its header is at the start.
+  if (!scanner.hasHeader(2 * options.sectorSize) && !scanner.readGpt() &&
+      !scanner.readApm()) {
+    scanner.readMbr();
+  }
+  if (scanner.volumes.empty()) {
+    scanner.volumes.push_back(
+        {0, scanner.imageSize, "whole image", "image",
+         scanner.hasSignature(0, scanner.imageSize)});
+  }
+  close(fd);
+  return scanner.volumes;
+}
@@ -0,0 +1,32 @@
+// HFFS (Help find files script)
+// Author: Michael O'Farrell
+
+#pragma once
+
+#include "rgs.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Images of whole disks hold the HFS+ volume in a partition, which needn't
+// start on a node boundary of the image.  The volumes are found through the
+// disk's partition map: GPT, Apple Partition Map or MBR.
+
+// An HFS+ volume in the image.
+struct Volume {
+  uint64_t offset;
+  uint64_t size;
+  // Where it was found, such as "GPT partition 2".
+  std::string source;
+  // A short name for it that can be used in a path, such as "gpt-2".
+  std::string name;
+  // Whether either volume header carries an HFS+ signature.
+  bool signature;
+};
+
+// Finds the HFS+ volumes through the image's partition map, in map order.
+// Partitions typed as HFS+ are kept even when their headers are damaged, as
+// are partitions of any type whose headers say HFS+.  Without a partition
+// map the image is taken to be a single volume.
+std::vector<Volume> findVolumes(const Options& options);
@@ -0,0 +1,189 @@
+// HFFS (Help find files script)
+// Author: Michael O'Farrell
+
+#include "prefilter.h"
+
+#include "convert.h"
+#include "hfs/hfs_format.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#define HFFS_PREFILTER_X86
+#include <immintrin.h>
+#endif
+
+namespace {
+
+// The smallest leaf record is a catalog thread with an empty name: an 8 byte
+// key, a 10 byte record and its 2 byte offset.
+constexpr uint64_t kMinLeafRecordSize = 20;
+
+// The checks are done on two little endian words of the node:
+//   - Bytes 8 to 11 hold kind, height and the big endian numRecords.
+//   - The last four bytes end with the big endian offset of the first record.
+constexpr uint32_t kKindHeightMask = 0x0000FFFF;
+constexpr uint32_t kKindHeight = (uint8_t)kBTLeafNode | (1 << 8);
+constexpr uint32_t kLastOffsetMask = 0xFFFF0000;
+constexpr uint32_t kLastOffset = sizeof(BTNodeDescriptor) << 24;
+
+struct Limits {
+  uint64_t catalogEnd;
+  uint64_t extentEnd;
+  uint32_t maxRecords;
+};
+
+Limits limits(const Options& options) {
+  uint64_t nodeSize = std::max(options.catalogNodeSize,
+                               options.extentNodeSize);
+  return {
+    options.catalogNodeSize - sizeof(uint32_t),
+    options.extentNodeSize - sizeof(uint32_t),
+    (uint32_t)((nodeSize - sizeof(BTNodeDescriptor)) / kMinLeafRecordSize),
+  };
+}
+
+uint32_t load32(const char* p) {
+  uint32_t x;
+  memcpy(&x, p, sizeof(x));
+  return x;
+}
+
+bool isCandidate(const Limits& l, const char* node) {
+  uint32_t descriptor = load32(node + 8);
+  if ((descriptor & kKindHeightMask) != kKindHeight) return false;
+  uint16_t numRecords = *(const uint16_t*)(node + 10);
+  ConvertBigEndian(&numRecords);
+  if (numRecords == 0 || numRecords > l.maxRecords) return false;
+  return (load32(node + l.catalogEnd) & kLastOffsetMask) == kLastOffset ||
+         (load32(node + l.extentEnd) & kLastOffsetMask) == kLastOffset;
+}
+
+uint64_t findScalar(const Limits& l, const char* base, size_t count,
+                    size_t stride) {
+  uint64_t bitmap = 0;
+  for (size_t i = 0; i < count; i++) {
+    if (isCandidate(l, base + i * stride)) {
+      bitmap |= 1ull << i;
+    }
+  }
+  return bitmap;
+}
+
+#ifdef HFFS_PREFILTER_X86
+
+// Four nodes at a time, the words are loaded one by one.
+uint64_t findSSE2(const Limits& l, const char* base, size_t count,
+                  size_t stride) {
+  const __m128i kindHeightMask = _mm_set1_epi32(kKindHeightMask);
+  const __m128i kindHeight = _mm_set1_epi32(kKindHeight);
+  const __m128i lastOffsetMask = _mm_set1_epi32(kLastOffsetMask);
+  const __m128i lastOffset = _mm_set1_epi32(kLastOffset);
+  const __m128i highByte = _mm_set1_epi32(0xFF00);
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i recordsLimit = _mm_set1_epi32(l.maxRecords + 1);
+
+  uint64_t bitmap = 0;
+  size_t i = 0;
+  for (; i + 4 <= count; i += 4) {
+    const char* n0 = base + i * stride;
+    const char* n1 = n0 + stride;
+    const char* n2 = n1 + stride;
+    const char* n3 = n2 + stride;
+    __m128i descriptor = _mm_set_epi32(load32(n3 + 8), load32(n2 + 8),
+                                       load32(n1 + 8), load32(n0 + 8));
+    __m128i catalogEnd = _mm_set_epi32(
+        load32(n3 + l.catalogEnd), load32(n2 + l.catalogEnd),
+        load32(n1 + l.catalogEnd), load32(n0 + l.catalogEnd));
+    __m128i extentEnd = _mm_set_epi32(
+        load32(n3 + l.extentEnd), load32(n2 + l.extentEnd),
+        load32(n1 + l.extentEnd), load32(n0 + l.extentEnd));
+
+    __m128i numRecords = _mm_or_si128(
+        _mm_and_si128(_mm_srli_epi32(descriptor, 8), highByte),
+        _mm_srli_epi32(descriptor, 24));
+    __m128i match = _mm_cmpeq_epi32(
+        _mm_and_si128(descriptor, kindHeightMask), kindHeight);
+    match = _mm_and_si128(match, _mm_cmpgt_epi32(numRecords, zero));
+    match = _mm_and_si128(match, _mm_cmpgt_epi32(recordsLimit, numRecords));
+    match = _mm_and_si128(match, _mm_or_si128(
+        _mm_cmpeq_epi32(_mm_and_si128(catalogEnd, lastOffsetMask), lastOffset),
+        _mm_cmpeq_epi32(_mm_and_si128(extentEnd, lastOffsetMask), lastOffset)));
+    bitmap |= (uint64_t)_mm_movemask_ps(_mm_castsi128_ps(match)) << i;
+  }
+  return bitmap | (findScalar(l, base + i * stride, count - i, stride) << i);
+}
+
+// Eight nodes at a time, the words are gathered.
+__attribute__((target("avx2")))
+uint64_t findAVX2(const Limits& l, const char* base, size_t count,
+                  size_t stride) {
+  const __m256i kindHeightMask = _mm256_set1_epi32(kKindHeightMask);
+  const __m256i kindHeight = _mm256_set1_epi32(kKindHeight);
+  const __m256i lastOffsetMask = _mm256_set1_epi32(kLastOffsetMask);
+  const __m256i lastOffset = _mm256_set1_epi32(kLastOffset);
+  const __m256i highByte = _mm256_set1_epi32(0xFF00);
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i recordsLimit = _mm256_set1_epi32(l.maxRecords + 1);
+  const __m256i offsets = _mm256_mullo_epi32(
+      _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7),
+      _mm256_set1_epi32((int)stride));
+
+  uint64_t bitmap = 0;
+  size_t i = 0;
+  for (; i + 8 <= count; i += 8) {
+    const char* node = base + i * stride;
+    __m256i descriptor = _mm256_i32gather_epi32(
+        (const int*)(node + 8), offsets, 1);
+    __m256i catalogEnd = _mm256_i32gather_epi32(
+        (const int*)(node + l.catalogEnd), offsets, 1);
+    __m256i extentEnd = _mm256_i32gather_epi32(
+        (const int*)(node + l.extentEnd), offsets, 1);
+
+    __m256i numRecords = _mm256_or_si256(
+        _mm256_and_si256(_mm256_srli_epi32(descriptor, 8), highByte),
+        _mm256_srli_epi32(descriptor, 24));
+    __m256i match = _mm256_cmpeq_epi32(
+        _mm256_and_si256(descriptor, kindHeightMask), kindHeight);
+    match = _mm256_and_si256(match, _mm256_cmpgt_epi32(numRecords, zero));
+    match = _mm256_and_si256(match,
+                             _mm256_cmpgt_epi32(recordsLimit, numRecords));
+    match = _mm256_and_si256(match, _mm256_or_si256(
+        _mm256_cmpeq_epi32(_mm256_and_si256(catalogEnd, lastOffsetMask),
+                           lastOffset),
+        _mm256_cmpeq_epi32(_mm256_and_si256(extentEnd, lastOffsetMask),
+                           lastOffset)));
+    bitmap |= (uint64_t)_mm256_movemask_ps(_mm256_castsi256_ps(match)) << i;
+  }
+  return bitmap | (findSSE2(l, base + i * stride, count - i, stride) << i);
+}
+
+bool haveAVX2() {
+  static const bool avx2 = __builtin_cpu_supports("avx2");
+  return avx2;
+}
+
+#endif
+
+}  // namespace
+///////////////////////////////////////////////////////////////////////////////
+
+bool isLeafCandidate(const Options& options, const char* node) {
+  return isCandidate(limits(options), node);
+}
+
+uint64_t findLeafCandidates(const Options& options, const char* base,
+                            size_t count, size_t stride) {
+  Limits l = limits(options);
+#ifdef HFFS_PREFILTER_X86
+  // Gather offsets are 32 bit.
+  if (haveAVX2() && stride * 8 < INT32_MAX) {
+    return findAVX2(l, base, count, stride);
+  }
+  return findSSE2(l, base, count, stride);
+#else
+  return findScalar(l, base, count, stride);
+#endif
+}
@@ -0,0 +1,28 @@
+// HFFS (Help find files script)
+// Author: Michael O'Farrell
+
+#pragma once
+
+#include "rgs.h"
+
+#include <cstddef>
+#include <cstdint>
+
+// Most of an image is file data.  Before handing a position to the node
+// parsers we check it starts with a plausible leaf node descriptor: kind is
+// kBTLeafNode, height is 1, numRecords is non zero and fits in the node, and
+// the last offset in the node (for either node size) points just past the
+// descriptor.
+
+// The most nodes findLeafCandidates() can check in one call.
+constexpr size_t kMaxCandidateBatch = 64;
+
+// Checks a single node.
+bool isLeafCandidate(const Options& options, const char* node);
+
+// Checks count nodes, stride bytes apart starting at base, several at a time
+// where the CPU allows.  Bit i of the result is set if the node at
+// base + i * stride is a candidate.  Every node checked must be readable up to
+// the larger of the two node sizes.
+uint64_t findLeafCandidates(const Options& options, const char* base,
+                            size_t count, size_t stride);
@@ -3,17 +3,36 @@
 
 #include "recover.h"
 
+#include "claims.h"
 #include "convert.h"
+#include "copy.h"
 #include "hfs/hfs_format.h"
+#include "image.h"
+#include "metrics.h"
+#include "nodes.h"
+#include "prefilter.h"
+#include "snapshot.h"
+#include "trace.h"
 
+#include <fcntl.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <unistd.h>
 
 #include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <exception>
+#include <cstdlib>
 #include <iostream>
+#include <iterator>
 #include <fstream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <unordered_map>
 
 namespace {
 
@@ -21,328 +40,748 @@ void warning(const char* msg) {
   std::cerr << "Warning:" << msg << std::endl;
 }
 
-bool accessIsSafe(size_t length, size_t access) {
-  if (access >= length) return false;
-  return true;
-}
-
+// Shows progress with l, and adds it to the progress file.  Every call shares
+// the one clock, so progress is shown every few seconds whoever shows it.
 template<typename Labda>
 void logInfo(RGS& env, Labda l) {
-  static auto lastInfoTime = std::chrono::system_clock::now();
+  if (!env.metrics || !env.metrics->due()) return;
+  l();
+  env.metrics->progress(env);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// What a scan worker found in its shard of the image.  Records are kept in the
+// order they were found, tagged by the node they came from, so the merge can
+// replay exactly the nodes the serial scan would have visited.
+
+struct ShardIndex {
+  // A node that parsed, and the record counts once it had been indexed.
+  struct Hit {
+    uint64_t position;
+    uint64_t advance;
+    size_t files;
+    size_t folders;
+    size_t extents;
+  };
+
+  Options options;
+  // Which volume, and which range of its scan plan, the shard is in.
+  size_t volume;
+  size_t range;
+  uint64_t begin;
+  uint64_t end;
+  // Where the worker's walk left the shard.
+  uint64_t exit;
+  std::vector<Hit> hits;
+  StringArena names;
+  std::vector<FileInfo> files;
+  std::vector<std::pair<uint32_t, FolderInfo>> folders;
+  std::vector<std::pair<uint64_t, ExtentRecord>> extents;
+};
+
+// The catalog can turn up more than once on disk, so the same file or folder
+// can be found several times.  Only the best copy is kept: the most recently
+// modified, or for copies of the same age the one with more of its extents.
+
+bool betterCopy(const FileInfo& a, const FileInfo& b) {
+  if (a.contentModDate != b.contentModDate) {
+    return a.contentModDate > b.contentModDate;
+  }
+  return std::min(a.foundBlocks, a.totalBlocks) >
+         std::min(b.foundBlocks, b.totalBlocks);
+}
+
+bool sameCopy(const RGS& env, const FileInfo& a, const FileInfo& b,
+              const char* name) {
+  return a.parentID == b.parentID && a.contentModDate == b.contentModDate &&
+         a.logicalSize == b.logicalSize && a.totalBlocks == b.totalBlocks &&
+         a.extentCount == b.extentCount &&
+         memcmp(a.extents, b.extents,
+                a.extentCount * sizeof(HFSPlusExtentDescriptor)) == 0 &&
+         env.names.get(b.name) == name;
+}
 
-  auto now = std::chrono::system_clock::now();
-  std::chrono::duration<double> diff = now - lastInfoTime;
+bool sameCopy(const RGS& env, const FolderInfo& a, const FolderInfo& b,
+              const char* name) {
+  return a.parentID == b.parentID && a.contentModDate == b.contentModDate &&
+         env.names.get(b.name) == name;
+}
+
+// Indexes fi, called name, unless a better copy is already indexed.
+void addFile(RGS& env, FileInfo fi, const char* name) {
+  uint32_t* index = env.fileIndex.find(fi.fileID);
+  if (index) {
+    FileInfo& kept = env.files[*index];
+    env.duplicateRecords++;
+    if (sameCopy(env, fi, kept, name)) return;
+    env.conflictingRecords++;
+    if (!betterCopy(fi, kept)) return;
+    fi.name = env.names.add(name, strlen(name));
+    kept = fi;
+  } else {
+    fi.name = env.names.add(name, strlen(name));
+    env.fileIndex.emplace(fi.fileID, env.files.size());
+    env.files.push_back(fi);
+  }
+  if (env.claims) {
+    for (uint32_t i = 0; i < fi.extentCount; i++) {
+      env.claims->claim(fi.extents[i]);
+    }
+  }
+}
+void addFile(ShardIndex& shard, FileInfo fi, const char* name) {
+  fi.name = shard.names.add(name, strlen(name));
+  shard.files.push_back(fi);
+}
 
-  if (diff.count() > 5.0) {
-    l();
-    lastInfoTime = now;
+void addFolder(RGS& env, uint32_t folderID, FolderInfo fi, const char* name) {
+  FolderInfo* kept = env.folders.find(folderID);
+  if (kept) {
+    env.duplicateRecords++;
+    if (sameCopy(env, fi, *kept, name)) return;
+    env.conflictingRecords++;
+    if (fi.contentModDate <= kept->contentModDate) return;
+    fi.name = env.names.add(name, strlen(name));
+    *kept = fi;
+    return;
   }
+  fi.name = env.names.add(name, strlen(name));
+  env.folders.emplace(folderID, fi);
+}
+void addFolder(ShardIndex& shard, uint32_t folderID, FolderInfo fi,
+               const char* name) {
+  fi.name = shard.names.add(name, strlen(name));
+  shard.folders.emplace_back(std::make_pair(folderID, fi));
+}
+
+void addExtent(RGS& env, uint64_t key, const ExtentRecord& eds) {
+  if (env.extents.emplace(key, eds) && env.claims) {
+    for (const auto& ed : eds) {
+      env.claims->claim(ed);
+    }
+  }
+}
+void addExtent(ShardIndex& shard, uint64_t key, const ExtentRecord& eds) {
+  shard.extents.emplace_back(std::make_pair(key, eds));
 }
 
 ///////////////////////////////////////////////////////////////////////////////
 // The index function are called on verified records.  We now add them to the
-// index.  The input is still in HFSPlus byte order.
-
-void index(RGS& env, HFSPlusCatalogKey* ck) {
-  ConvertBigEndian(ck);
-  
-  char* record = (char*)ck + ck->keyLength + 2;
-  uint16_t recordType = *(uint16_t*)(record);
-  ConvertBigEndian(&recordType);
-
-  char buf[kHFSPlusMaxFileNameChars + 1];
-  DecodeU16(ck->nodeName.unicode, buf, ck->nodeName.length);
-
-  switch (recordType) {
-    case kHFSPlusFolderRecord: {
-      FolderInfo fi;
-      fi.name = std::string(buf);
-      fi.parentID = ck->parentID;
-
-      HFSPlusCatalogFolder* folder = (HFSPlusCatalogFolder*)record;
-      ConvertBigEndian(folder);
-      
-      uint32_t folderID = folder->folderID;
-      env.folders.emplace(std::make_pair(folderID, fi));
-      break;
+// index.  The input is still in HFSPlus byte order, and is only read.
+
+template<typename Index>
+void indexCatalogRecord(Index& env, const char* key) {
+  CatalogRecord record;
+  if (!decodeCatalogRecord(env.options, key, record)) return;
+  if (record.recordType == kHFSPlusFolderRecord) {
+    addFolder(env, record.folderID, record.folder, record.name);
+  } else {
+    addFile(env, record.file, record.name);
+  }
+}
+
+template<typename Index>
+void indexExtentRecord(Index& env, const char* key) {
+  ExtentRecord eds;
+  uint64_t extentKey = decodeExtentRecord(key, eds);
+  addExtent(env, extentKey, eds);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// This is where we scan the image, locating and indexing the files, folders
+// and extents as we scan.
+
+struct ScanStats {
+  size_t positions = 0;
+  size_t processedBTNodes = 0;
+  size_t printedFiles = 0;
+};
+
+// Adds a scan of bytes of the image to the metrics.
+void addScan(const RGS& env, uint64_t bytes, const ScanStats& stats) {
+  if (env.metrics) {
+    env.metrics->addScan(bytes, stats.positions, stats.processedBTNodes);
+  }
+}
+
+void logScanProgress(RGS& env, ScanStats& stats, uint64_t bytes) {
+  logInfo(env, [&]{
+    std::cout << "Processed: " << bytes / env.options.blockSize << " blocks "
+      << bytes << " bytes "
+      << stats.processedBTNodes << " BTNodes "
+      << env.files.size() << " files "
+      << env.folders.size() << " folders "
+      << env.extents.size() << " extents"
+      << std::endl;
+
+    if (env.files.size() > stats.printedFiles) {
+      std::cout << "Found additional " << env.files.size() - stats.printedFiles
+                << " files" << std::endl;
+      stats.printedFiles = env.files.size();
     }
-    case kHFSPlusFileRecord: {
-      FileInfo fi;
-      fi.name = std::string(buf);
-      fi.parentID = ck->parentID;
-
-      HFSPlusCatalogFile* file = (HFSPlusCatalogFile*)record;
-      ConvertBigEndian(file);
-
-      fi.fileID = file->fileID;
-      fi.logicalSize = file->dataFork.logicalSize;
-      fi.totalBlocks = file->dataFork.totalBlocks;
-      if (fi.logicalSize != 0 && fi.totalBlocks != 0 &&
-          (fi.totalBlocks * env.options.blockSize < fi.logicalSize ||
-           (fi.totalBlocks - 1) * env.options.blockSize >= fi.logicalSize)) {
-        if (env.options.permissive) {
-          warning("Block size appears wrong.");
-        } else {
-          std::cout << "File " << fi.name << " Size " << fi.logicalSize
-                    << " Blocks " << fi.totalBlocks << std::endl;
-          return;
-          // throw std::runtime_error("Block size appears wrong.");
-        }
+  });
+}
+
+// Parses buffer as a catalog leaf node of nodeSize bytes, indexing the files
+// and folders in it.  Returns false if it doesn't look like one.
+template<typename Index>
+bool parseCatalogNode(Index& env, const char* buffer, size_t nodeSize) {
+  std::vector<const char*> foundCatalogEntries;
+  {
+    TraceSpan span("process-catalog-node");
+    if (!findCatalogRecords(env.options, buffer, nodeSize,
+                            foundCatalogEntries)) {
+      return false;
+    }
+  }
+  TraceSpan span("index-catalog-records");
+  for (auto entry : foundCatalogEntries) {
+    indexCatalogRecord(env, entry);
+  }
+  return true;
+}
+
+// Parses buffer as an extent leaf node of nodeSize bytes, indexing the extents
+// in it.  Returns false if it doesn't look like one.
+template<typename Index>
+bool parseExtentNode(Index& env, const char* buffer, size_t nodeSize) {
+  std::vector<const char*> foundExtentEntries;
+  {
+    TraceSpan span("process-extent-node");
+    if (!findExtentRecords(env.options, buffer, nodeSize,
+                           foundExtentEntries)) {
+      return false;
+    }
+  }
+  TraceSpan span("index-extent-records");
+  for (auto entry : foundExtentEntries) {
+    indexExtentRecord(env, entry);
+  }
+  return true;
+}
+
+// Looks for a catalog or extent node at buffer and indexes what it finds.
+// Returns how far the scan should advance past this node.  Nodes the prefilter
+// ruled out aren't candidates and are stepped over.
+template<typename Index>
+uint64_t scanNode(Index& env, ScanStats& stats, const char* buffer,
+                  bool candidate) {
+  uint64_t processedSize = 0;
+
+  // This will be used to advance our reading by the appropriate amount and no
+  // more.
+  uint64_t stride = scanStride(env.options);
+  stats.positions++;
+  if (!candidate) return stride;
+
+  // We only care about leaf nodes that contain:
+  //   - File records
+  //   - Folder records
+  //   - Extent records (exclusively)
+  if (env.options.permissive ||
+      BTNodeDescriptorView(buffer).kind() == kBTLeafNode) {
+    stats.processedBTNodes++;
+
+    if (parseCatalogNode(env, buffer, env.options.catalogNodeSize)) {
+      processedSize = env.options.catalogNodeSize;
+    } else if (parseExtentNode(env, buffer, env.options.extentNodeSize)) {
+      processedSize = env.options.extentNodeSize;
+    }
+  }
+  return std::max(stride, processedSize);
+}
+
+// Scans the node at pos, unless it lies in file data the scan can skip.
+uint64_t scanAt(RGS& env, ScanStats& stats, uint64_t pos, const char* buffer,
+                bool candidate) {
+  logScanProgress(env, stats, pos);
+  if (env.claims) {
+    uint64_t next = env.claims->next(pos);
+    if (next != pos) return next - pos;
+  }
+  return scanNode(env, stats, buffer, candidate);
+}
+
+// The first byte past the last node position the scan should visit.
+uint64_t scanEnd(const Options& options, uint64_t size) {
+  uint64_t end = std::min(size, volumeEnd(options));
+  if (options.stopBlock > 0) {
+    return std::min(end, blockOffset(options, options.stopBlock + 1));
+  }
+  return end;
+}
+
+// How much the index holds, to tell what part of a scan added.
+struct IndexSizes {
+  size_t files;
+  size_t folders;
+  size_t extents;
+  uint64_t duplicates;
+};
+
+IndexSizes indexSizes(const RGS& env) {
+  return {env.files.size(), env.folders.size(), env.extents.size(),
+          env.duplicateRecords};
+}
+
+IndexSizes operator-(const IndexSizes& a, const IndexSizes& b) {
+  return {a.files - b.files, a.folders - b.folders, a.extents - b.extents,
+          a.duplicates - b.duplicates};
+}
+
+// A stretch of the image to scan, why, and what scanning it found.
+struct ScanRange {
+  uint64_t begin;
+  uint64_t end;
+  std::string why;
+  IndexSizes found;
+};
+
+// The ranges to scan, in image order and apart from each other.
+typedef std::vector<ScanRange> ScanPlan;
+
+// Walks node positions from begin until the walk passes end, bringing in the
+// image window bytes at a time through mapping, a MappedWindow or ReadWindow.
+// visit(position, buffer, candidate) returns how far to advance, or 0 to stop
+// the walk there.  candidate is false for nodes the prefilter ruled out.
+// Returns where the walk stopped.
+template<typename Window, typename Visit>
+uint64_t walkWindows(const Options& options, Window& mapping, uint64_t window,
+                     uint64_t size, uint64_t begin, uint64_t end,
+                     Visit visit) {
+  uint64_t stride = scanStride(options);
+  uint64_t nodeSpan = std::max(options.catalogNodeSize,
+                               options.extentNodeSize) + kNodeSlack;
+  // Keep this far ahead of the cursor with read ahead requests.
+  uint64_t prefetchSize = std::min<uint64_t>(window, 8 << 20);
+
+  uint64_t pos = begin;
+  while (pos < end) {
+    // Windows overlap by a node so those straddling the edge are read whole.
+    uint64_t mapEnd = std::min(size, pos + window + nodeSpan);
+    {
+      TraceSpan span("map-window");
+      if (!mapping.map(pos, mapEnd)) {
+        throw std::runtime_error("Failed to read image.");
       }
-      if (fi.logicalSize == 0) {
-        return;
+    }
+    mapping.adviseSequential();
+    uint64_t prefetched = pos;
+
+    // The prefilter runs over batches of node positions ahead of the walk.
+    uint64_t batchBegin = 0;
+    uint64_t batchEnd = 0;
+    uint64_t candidates = 0;
+
+    uint64_t windowEnd = std::min(end, pos + window);
+    while (pos < windowEnd && pos + nodeSpan <= mapEnd) {
+      // Skipping ahead leaves earlier read ahead behind.
+      prefetched = std::max(prefetched, pos);
+      if (prefetched < pos + prefetchSize) {
+        mapping.prefetch(prefetched, prefetched + 2 * prefetchSize);
+        prefetched += 2 * prefetchSize;
       }
-      fi.foundBlocks = 0;
-      
-      for (uint32_t i = 0;
-             i < kHFSPlusExtentDensity && fi.foundBlocks < fi.totalBlocks;
-           i++) {
-        fi.extents.emplace_back(file->dataFork.extents[i]);
-        fi.foundBlocks += file->dataFork.extents[i].blockCount;
+      bool candidate = true;
+      if (options.prefilter) {
+        if (pos >= batchEnd || (pos - batchBegin) % stride != 0) {
+          size_t count = std::min<uint64_t>(
+              kMaxCandidateBatch, (mapEnd - nodeSpan - pos) / stride + 1);
+          candidates = findLeafCandidates(options, mapping.at(pos), count,
+                                          stride);
+          batchBegin = pos;
+          batchEnd = pos + count * stride;
+        }
+        candidate = (candidates >> ((pos - batchBegin) / stride)) & 1;
+      }
+      uint64_t advance = visit(pos, mapping.at(pos), candidate);
+      if (advance == 0) return pos;
+      pos += advance;
+    }
+
+    if (pos < windowEnd && mapEnd == size) {
+      // The last few nodes run off the end of the image.  Give them a zero
+      // padded copy so the parsers stay in bounds.
+      std::vector<char> tail(size - pos + nodeSpan, 0);
+      memcpy(tail.data(), mapping.at(pos), size - pos);
+      uint64_t tailStart = pos;
+      while (pos < windowEnd) {
+        const char* buffer = &tail[pos - tailStart];
+        uint64_t advance = visit(pos, buffer,
+                                 !options.prefilter ||
+                                 isLeafCandidate(options, buffer));
+        if (advance == 0) return pos;
+        pos += advance;
       }
-      env.files.emplace_back(fi);
-      break;
     }
-    default:
-      throw std::logic_error("Shouldn't have non folder/file records here.");
   }
-  
+  mapping.unmap();
+  return pos;
 }
 
-void index(RGS& env, HFSPlusExtentKey* ek) {
-  ConvertBigEndian(ek);
+// Walks the image mapped into memory.
+template<typename Visit>
+uint64_t walkMapped(const Options& options, MappedWindow& mapping,
+                    uint64_t size, uint64_t begin, uint64_t end, Visit visit) {
+  return walkWindows(options, mapping,
+                     std::max(options.mmapWindow, options.bufferSize), size,
+                     begin, end, visit);
+}
+
+// Opens the image for mapping, checking the kernel will actually map it.
+int openMappable(const Options& options, uint64_t& size) {
+  int fd = open(options.infile, O_RDONLY);
+  if (fd < 0) return -1;
+  size = imageSize(fd);
+  MappedWindow mapping(fd);
+  if (size == 0 || !mapping.map(0, std::min<uint64_t>(size, 1))) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
 
-  ExtentKey extentKey;
-  extentKey.fileID = ek->fileID;
-  extentKey.startBlock = ek->startBlock;
+// Scans the ranges of the plan by mapping the image into memory a window at a
+// time and walking the nodes in place.  Returns false if the image can't be
+// mapped, in which case nothing has been scanned.
+bool scanMapped(RGS& env, ScanPlan& plan) {
+  uint64_t size;
+  int fd = openMappable(env.options, size);
+  if (fd < 0) return false;
 
-  HFSPlusExtentRecord* er = (HFSPlusExtentRecord*)(ek + 1);
-  ConvertBigEndian(er);
-  
-  std::array<HFSPlusExtentDescriptor, kHFSPlusExtentDensity> eds;
-  memcpy(&eds, er, sizeof(HFSPlusExtentRecord));
-  env.extents.emplace(std::make_pair(extentKey.key, eds));
+  ScanStats stats;
+  MappedWindow mapping(fd);
+  for (auto& range : plan) {
+    IndexSizes before = indexSizes(env);
+    walkMapped(env.options, mapping, size, range.begin, range.end,
+               [&](uint64_t pos, const char* buffer,
+                   bool candidate) -> uint64_t {
+      return scanAt(env, stats, pos, buffer, candidate);
+    });
+    range.found = indexSizes(env) - before;
+    addScan(env, range.end - range.begin, stats);
+    stats.positions = 0;
+    stats.processedBTNodes = 0;
+  }
+  close(fd);
+  return true;
 }
 
-///////////////////////////////////////////////////////////////////////////////
-// These process our two different types of nodes we care about.  Catalog nodes
-// and extent nodes.
-template<typename Lambda>
-bool processNode(RGS& env, size_t nodeSize, char* buffer, Lambda lambda) {
-  // Get the first records offset if it is a catalogNode.
-  size_t reverseCursor = nodeSize - sizeof(uint16_t);
-  uint16_t nodeEndOffset = *(uint16_t*)&buffer[reverseCursor];
-  ConvertBigEndian(&nodeEndOffset);
-  reverseCursor -= sizeof(uint16_t);
-  
-  if (env.options.permissive || nodeEndOffset == sizeof(BTNodeDescriptor)) {
-    size_t cursor = sizeof(BTNodeDescriptor);
-    uint16_t numRead = 0;
-    while (cursor < nodeSize) {
-      // Get the key length for the BTree key.
-      BTreeKey* btkey = (BTreeKey*)&buffer[cursor];
-      uint16_t length = btkey->length16;
-      ConvertBigEndian(&length);
-
-      // Get the records end offset.
-      nodeEndOffset = *(uint16_t*)&buffer[reverseCursor];
-      ConvertBigEndian(&nodeEndOffset);
-      reverseCursor -= sizeof(uint16_t);
-
-      if (!accessIsSafe(kMaxKeyLength, length)) break;
-      char* record = &buffer[cursor + length + sizeof(uint16_t)];
-
-      size_t cursorUpdate = lambda(btkey, record);
-      if (cursorUpdate == -1) return false;
-      if (cursorUpdate == 0) break;
-      numRead++;
-
-      if (nodeEndOffset != cursor + cursorUpdate) {
-        if (!env.options.permissive) {
-          break;
-        } else {
-          warning("Read record with incorrect offset label.");
-        }
-      }
+// Scans the ranges of the plan by reading the image a window at a time, for
+// when it can't be mapped.  The next window is read ahead while this one is
+// scanned.  Returns false if the reader can't be set up, in which case
+// nothing has been scanned.
+bool scanRead(RGS& env, ScanPlan& plan) {
+  int fd = open(env.options.infile, O_RDONLY);
+  if (fd < 0) throw std::runtime_error("Couldn't open image.");
+  uint64_t size = imageSize(fd);
+  uint64_t nodeSpan = std::max(env.options.catalogNodeSize,
+                               env.options.extentNodeSize) + kNodeSlack;
+  uint64_t window = std::max(env.options.bufferSize,
+                             env.options.ioSize * env.options.queueDepth);
 
-      cursor += cursorUpdate;
+  std::unique_ptr<AsyncIo> io;
+  std::unique_ptr<ReadWindow> reader;
+  try {
+    io = openAsyncIo(env.options.queueDepth, env.options.ioUring);
+    reader.reset(new ReadWindow(fd, size, *io, window + 2 * nodeSpan,
+                                nodeSpan));
+  } catch (const std::exception& e) {
+    std::cerr << "Failed to set up reading the image: " << e.what()
+              << std::endl;
+    close(fd);
+    return false;
+  }
+  if (env.metrics) io->timeReads(&env.metrics->readLatency());
+  std::cout << "Reading image with " << io->name() << std::endl;
+  ScanStats stats;
+  for (auto& range : plan) {
+    IndexSizes before = indexSizes(env);
+    walkWindows(env.options, *reader, window, size, range.begin, range.end,
+                [&](uint64_t pos, const char* buffer,
+                    bool candidate) -> uint64_t {
+      return scanAt(env, stats, pos, buffer, candidate);
+    });
+    range.found = indexSizes(env) - before;
+    addScan(env, range.end - range.begin, stats);
+    stats.positions = 0;
+    stats.processedBTNodes = 0;
+  }
+  reader.reset();
+  close(fd);
+  return true;
+}
+
+// Scans the ranges of the plan by streaming the image through a double
+// buffer, the way the scan first worked.  This is the fallback for when the
+// reader can't be set up.  Each half of the buffer is at least --buffer-size
+// and holds a whole node.
+void scanStream(RGS& env, ScanPlan& plan) {
+  std::ifstream file(env.options.infile, std::ios::in|std::ios::binary);
+  if (!file) throw std::runtime_error("Couldn't open image.");
+  uint64_t half = std::max(env.options.bufferSize,
+                           std::max(env.options.catalogNodeSize,
+                                    env.options.extentNodeSize) + kNodeSlack);
+  std::vector<char> backbuffer(half * 2);
+  // Where in the image backbuffer starts, and how much of it was read.
+  // Past what was read it is zeroed, so nodes running off the end of the
+  // image are still read in bounds.
+  uint64_t base = 0;
+  uint64_t filled = 0;
+  auto fill = [&](uint64_t from) {
+    file.read(backbuffer.data() + from, half * 2 - from);
+    filled = from + file.gcount();
+    memset(backbuffer.data() + filled, 0, half * 2 - filled);
+  };
+  // Slides the buffer along until pos is in its lower half.  Returns false
+  // if the image ends before pos.
+  auto reach = [&](uint64_t pos) {
+    if (pos - base >= half * 2) {
+      // Nothing buffered is wanted, start afresh at pos.
+      if (filled == half * 2) file.ignore(pos - base - filled);
+      base = pos;
+      fill(0);
+    } else if (pos - base >= half) {
+      memcpy(backbuffer.data(), backbuffer.data() + half, half);
+      base += half;
+      if (filled == half * 2) {
+        fill(half);
+      } else {
+        filled = filled > half ? filled - half : 0;
+        memset(backbuffer.data() + half, 0, half);
+      }
     }
+    return pos < base + filled;
+  };
 
-    if (numRead == 0) return false;
-    if (numRead != ((BTNodeDescriptor*)buffer)->numRecords) {
-      std::cerr << "Read some from block." << std::endl;
+  fill(0);
+  ScanStats stats;
+  for (auto& range : plan) {
+    IndexSizes before = indexSizes(env);
+    // The ranges are in image order, and the stream only goes forward.
+    uint64_t pos = range.begin;
+    while (pos < range.end && reach(pos)) {
+      const char* buffer = &backbuffer[pos - base];
+      uint64_t advance = scanAt(env, stats, pos, buffer,
+                                !env.options.prefilter ||
+                                isLeafCandidate(env.options, buffer));
+      if (advance == 0) break;
+      pos += advance;
     }
+    range.found = indexSizes(env) - before;
+    addScan(env, range.end - range.begin, stats);
+    stats.positions = 0;
+    stats.processedBTNodes = 0;
+  }
+}
 
-    return true;
+// Whether the worker's walk through the shard visited position.
+bool visited(const ShardIndex& shard, uint64_t stride, uint64_t position) {
+  auto hit = std::upper_bound(
+      shard.hits.begin(), shard.hits.end(), position,
+      [](uint64_t p, const ShardIndex::Hit& h) { return p < h.position; });
+  uint64_t from = shard.begin;
+  if (hit != shard.hits.begin()) {
+    --hit;
+    if (hit->position == position) return true;
+    from = hit->position + hit->advance;
+    if (position < from) return false;
   }
-  return false;
+  return (position - from) % stride == 0;
 }
 
-///////////////////////////////////////////////////////////////////////////////
-// This is where we scan the image, locating and indexing the files, folders
-// and extents as we scan.
-void scan(RGS& env, std::ifstream& file) {
-  char backbuffer[env.options.bufferSize * 2];
-  char* buffer = backbuffer;
-  if (!file.read(backbuffer, env.options.bufferSize * 2)) {
-    std::runtime_error("File empty.");
+// Adds everything a worker found from its first hit at or after position.
+void merge(RGS& env, const ShardIndex& shard, uint64_t position) {
+  auto hit = std::lower_bound(
+      shard.hits.begin(), shard.hits.end(), position,
+      [](const ShardIndex::Hit& h, uint64_t p) { return h.position < p; });
+  size_t files = 0;
+  size_t folders = 0;
+  size_t extents = 0;
+  if (hit != shard.hits.begin()) {
+    --hit;
+    files = hit->files;
+    folders = hit->folders;
+    extents = hit->extents;
   }
-  size_t processedBTNodes = 0;
-  size_t blockNumber = 0;
+  // Names move from the shard's arena to the main one.
+  for (size_t i = files; i < shard.files.size(); i++) {
+    const FileInfo& fi = shard.files[i];
+    addFile(env, fi, shard.names.get(fi.name).c_str());
+  }
+  for (size_t i = folders; i < shard.folders.size(); i++) {
+    const FolderInfo& fi = shard.folders[i].second;
+    addFolder(env, shard.folders[i].first, fi,
+              shard.names.get(fi.name).c_str());
+  }
+  for (size_t i = extents; i < shard.extents.size(); i++) {
+    env.extents.emplace(shard.extents[i].first, shard.extents[i].second);
+  }
+}
 
-  // This will be used to advance our reading by the appropriate amount and no
-  // more.
-  uint64_t minNodeSize = std::min(env.options.catalogNodeSize,
-                                  env.options.extentNodeSize);
+// A volume to scan, and the plan of what to scan in it.
+struct VolumeScan {
+  RGS* env;
+  ScanPlan* plan;
+};
 
-  size_t printedFiles = 0;
-  while (true) {
-    uint64_t processedSize = 0;
-    logInfo(env, [&]{
-        // This will be used to advance our reading by the appropriate amount and no
-        // more.
-      std::cout << "Processed: " << blockNumber << " blocks "
-        << blockNumber * env.options.blockSize << " bytes "
-        << processedBTNodes << " BTNodes " 
-        << env.files.size() << " files "
-        << env.folders.size() << " folders "
-        << env.extents.size() << " extents"
-        << std::endl;
-
-      if (env.files.size() > printedFiles) {
-        std::cout << "Found additional " << env.files.size() - printedFiles
-                  << " files" << std::endl;
-        printedFiles = env.files.size();
-      }
-    });
-    if (buffer - backbuffer >= env.options.bufferSize) {
-      memcpy(&backbuffer, &backbuffer[env.options.bufferSize],
-          env.options.bufferSize);
-      if (!file.read(&backbuffer[env.options.bufferSize],
-            env.options.bufferSize)) {
-        break; // The file is empty.
-      }
-      buffer -= env.options.bufferSize;
-      blockNumber += env.options.bufferSize / env.options.blockSize;
-      if (env.options.stopBlock > 0 && blockNumber > env.options.stopBlock) {
-        break;
+// Scans the image with several threads.  Each volume's plan is cut into
+// shards that workers walk independently, indexing into their own ShardIndex.
+// Workers take the shards of all the volumes in image order, so the volumes
+// are scanned together in one pass through the image.  The merge then follows
+// the walk the serial scan of each volume would have made, which can enter a
+// shard partway through a node a worker parsed.  Until the two walks meet
+// again the merge scans those nodes itself.  The result matches scanMapped().
+bool scanThreaded(std::vector<VolumeScan>& scans) {
+  const Options& first = scans[0].env->options;
+  uint64_t size;
+  int fd = openMappable(first, size);
+  if (fd < 0) return false;
+
+  // Every volume gets a thread of its own.
+  uint64_t threads = std::max<uint64_t>(first.threads, scans.size());
+  uint64_t planned = 0;
+  for (const auto& scan : scans) {
+    for (const auto& range : *scan.plan) {
+      planned += range.end - range.begin;
+    }
+  }
+  std::vector<ShardIndex> shards;
+  for (size_t v = 0; v < scans.size(); v++) {
+    const Options& options = scans[v].env->options;
+    const ScanPlan& plan = *scans[v].plan;
+    uint64_t stride = scanStride(options);
+    uint64_t nodeSpan = std::max(options.catalogNodeSize,
+                                 options.extentNodeSize) + kNodeSlack;
+    // Several shards per thread keeps them all busy to the end.  Shards start
+    // on scan positions and are longer than any node.
+    uint64_t shardSize = planned / (threads * 8) + 1;
+    shardSize = std::max(shardSize, 2 * nodeSpan);
+    shardSize = (shardSize + stride - 1) / stride * stride;
+    for (size_t r = 0; r < plan.size(); r++) {
+      for (uint64_t begin = plan[r].begin; begin < plan[r].end;
+           begin += shardSize) {
+        ShardIndex shard;
+        shard.options = options;
+        shard.volume = v;
+        shard.range = r;
+        shard.begin = begin;
+        shard.end = std::min(plan[r].end, begin + shardSize);
+        shard.exit = shard.end;
+        shards.emplace_back(std::move(shard));
       }
     }
+  }
+  // Volumes don't overlap, so in image order each byte is read once.
+  std::vector<size_t> order(shards.size());
+  for (size_t i = 0; i < order.size(); i++) order[i] = i;
+  std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+    return shards[a].begin < shards[b].begin;
+  });
 
-    BTNodeDescriptor* btnode = (BTNodeDescriptor*)buffer;
-    ConvertBigEndian(btnode);
-
-    // We only care about leaf nodes that contain:
-    //   - File records
-    //   - Folder records
-    //   - Extent records (exclusively)
-    if (env.options.permissive || btnode->kind == kBTLeafNode) {
-      processedBTNodes++;
-      
-      std::vector<HFSPlusCatalogKey*> foundCatalogEntries;
-      std::vector<HFSPlusExtentKey*> foundExtentEntries;
-
-      auto processCatalogNode = [&](BTreeKey* btkey, char* record) -> size_t {
-        uint16_t length = btkey->length16;
-        ConvertBigEndian(&length);
-
-        // Find the name length if this is a catalogue key.
-        uint16_t strLen = ((HFSPlusCatalogKey*)btkey)->nodeName.length;
-        ConvertBigEndian(&strLen);
-
-        // Find the record type if this is a catalog key.
-        uint16_t recordType = *(uint16_t*)record;
-        ConvertBigEndian(&recordType);
-
-        if (  // Check the two lengths stored in catalog keys line up.
-            length == strLen * sizeof(uint16_t)
-            + kHFSPlusCatalogKeyMinimumLength
-            && (  // Check the record type looks correct.
-              recordType == kHFSPlusFolderRecord
-              || recordType == kHFSPlusFileRecord
-              || recordType == kHFSPlusFolderThreadRecord
-              || recordType == kHFSPlusFileThreadRecord
-              )
-           ) {
-          // It is highly likely that we have found a catalog record.
-          // Handle and record the information it held.
-          
-          size_t cursorUpdate = length + sizeof(uint16_t);
-          
-          switch(recordType) {
-            case kHFSPlusFolderRecord:
-              cursorUpdate += sizeof(HFSPlusCatalogFolder);
-              break;
-            case kHFSPlusFileRecord:
-              cursorUpdate += sizeof(HFSPlusCatalogFile);
-              break;
-            case kHFSPlusFolderThreadRecord:  // Falltrough
-            case kHFSPlusFileThreadRecord: {
-              cursorUpdate += sizeof(HFSPlusCatalogThread);
-              cursorUpdate -= sizeof(HFSUniStr255);
-              uint16_t threadNameLength = *(uint16_t*)(((char*)btkey) +
-                                                       cursorUpdate);
-              ConvertBigEndian(&threadNameLength);
-              cursorUpdate += sizeof(uint16_t) * (threadNameLength + 1);
-              break;
+  // Progress and metrics go through the first volume.
+  RGS& reporter = *scans[0].env;
+  std::atomic<size_t> nextShard(0);
+  std::atomic<size_t> doneShards(0);
+  std::atomic<bool> failed(false);
+  std::vector<std::exception_ptr> errors(threads);
+  std::vector<std::thread> workers;
+  for (uint64_t t = 0; t < threads; t++) {
+    workers.emplace_back([&, t] {
+      try {
+        MappedWindow mapping(fd);
+        size_t i;
+        while (!failed && (i = nextShard++) < shards.size()) {
+          ShardIndex& shard = shards[order[i]];
+          uint64_t stride = scanStride(shard.options);
+          TraceSpan span("scan-shard");
+          ScanStats stats;
+          shard.exit = walkMapped(
+              shard.options, mapping, size, shard.begin, shard.end,
+              [&](uint64_t pos, const char* buffer,
+                  bool candidate) -> uint64_t {
+            size_t files = shard.files.size();
+            size_t folders = shard.folders.size();
+            size_t extents = shard.extents.size();
+            uint64_t advance = scanNode(shard, stats, buffer, candidate);
+            if (advance != stride || files != shard.files.size() ||
+                folders != shard.folders.size() ||
+                extents != shard.extents.size()) {
+              shard.hits.push_back({pos, advance, shard.files.size(),
+                                    shard.folders.size(),
+                                    shard.extents.size()});
             }
-            default:
-              return 0;
-          }
-
-          // We have likely found a catalog record.  Record the location for
-          // indexing.
-          if (recordType == kHFSPlusFolderRecord ||
-              recordType == kHFSPlusFileRecord) {
-            foundCatalogEntries.emplace_back(
-              (HFSPlusCatalogKey*)(btkey)
-            );
-          }
-          return cursorUpdate;
-        }
-        return 0;
-      };
-
-      auto processExtentNode = [&](BTreeKey* btkey, char* record) -> size_t {
-        uint16_t length = btkey->length16;
-        ConvertBigEndian(&length);
-
-        if (length == kHFSPlusExtentKeyMaximumLength // Only length.
-            && ((HFSPlusExtentKey*)btkey)->forkType == 0  // data fork
-            ) {
-          // We have likely found an extent record.  Record the location to
-          // index it.
-          foundExtentEntries.emplace_back(
-            (HFSPlusExtentKey*)(btkey)
-          );
-
-          return sizeof(HFSPlusExtentKey) +
-            sizeof(HFSPlusExtentRecord);
-        }
-        return 0;
-      };
-      if (processNode(env, env.options.catalogNodeSize, buffer,
-                      processCatalogNode)) {
-        if (!foundExtentEntries.empty()) {
-          throw std::runtime_error("Extent entries non empty.");
+            return advance;
+          });
+          addScan(reporter, shard.end - shard.begin, stats);
+          doneShards++;
         }
-        for (auto entry : foundCatalogEntries) {
-          index(env, entry);
-        }
-        processedSize = env.options.catalogNodeSize;
-      } else if (processNode(env, env.options.extentNodeSize, buffer,
-                             processExtentNode)) {
-        if (!foundCatalogEntries.empty()) {
-          throw std::runtime_error("Catalog entries non empty.");
-        }
-        for (auto entry : foundExtentEntries) {
-          index(env, entry);
-        }
-        processedSize = env.options.extentNodeSize;
+      } catch (...) {
+        errors[t] = std::current_exception();
+        failed = true;
       }
+    });
+  }
+  while (!failed && doneShards < shards.size()) {
+    logInfo(reporter, [&]{
+      std::cout << "Scanned: " << doneShards << " of " << shards.size()
+                << " shards with " << threads << " threads" << std::endl;
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  }
+  for (auto& worker : workers) {
+    worker.join();
+  }
+  for (auto& error : errors) {
+    if (error) {
+      close(fd);
+      std::rethrow_exception(error);
     }
-    buffer += std::max(minNodeSize, processedSize);
   }
+
+  TraceSpan span("merge-shards");
+  ScanStats stats;
+  MappedWindow mapping(fd);
+  uint64_t cursor = 0;
+  size_t volume = scans.size();
+  size_t range = 0;
+  IndexSizes before;
+  for (auto& shard : shards) {
+    // Each range is walked from its start, like scanMapped() does.
+    if (shard.volume != volume || shard.range != range) {
+      if (volume < scans.size()) {
+        (*scans[volume].plan)[range].found =
+            indexSizes(*scans[volume].env) - before;
+      }
+      volume = shard.volume;
+      range = shard.range;
+      before = indexSizes(*scans[volume].env);
+      cursor = shard.begin;
+    }
+    RGS& env = *scans[volume].env;
+    uint64_t stride = scanStride(shard.options);
+    if (cursor < shard.end && !visited(shard, stride, cursor)) {
+      cursor = walkMapped(env.options, mapping, size, cursor, shard.end,
+                          [&](uint64_t pos, const char* buffer,
+                              bool candidate) -> uint64_t {
+        if (visited(shard, stride, pos)) return 0;
+        return scanNode(env, stats, buffer, candidate);
+      });
+    }
+    if (cursor < shard.end) {
+      merge(env, shard, cursor);
+      cursor = shard.exit;
+    }
+    // Hand the memory back as we go, the shards can be large.
+    shard = ShardIndex();
+  }
+  if (volume < scans.size()) {
+    (*scans[volume].plan)[range].found =
+        indexSizes(*scans[volume].env) - before;
+  }
+  // What the merge scanned again was already counted in bytes.
+  addScan(reporter, 0, stats);
+  close(fd);
+  return true;
 }
 
 // Defragment the file looking up additional extents in the extent table.
@@ -352,142 +791,1384 @@ void defragment(RGS& env, FileInfo& fi) {
     extentKey.fileID = fi.fileID;
     extentKey.startBlock = fi.foundBlocks;
     
-    auto erit = env.extents.find(extentKey.key);
-    if (erit == env.extents.end()) {
+    const ExtentRecord* record = env.extents.find(extentKey.key);
+    if (!record) {
       warning("Couldn't find needed extent.");
       break;
     }
 
-    for (auto ed : erit->second) {
-      fi.extents.emplace_back(ed);
+    for (auto ed : *record) {
+      env.appendExtent(fi, ed);
       fi.foundBlocks += ed.blockCount;
       if (fi.foundBlocks >= fi.totalBlocks) break;
     }
   }
 }
 
-std::string makeFolder(RGS& env, uint32_t parentID) {
-  if (parentID < kHFSFirstUserCatalogNodeID) {
-    return std::string(env.options.outdir);
+///////////////////////////////////////////////////////////////////////////////
+// Following the B-trees from the volume header.  On a lightly damaged volume
+// the catalog and extents files are mostly intact, and reading just those
+// finds what a scan of the whole disk would.
+
+// Byte ranges [first, second) of the image.
+typedef std::vector<std::pair<uint64_t, uint64_t>> ByteRanges;
+
+void addRange(ByteRanges& ranges, uint64_t begin, uint64_t end) {
+  if (!ranges.empty() && ranges.back().second == begin) {
+    ranges.back().second = end;
+  } else {
+    ranges.emplace_back(begin, end);
+  }
+}
+
+// Reads the main and alternate volume headers, converted to host order.
+bool readVolumeHeaders(const Options& options, HFSPlusVolumeHeader& volHeader,
+                       HFSPlusVolumeHeader& altHeader) {
+  std::ifstream file(options.infile, std::ios::in|std::ios::binary);
+  if (!file.is_open()) return false;
+  file.seekg(options.volumeOffset + 2 * options.sectorSize);
+  file.read((char*)&volHeader, sizeof(HFSPlusVolumeHeader));
+  file.seekg(volumeEnd(options) - 2 * options.sectorSize);
+  file.read((char*)&altHeader, sizeof(HFSPlusVolumeHeader));
+  file.close();
+
+  ConvertBigEndian(&volHeader);
+  ConvertBigEndian(&altHeader);
+  return true;
+}
+
+bool trustVolumeHeader(const Options& options,
+                       const HFSPlusVolumeHeader& header) {
+  return (header.signature == kHFSPlusSigWord ||
+          header.signature == kHFSXSigWord) &&
+         header.blockSize == options.blockSize &&
+         header.catalogFile.totalBlocks > 0;
+}
+
+// A B-tree file, read through the extents of its fork.
+struct BTreeFork {
+  FileInfo fork;
+  uint16_t nodeSize;
+  uint32_t firstLeafNode;
+  uint32_t lastLeafNode;
+  uint32_t totalNodes;
+  uint32_t freeNodes;
+};
+
+BTreeFork btreeFork(RGS& env, uint32_t fileID, const HFSPlusForkData& data) {
+  BTreeFork tree;
+  tree.fork.fileID = fileID;
+  tree.fork.parentID = 0;
+  tree.fork.contentModDate = 0;
+  tree.fork.logicalSize = data.logicalSize;
+  tree.fork.totalBlocks = data.totalBlocks;
+  tree.fork.foundBlocks = 0;
+  tree.fork.extentCount = 0;
+  for (uint32_t i = 0; i < kHFSPlusExtentDensity &&
+                       tree.fork.foundBlocks < tree.fork.totalBlocks; i++) {
+    HFSPlusExtentDescriptor ed = data.extents[i];
+    env.appendExtent(tree.fork, ed);
+    tree.fork.foundBlocks += ed.blockCount;
+  }
+  // The extents file holds any further extents, for the catalog file.
+  defragment(env, tree.fork);
+  tree.nodeSize = 0;
+  tree.firstLeafNode = tree.lastLeafNode = tree.totalNodes = 0;
+  tree.freeNodes = 0;
+  return tree;
+}
+
+// Where the bytes [offset, offset + length) of the fork are in the image.
+ByteRanges forkRanges(const RGS& env, const FileInfo& fork, uint64_t offset,
+                      uint64_t length) {
+  ByteRanges ranges;
+  uint64_t extentOffset = 0;
+  for (uint32_t i = 0; i < fork.extentCount; i++) {
+    const auto& extent = env.extent(fork, i);
+    uint64_t extentLength = (uint64_t)extent.blockCount * env.options.blockSize;
+    uint64_t begin = std::max(offset, extentOffset);
+    uint64_t end = std::min(offset + length, extentOffset + extentLength);
+    if (begin < end) {
+      uint64_t physical = blockOffset(env.options, extent.startBlock);
+      addRange(ranges, physical + begin - extentOffset,
+               physical + end - extentOffset);
+    }
+    extentOffset += extentLength;
+  }
+  return ranges;
+}
+
+// Reads the bytes [offset, offset + length) of the fork into buffer.  Returns
+// false if any of them are missing from the fork or the image.
+bool readFork(const RGS& env, int fd, const FileInfo& fork, uint64_t offset,
+              uint64_t length, char* buffer) {
+  uint64_t read = 0;
+  for (const auto& range : forkRanges(env, fork, offset, length)) {
+    uint64_t rangeLength = range.second - range.first;
+    if (pread(fd, buffer + read, rangeLength, range.first) !=
+        (ssize_t)rangeLength) {
+      return false;
+    }
+    read += rangeLength;
+  }
+  return read == length;
+}
+
+// Reads the header node of the tree.  Returns false if the fork doesn't start
+// with a plausible B-tree header.
+bool openBTree(const RGS& env, int fd, BTreeFork& tree) {
+  char header[sizeof(BTNodeDescriptor) + sizeof(BTHeaderRec)];
+  if (!readFork(env, fd, tree.fork, 0, sizeof(header), header)) {
+    return false;
+  }
+  BTNodeDescriptorView descriptor(header);
+  BTHeaderRecView rec(header + sizeof(BTNodeDescriptor));
+  tree.nodeSize = rec.nodeSize();
+  tree.firstLeafNode = rec.firstLeafNode();
+  tree.lastLeafNode = rec.lastLeafNode();
+  tree.totalNodes = rec.totalNodes();
+  tree.freeNodes = rec.freeNodes();
+  // Node sizes are powers of two from 512 bytes to 32KiB.
+  return descriptor.kind() == kBTHeaderNode &&
+         tree.nodeSize >= 512 && (tree.nodeSize & (tree.nodeSize - 1)) == 0 &&
+         (uint64_t)tree.totalNodes * tree.nodeSize <= tree.fork.logicalSize &&
+         tree.firstLeafNode < tree.totalNodes &&
+         tree.lastLeafNode < tree.totalNodes;
+}
+
+// Follows the leaf chain of the tree, handing each node to parse(buffer,
+// nodeSize).  visited marks the nodes that parsed.  Returns false if the chain
+// breaks before reaching the last leaf.
+template<typename Parse>
+bool walkLeaves(const RGS& env, int fd, const BTreeFork& tree,
+                std::vector<bool>& visited, Parse parse) {
+  std::vector<char> buffer(tree.nodeSize + kNodeSlack, 0);
+  uint32_t node = tree.firstLeafNode;
+  uint32_t last = 0;
+  while (node != 0) {
+    if (node >= tree.totalNodes || visited[node]) {
+      warning("B-tree leaf chain leads astray.");
+      return false;
+    }
+    if (!readFork(env, fd, tree.fork, (uint64_t)node * tree.nodeSize,
+                  tree.nodeSize, buffer.data())) {
+      warning("Couldn't read B-tree node.");
+      return false;
+    }
+    BTNodeDescriptorView descriptor(buffer.data());
+    if (descriptor.kind() != kBTLeafNode || descriptor.height() != 1 ||
+        !parse(buffer.data(), tree.nodeSize)) {
+      warning("B-tree leaf node doesn't validate.");
+      return false;
+    }
+    visited[node] = true;
+    last = node;
+    node = descriptor.fLink();
+  }
+  if (last != tree.lastLeafNode) {
+    warning("B-tree leaf chain ends early.");
+    return false;
+  }
+  return true;
+}
+
+// Indexes the leaves of one tree.  Whatever of its fork the walk couldn't
+// account for is added to unread.  Returns the number of leaves read.
+template<typename Parse>
+size_t followBTree(RGS& env, int fd, const char* name, BTreeFork& tree,
+                   ByteRanges& unread, Parse parse) {
+  if (tree.fork.foundBlocks < tree.fork.totalBlocks) {
+    std::cerr << "Missing extents of the " << name << " file." << std::endl;
+  }
+  std::vector<bool> visited;
+  if (!openBTree(env, fd, tree)) {
+    std::cerr << "No valid header node in the " << name << " file."
+              << std::endl;
+    for (const auto& range : forkRanges(env, tree.fork, 0,
+                                        tree.fork.logicalSize)) {
+      unread.emplace_back(range);
+    }
+    return 0;
   }
-  auto fdit = env.folders.find(parentID);
-  std::string path;
-  if (fdit == env.folders.end()) {
-    warning("Couldn't find folder in chain.");
-    path = std::string(env.options.outdir) + "/lost";
+  if (tree.nodeSize != env.options.catalogNodeSize &&
+      tree.nodeSize != env.options.extentNodeSize) {
+    std::cerr << "The " << name << " file has " << tree.nodeSize
+              << " byte nodes, the scan will look for other sizes."
+              << std::endl;
+  }
+
+  visited.assign(tree.totalNodes, false);
+  if (!walkLeaves(env, fd, tree, visited, parse)) {
+    // Every node the walk didn't parse could hold leaves it missed.
+    for (uint32_t node = 0; node < tree.totalNodes; node++) {
+      if (visited[node]) continue;
+      for (const auto& range : forkRanges(env, tree.fork,
+                                          (uint64_t)node * tree.nodeSize,
+                                          tree.nodeSize)) {
+        addRange(unread, range.first, range.second);
+      }
+    }
+  }
+  return std::count(visited.begin(), visited.end(), true);
+}
+
+// Indexes the catalog and extents files by following their B-trees from the
+// volume header.  Parts of the trees that can't be read or don't validate are
+// scanned for instead.  Returns false if no volume header can be trusted, or
+// the catalog file can't be located, leaving the whole volume to be scanned.
+bool followBTrees(RGS& env) {
+  if (!env.options.mmap) {
+    warning("Following the B-trees needs the image mapped, scanning it.");
+    return false;
+  }
+  HFSPlusVolumeHeader volHeader;
+  HFSPlusVolumeHeader altHeader;
+  if (!readVolumeHeaders(env.options, volHeader, altHeader)) return false;
+  const HFSPlusVolumeHeader* header = nullptr;
+  if (trustVolumeHeader(env.options, volHeader)) {
+    header = &volHeader;
+  } else if (trustVolumeHeader(env.options, altHeader)) {
+    warning("Following the B-trees from the alternate volume header.");
+    header = &altHeader;
   } else {
-    path = makeFolder(env, fdit->second.parentID) + "/" + fdit->second.name;
+    warning("No volume header to follow the B-trees from.");
+    return false;
   }
-  if (mkdir(path.c_str(), 0777) < 0) {
-    if (errno != EEXIST) {
-      std::cerr << "Failed to create " << path << std::endl;
-      warning("Couldn't create folder.");
+
+  uint64_t size;
+  int fd = openMappable(env.options, size);
+  if (fd < 0) return false;
+
+  ByteRanges unread;
+  // The extents file goes first, it can hold more of the catalog file's
+  // extents.
+  BTreeFork extentsTree = btreeFork(env, kHFSExtentsFileID,
+                                    header->extentsFile);
+  size_t extentLeaves = followBTree(
+      env, fd, "extents", extentsTree, unread,
+      [&](const char* buffer, size_t nodeSize) {
+    return parseExtentNode(env, buffer, nodeSize);
+  });
+
+  BTreeFork catalogTree = btreeFork(env, kHFSCatalogFileID,
+                                    header->catalogFile);
+  if (catalogTree.fork.foundBlocks < catalogTree.fork.totalBlocks) {
+    warning("Couldn't locate all of the catalog file.");
+    close(fd);
+    return false;
+  }
+  size_t catalogLeaves = followBTree(
+      env, fd, "catalog", catalogTree, unread,
+      [&](const char* buffer, size_t nodeSize) {
+    return parseCatalogNode(env, buffer, nodeSize);
+  });
+
+  std::cout << "Followed B-trees:" << std::endl
+            << "  " << catalogLeaves << " catalog leaf nodes" << std::endl
+            << "  " << extentLeaves << " extents leaf nodes" << std::endl;
+
+  ScanStats stats;
+  MappedWindow mapping(fd);
+  for (const auto& range : unread) {
+    uint64_t begin = std::min(range.first, size);
+    uint64_t end = std::min(range.second, size);
+    std::cout << "Scanning bytes " << begin << " to " << end
+              << " the B-trees didn't account for." << std::endl;
+    walkMapped(env.options, mapping, size, begin, end,
+               [&](uint64_t pos, const char* buffer,
+                   bool candidate) -> uint64_t {
+      logScanProgress(env, stats, pos);
+      return scanNode(env, stats, buffer, candidate);
+    });
+  }
+  close(fd);
+  return true;
+}
+
+// Copies of the catalog turn up at the end of the volume as well as the
+// start.  The end is this much of it, or a hundredth of the volume if that is
+// more.
+constexpr uint64_t kTailSize = 64ull << 20;
+
+uint64_t tailBegin(const Options& options) {
+  uint64_t tail = std::max(kTailSize, options.volumeSize / 100);
+  return options.volumeSize > tail ? volumeEnd(options) - tail :
+                                     options.volumeOffset;
+}
+
+// Sets up --skip-claimed for a scan of the volume.  The B-trees the volume
+// headers point to are never skipped, nor is the end of the volume.
+std::unique_ptr<ClaimedRanges> claimRanges(RGS& env) {
+  std::unique_ptr<ClaimedRanges> claims(new ClaimedRanges(env.options));
+  claims->protect(tailBegin(env.options), volumeEnd(env.options));
+
+  HFSPlusVolumeHeader headers[2];
+  if (readVolumeHeaders(env.options, headers[0], headers[1])) {
+    for (const auto& header : headers) {
+      if (!trustVolumeHeader(env.options, header)) continue;
+      HFSPlusForkData forks[] = {header.catalogFile, header.extentsFile};
+      for (const auto& fork : forks) {
+        for (const auto& ed : fork.extents) {
+          claims->protect(
+              blockOffset(env.options, ed.startBlock),
+              blockOffset(env.options,
+                          (uint64_t)ed.startBlock + ed.blockCount));
+        }
+      }
+    }
+  }
+  return claims;
+}
+
+// The number of nodes of the opened tree up to the last one its map marks in
+// use.  The map is the header node's map record, carried on by map nodes
+// chained from it.  Returns totalNodes if the map can't be read, or it doesn't
+// agree with the header's count of free nodes.
+uint32_t usedNodes(const RGS& env, int fd, const BTreeFork& tree) {
+  std::vector<char> buffer(tree.nodeSize);
+  uint32_t node = 0;
+  // The map record is the header node's third, and a map node's only one.
+  uint16_t record = 2;
+  uint32_t bit = 0;
+  uint32_t used = 0;
+  uint32_t last = 0;
+  for (uint32_t hops = 0; bit < tree.totalNodes; hops++) {
+    if (hops > tree.totalNodes ||
+        !readFork(env, fd, tree.fork, (uint64_t)node * tree.nodeSize,
+                  tree.nodeSize, buffer.data())) {
+      return tree.totalNodes;
+    }
+    BTNodeDescriptorView descriptor(buffer.data());
+    if (descriptor.kind() != (node == 0 ? kBTHeaderNode : kBTMapNode) ||
+        descriptor.numRecords() != record + 1) {
+      return tree.totalNodes;
+    }
+    // Record offsets run back from the end of the node, the last giving where
+    // the free space starts.
+    uint16_t begin = LoadBigEndian16(&buffer[tree.nodeSize - 2 * record - 2]);
+    uint16_t end = LoadBigEndian16(&buffer[tree.nodeSize - 2 * record - 4]);
+    if (begin < sizeof(BTNodeDescriptor) || begin > end ||
+        end > tree.nodeSize - 2 * record - 4) {
+      return tree.totalNodes;
+    }
+    for (uint16_t i = begin; i < end && bit < tree.totalNodes; i++) {
+      for (int j = 7; j >= 0 && bit < tree.totalNodes; j--, bit++) {
+        if (((uint8_t)buffer[i] >> j) & 1) {
+          used++;
+          last = bit;
+        }
+      }
+    }
+    node = descriptor.fLink();
+    record = 0;
+    if (bit < tree.totalNodes && (node == 0 || node >= tree.totalNodes)) {
+      return tree.totalNodes;
+    }
+  }
+  if (used + tree.freeNodes != tree.totalNodes) return tree.totalNodes;
+  return last + 1;
+}
+
+// Adds the part of the tree's fork in use to the plan, as far as its header
+// node and map tell, or the whole fork without them.  Free nodes before the
+// last one in use are kept, they may still hold records worth finding.
+// Returns whether the header node was read.
+bool planTree(const RGS& env, int fd, BTreeFork& tree, const std::string& why,
+              ScanPlan& plan) {
+  bool opened = openBTree(env, fd, tree);
+  uint64_t used = opened ?
+      (uint64_t)usedNodes(env, fd, tree) * tree.nodeSize :
+      tree.fork.logicalSize;
+  for (const auto& range : forkRanges(env, tree.fork, 0, used)) {
+    plan.push_back({range.first, range.second, why, IndexSizes()});
+  }
+  return opened;
+}
+
+// Plans a scan of the catalog and extents files each volume header describes,
+// and of the end of the volume.
+ScanPlan planFromHeaders(const RGS& env, int fd) {
+  ScanPlan plan;
+  HFSPlusVolumeHeader headers[2];
+  const char* names[] = {"main", "alternate"};
+  if (!readVolumeHeaders(env.options, headers[0], headers[1])) return plan;
+  for (int i = 0; i < 2; i++) {
+    if (!trustVolumeHeader(env.options, headers[i])) continue;
+    // The catalog file's extents past the first few are in the extents
+    // file, which is read into its own index to find them.
+    RGS trees{env.options};
+    std::string header = std::string(" (") + names[i] + " header)";
+    BTreeFork extentsTree = btreeFork(trees, kHFSExtentsFileID,
+                                      headers[i].extentsFile);
+    if (planTree(trees, fd, extentsTree, "extents file" + header, plan)) {
+      std::vector<bool> visited(extentsTree.totalNodes, false);
+      walkLeaves(trees, fd, extentsTree, visited,
+                 [&](const char* buffer, size_t nodeSize) {
+        return parseExtentNode(trees, buffer, nodeSize);
+      });
+    }
+    BTreeFork catalogTree = btreeFork(trees, kHFSCatalogFileID,
+                                      headers[i].catalogFile);
+    planTree(trees, fd, catalogTree, "catalog file" + header, plan);
+  }
+  if (plan.empty()) return plan;
+  plan.push_back({tailBegin(env.options), volumeEnd(env.options),
+                  "end of volume", IndexSizes()});
+  return plan;
+}
+
+// Parses --scan-ranges: first-last block ranges, separated by commas.  The
+// last block can be left out to scan to the end.
+ScanPlan parseScanRanges(const Options& options) {
+  // Where block is in the image, refusing blocks past what it can address.
+  auto offset = [&](uint64_t block) {
+    if (block > (UINT64_MAX - options.volumeOffset) / options.blockSize) {
+      throw std::runtime_error("Couldn't understand --scan-ranges.");
+    }
+    return blockOffset(options, block);
+  };
+  ScanPlan plan;
+  const char* ranges = options.scanRanges;
+  while (*ranges) {
+    char* rest;
+    uint64_t first = strtoull(ranges, &rest, 10);
+    if (rest == ranges || *rest != '-') {
+      throw std::runtime_error("Couldn't understand --scan-ranges.");
+    }
+    ranges = rest + 1;
+    uint64_t end = volumeEnd(options);
+    if (*ranges != ',' && *ranges != '\0') {
+      uint64_t last = strtoull(ranges, &rest, 10);
+      if (rest == ranges || (*rest != ',' && *rest != '\0') ||
+          last < first || last == UINT64_MAX) {
+        throw std::runtime_error("Couldn't understand --scan-ranges.");
+      }
+      end = offset(last + 1);
+      ranges = rest;
+    }
+    plan.push_back({offset(first), end, "--scan-ranges", IndexSizes()});
+    if (*ranges == ',') ranges++;
+  }
+  return plan;
+}
+
+// Works out which ranges of the volume to scan: the whole of it, those given
+// by --scan-ranges, or with "auto" those planned from the volume headers.
+// Ranges start on scan positions, end by --stop-block, and are put in order
+// with overlapping ones joined.
+ScanPlan planScan(const RGS& env) {
+  int fd = open(env.options.infile, O_RDONLY);
+  if (fd < 0) throw std::runtime_error("Couldn't open image.");
+  uint64_t size = imageSize(fd);
+
+  const Options& options = env.options;
+  ScanPlan plan;
+  if (!options.scanRanges) {
+    plan.push_back({options.volumeOffset, volumeEnd(options), "whole volume",
+                    IndexSizes()});
+  } else if (std::string(options.scanRanges) == "auto") {
+    plan = planFromHeaders(env, fd);
+    if (plan.empty()) {
+      warning("No volume header to plan the scan from, scanning it all.");
+      plan.push_back({options.volumeOffset, volumeEnd(options),
+                      "whole volume", IndexSizes()});
+    }
+  } else {
+    plan = parseScanRanges(options);
+  }
+  close(fd);
+
+  uint64_t stride = scanStride(options);
+  uint64_t end = scanEnd(options, size);
+  for (auto& range : plan) {
+    uint64_t begin = std::max(range.begin, options.volumeOffset);
+    range.begin = options.volumeOffset +
+                  (begin - options.volumeOffset) / stride * stride;
+    range.end = std::min(range.end, end);
+  }
+  std::stable_sort(plan.begin(), plan.end(),
+                   [](const ScanRange& a, const ScanRange& b) {
+    return a.begin < b.begin;
+  });
+  ScanPlan joined;
+  for (const auto& range : plan) {
+    if (range.begin >= range.end) continue;
+    if (!joined.empty() && range.begin <= joined.back().end) {
+      ScanRange& last = joined.back();
+      last.end = std::max(last.end, range.end);
+      if (last.why.find(range.why) == std::string::npos) {
+        last.why += ", " + range.why;
+      }
+    } else {
+      joined.push_back(range);
     }
   }
-  return path;
+  return joined;
 }
-void save(RGS& env, std::ifstream& infile, const FileInfo& fi) {
-  if (mkdir(env.options.outdir, 0777) < 0) {
-    if (errno != EEXIST) {
-      std::cerr << "Failed to create " << env.options.outdir << std::endl;
+
+// Says what each range of the plan added to the index.
+void printScanPlan(const ScanPlan& plan) {
+  std::cout << "Scanned ranges:" << std::endl;
+  for (const auto& range : plan) {
+    std::cout << "  bytes " << range.begin << " to " << range.end << " ("
+              << range.why << "): " << range.found.files << " files, "
+              << range.found.folders << " folders, "
+              << range.found.extents << " extents, "
+              << range.found.duplicates << " duplicates" << std::endl;
+  }
+}
+
+// What becomes of each file when saving.
+enum SaveState : uint8_t {
+  kNotSaved,  // Left out, or its output file couldn't be created.
+  kToSave,    // Created empty, ready to be copied into.
+  kKept,      // Already saved by an earlier run.
+};
+
+// Marks a file as having nothing to keep from an earlier save.
+constexpr uint64_t kNoKeep = ~0ull;
+
+// The folders files are saved into.  Each folderID is resolved to an output
+// folder once, and the folders are then created in a single pass from the top
+// down, along with the empty files that go in them.
+class OutputFolders {
+ public:
+  // The output folder itself.
+  enum { kRoot = 0 };
+
+  explicit OutputFolders(RGS& env) : env_(env), lost_(0) {
+    folders_.push_back({0, std::string(), env.options.outdir});
+  }
+
+  // The output folder for files whose parent is parentID.
+  uint32_t resolve(uint32_t parentID) {
+    // Walk up to the nearest folder already resolved.
+    std::vector<uint32_t> chain;
+    uint32_t base = kRoot;
+    uint32_t id = parentID;
+    while (id >= kHFSFirstUserCatalogNodeID) {
+      const uint32_t* resolved = byID_.find(id);
+      if (resolved) {
+        base = *resolved;
+        break;
+      }
+      const FolderInfo* folder = env_.folders.find(id);
+      if (!folder) {
+        warning("Couldn't find folder in chain.");
+        base = lost();
+        break;
+      }
+      if (std::find(chain.begin(), chain.end(), id) != chain.end()) {
+        // Each folder of the loop goes in once, under lost.
+        warning("Folder chain loops.");
+        base = lost();
+        break;
+      }
+      chain.push_back(id);
+      id = folder->parentID;
+    }
+    // Then add the rest on the way back down.
+    for (auto it = chain.rbegin(); it != chain.rend(); ++it) {
+      const FolderInfo* folder = env_.folders.find(*it);
+      base = add(base, env_.names.get(folder->name));
+      byID_.emplace(*it, base);
+    }
+    return base;
+  }
+
+  // Has create() make the empty file name in folder, unless it is already
+  // there with keepSize bytes.  file is where its state goes.
+  void addFile(uint32_t folder, Name name, size_t file, uint64_t keepSize) {
+    folders_[folder].files.push_back({name, file, keepSize});
+  }
+
+  // Creates the folders and files added, with mkdirat and openat relative to
+  // each folder's parent so no path is looked up twice.  Sets the state of
+  // each file added.
+  void create(std::vector<SaveState>& states) {
+    TraceSpan span("create-folders");
+    if (mkdir(env_.options.outdir, 0777) < 0 && errno != EEXIST) {
+      std::cerr << "Failed to create " << env_.options.outdir << std::endl;
       warning("Couldn't create folder.");
     }
+    int root = open(env_.options.outdir, O_RDONLY|O_DIRECTORY);
+    // Depth first, holding open only the folders on the way down to the one
+    // being worked on.  Each folder is opened once its turn comes.
+    struct Frame {
+      uint32_t folder;
+      int fd;
+      size_t child;
+    };
+    std::vector<Frame> stack;
+    createFiles(kRoot, root, states);
+    stack.push_back({kRoot, root, 0});
+    while (!stack.empty()) {
+      Frame& frame = stack.back();
+      const Folder& f = folders_[frame.folder];
+      if (frame.child == f.children.size()) {
+        if (frame.fd >= 0) close(frame.fd);
+        stack.pop_back();
+        continue;
+      }
+      uint32_t child = f.children[frame.child++];
+      const std::string& name = folders_[child].name;
+      int childFd = -1;
+      if (frame.fd >= 0) {
+        mkdirat(frame.fd, name.c_str(), 0777);
+        childFd = openat(frame.fd, name.c_str(), O_RDONLY|O_DIRECTORY);
+      }
+      createFiles(child, childFd, states);
+      stack.push_back({child, childFd, 0});
+    }
+  }
+
+  // The paths of the output folders, by the index resolve() gave.
+  std::vector<std::string> paths() const {
+    std::vector<std::string> paths;
+    for (const auto& folder : folders_) {
+      paths.push_back(folder.path);
+    }
+    return paths;
   }
-  auto path = makeFolder(env, fi.parentID) + "/" + fi.name;
 
-  std::ofstream outfile(path, std::ios::out|std::ios::binary);
-  if (outfile.is_open()) {
-    uint64_t sizeLeft = fi.logicalSize;
-    for (const auto& extent : fi.extents) {
-      uint64_t pos = extent.startBlock * env.options.blockSize;
-      uint32_t blocks =  extent.blockCount;
-      infile.seekg(pos);
-      if (!infile) {
-        infile.close();
-        infile = std::ifstream(env.options.infile,
-                               std::ios::in|std::ios::binary);
-        infile.seekg(pos);
+ private:
+  struct OutputFile {
+    Name name;
+    size_t file;
+    uint64_t keepSize;
+  };
+
+  struct Folder {
+    uint32_t parent;
+    std::string name;
+    std::string path;
+    std::vector<uint32_t> children;
+    std::vector<OutputFile> files;
+  };
+
+  // Creates the files added to folder, open as fd.
+  void createFiles(uint32_t folder, int fd, std::vector<SaveState>& states) {
+    const Folder& f = folders_[folder];
+    if (fd < 0) {
+      std::cerr << "Failed to create " << f.path << std::endl;
+      warning("Couldn't create folder.");
+    }
+    for (const auto& file : f.files) {
+      std::string name = env_.names.get(file.name);
+      struct stat st;
+      if (fd >= 0 && file.keepSize != kNoKeep &&
+          fstatat(fd, name.c_str(), &st, 0) == 0 && S_ISREG(st.st_mode) &&
+          (uint64_t)st.st_size == file.keepSize) {
+        states[file.file] = kKept;
+        continue;
       }
-      char buf[env.options.blockSize];
-      while (blocks > 0) {
-        uint64_t bytes = std::min(env.options.blockSize, sizeLeft);
-        infile.read(buf, bytes);
-        if (!infile) throw std::runtime_error("Failed to read.");
-        outfile.write(buf, bytes);
-        if (!outfile) throw std::runtime_error("Failed to write.");
-        sizeLeft -= std::min(env.options.blockSize, sizeLeft);
-        blocks--;
+      int out = fd < 0 ? -1 :
+          openat(fd, name.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0666);
+      if (out < 0) {
+        std::cerr << "Failed to write file " << f.path << "/" << name
+                  << std::endl;
+        warning("Couldn't open output file.");
+        states[file.file] = kNotSaved;
+      } else {
+        close(out);
+        states[file.file] = kToSave;
       }
     }
+  }
 
-    outfile.close();
-  } else {
-    std::cerr << "Failed to write file " << path << std::endl;
-    warning("Couldn't open output file.");
+  uint32_t add(uint32_t parent, const std::string& name) {
+    uint32_t folder = folders_.size();
+    folders_.push_back({parent, name, folders_[parent].path + "/" + name});
+    folders_[parent].children.push_back(folder);
+    return folder;
+  }
+
+  // Where files go whose folders are missing.
+  uint32_t lost() {
+    if (!lost_) lost_ = add(kRoot, "lost");
+    return lost_;
+  }
+
+  RGS& env_;
+  std::vector<Folder> folders_;
+  FlatHashMap<uint32_t, uint32_t> byID_;
+  uint32_t lost_;
+};
+
+// A piece of a recovered file and where it lives in the image.
+struct SaveChunk {
+  uint64_t diskOffset;
+  uint64_t fileOffset;
+  uint64_t length;
+  uint32_t file;  // Index into SavePlan::files.
+};
+
+// A file being saved, and the output folder it goes in.
+struct SaveFile {
+  uint32_t folder;  // Index into SavePlan::folders.
+  Name name;
+  uint32_t fileID;
+  uint64_t size;
+  uint32_t chunks;
+};
+
+// Chunks are no longer than about this, so that several threads can share the
+// work of saving a large file.
+constexpr uint64_t kSaveTaskSize = 8ull << 20;
+
+// Everything to be saved, ordered by where it lives in the image so the image
+// can be read in a single forward pass.
+struct SavePlan {
+  const StringArena* names;
+  std::vector<std::string> folders;
+  std::vector<SaveFile> files;
+  std::vector<SaveChunk> chunks;
+  uint64_t bytes = 0;
+  // Files left as an earlier save wrote them.
+  uint64_t kept = 0;
+};
+
+// Adds run to the plan, split into chunks of at most taskSize bytes.
+void addChunks(SavePlan& plan, SaveChunk run, uint64_t taskSize) {
+  while (run.length > 0) {
+    uint64_t length = std::min(taskSize, run.length);
+    plan.chunks.push_back({run.diskOffset, run.fileOffset, length, run.file});
+    plan.files[run.file].chunks++;
+    run.diskOffset += length;
+    run.fileOffset += length;
+    run.length -= length;
+    plan.bytes += length;
+  }
+}
+
+// How many bytes saving fi writes: up to its logical size, as far as its
+// extents reach.
+uint64_t savedSize(const RGS& env, const FileInfo& fi) {
+  uint64_t size = 0;
+  for (uint32_t e = 0; e < fi.extentCount && size < fi.logicalSize; e++) {
+    size += std::min(
+        (uint64_t)env.extent(fi, e).blockCount * env.options.blockSize,
+        fi.logicalSize - size);
+  }
+  return size;
+}
+
+// Where in the output folder the save journal is kept.
+constexpr char kJournalName[] = ".hffs-save-journal";
+// Journal entries are written every this many files, or this many seconds.
+constexpr size_t kJournalBatch = 4096;
+constexpr double kJournalInterval = 5.0;
+
+// The files a save into the output folder has finished, kept in a journal
+// there so that an interrupted save can pick up where it left off.  Entries
+// are written in batches, each once everything written before it has reached
+// the disk.
+class SaveJournal {
+ public:
+  explicit SaveJournal(RGS& env)
+      : path_(std::string(env.options.outdir) + "/" + kJournalName),
+        valid_(0), fd_(-1), pending_(0),
+        lastFlush_(std::chrono::steady_clock::now()) {
+    std::ostringstream header;
+    header << "hffs save journal " << infileSize(env) << " "
+           << env.options.blockSize << "\n";
+    header_ = header.str();
+    read();
+  }
+  ~SaveJournal() {
+    try {
+      flush();
+    } catch (const std::exception&) {
+      warning("Couldn't write save journal.");
+    }
+    if (fd_ >= 0) close(fd_);
+  }
+
+  SaveJournal(const SaveJournal&) = delete;
+  SaveJournal& operator=(const SaveJournal&) = delete;
+
+  // The size an earlier save finished fileID at, or kNoKeep.
+  uint64_t finished(uint32_t fileID) const {
+    const uint64_t* size = finished_.find(fileID);
+    return size ? *size : kNoKeep;
+  }
+
+  // Notes that fileID has been saved with size bytes.
+  void finish(uint32_t fileID, uint64_t size) {
+    std::string batch;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      batch_ += std::to_string(fileID) + " " + std::to_string(size) + "\n";
+      pending_++;
+      std::chrono::duration<double> waited =
+          std::chrono::steady_clock::now() - lastFlush_;
+      if (pending_ < kJournalBatch && waited.count() <= kJournalInterval) {
+        return;
+      }
+      batch = take();
+    }
+    write(batch);
+  }
+
+  // Writes out whatever hasn't been yet.
+  void flush() {
+    std::string batch;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      batch = take();
+    }
+    write(batch);
+  }
+
+ private:
+  static uint64_t infileSize(RGS& env) {
+    int fd = open(env.options.infile, O_RDONLY);
+    uint64_t size = fd < 0 ? 0 : imageSize(fd);
+    if (fd >= 0) close(fd);
+    return size;
+  }
+
+  // Loads the entries of a journal left by an earlier save of the same image.
+  // Anything after the last complete entry is dropped.
+  void read() {
+    std::ifstream in(path_, std::ios::in|std::ios::binary);
+    std::string journal((std::istreambuf_iterator<char>(in)),
+                        std::istreambuf_iterator<char>());
+    if (journal.compare(0, header_.size(), header_) != 0) return;
+    size_t end = header_.size();
+    for (size_t next; (next = journal.find('\n', end)) != std::string::npos;
+         end = next + 1) {
+      const char* line = journal.c_str() + end;
+      char* rest;
+      uint64_t fileID = strtoull(line, &rest, 10);
+      uint64_t size = strtoull(rest, &rest, 10);
+      if (rest != journal.c_str() + next) break;
+      finished_.emplace(fileID, size);
+    }
+    valid_ = end;
+  }
+
+  // Hands over the batch to be written.  Called with mutex_ held.
+  std::string take() {
+    std::string batch;
+    batch.swap(batch_);
+    pending_ = 0;
+    lastFlush_ = std::chrono::steady_clock::now();
+    return batch;
+  }
+
+  // Appends batch, once what it records is safely on disk.  The sync is done
+  // without holding mutex_, so workers can go on finishing files meanwhile.
+  void write(std::string& batch) {
+    if (batch.empty()) return;
+    std::lock_guard<std::mutex> lock(writeMutex_);
+    if (fd_ < 0) {
+      fd_ = open(path_.c_str(), O_WRONLY|O_CREAT, 0666);
+      if (fd_ < 0 || ftruncate(fd_, valid_) < 0 ||
+          lseek(fd_, 0, SEEK_END) < 0) {
+        throw std::runtime_error("Couldn't write save journal.");
+      }
+      if (valid_ == 0) batch = header_ + batch;
+    }
+#ifdef __linux__
+    if (syncfs(fd_) < 0) {
+      throw std::runtime_error("Couldn't sync saved files.");
+    }
+#else
+    sync();
+#endif
+    for (size_t done = 0; done < batch.size();) {
+      ssize_t written = ::write(fd_, batch.data() + done,
+                                batch.size() - done);
+      if (written < 0 && errno == EINTR) continue;
+      if (written <= 0) {
+        throw std::runtime_error("Couldn't write save journal.");
+      }
+      done += written;
+    }
+    if (fdatasync(fd_) < 0) {
+      throw std::runtime_error("Couldn't write save journal.");
+    }
+  }
+
+  std::string path_;
+  std::string header_;
+  FlatHashMap<uint32_t, uint64_t> finished_;
+  // How much of the journal on disk is whole and for this image.
+  uint64_t valid_;
+  // Guards the batch being gathered.
+  std::mutex mutex_;
+  // Guards fd_ and the writing of batches.
+  std::mutex writeMutex_;
+  int fd_;
+  std::string batch_;
+  size_t pending_;
+  std::chrono::steady_clock::time_point lastFlush_;
+};
+
+// Creates the folders and empty output files for every file, and lays out
+// their extents.  Like saving them one after another, when several files end
+// up at the same path the last one wins.  Files the journal says an earlier
+// save finished are left alone if they are still the size it wrote.
+SavePlan planSave(RGS& env, const SaveJournal& journal) {
+  uint64_t ioSize = env.options.ioSize;
+  uint64_t taskSize = std::max<uint64_t>(kSaveTaskSize / ioSize, 1) * ioSize;
+
+  OutputFolders folders(env);
+  std::vector<uint32_t> folderOf(env.files.size());
+  std::unordered_map<std::string, size_t> lastFile;
+  for (size_t i = 0; i < env.files.size(); i++) {
+    folderOf[i] = folders.resolve(env.files[i].parentID);
+    std::string key((const char*)&folderOf[i], sizeof(uint32_t));
+    lastFile[key + env.names.get(env.files[i].name)] = i;
+  }
+  std::vector<uint64_t> sizes(env.files.size());
+  for (const auto& last : lastFile) {
+    size_t i = last.second;
+    const auto& fi = env.files[i];
+    sizes[i] = savedSize(env, fi);
+    uint64_t keepSize = journal.finished(fi.fileID) == sizes[i] ?
+                        sizes[i] : kNoKeep;
+    folders.addFile(folderOf[i], fi.name, i, keepSize);
+  }
+  lastFile.clear();
+  std::vector<SaveState> states(env.files.size(), kNotSaved);
+  folders.create(states);
+
+  SavePlan plan;
+  plan.names = &env.names;
+  plan.folders = folders.paths();
+  for (size_t i = 0; i < env.files.size(); i++) {
+    if (states[i] == kKept) plan.kept++;
+    if (states[i] != kToSave) continue;
+    const auto& fi = env.files[i];
+    uint32_t file = plan.files.size();
+    plan.files.push_back({folderOf[i], fi.name, fi.fileID, sizes[i], 0});
+    // Extents that follow on from each other in the image are copied as one.
+    SaveChunk run = {0, 0, 0, file};
+    for (uint32_t e = 0; e < fi.extentCount; e++) {
+      const auto& extent = env.extent(fi, e);
+      uint64_t fileOffset = run.fileOffset + run.length;
+      if (fileOffset >= fi.logicalSize) break;
+      uint64_t diskOffset = blockOffset(env.options, extent.startBlock);
+      uint64_t length = std::min(
+          (uint64_t)extent.blockCount * env.options.blockSize,
+          fi.logicalSize - fileOffset);
+      if (run.length > 0 && run.diskOffset + run.length == diskOffset) {
+        run.length += length;
+      } else {
+        addChunks(plan, run, taskSize);
+        run = {diskOffset, fileOffset, length, file};
+      }
+    }
+    addChunks(plan, run, taskSize);
+  }
+
+  std::stable_sort(plan.chunks.begin(), plan.chunks.end(),
+                   [](const SaveChunk& a, const SaveChunk& b) {
+    return a.diskOffset < b.diskOffset;
+  });
+  return plan;
+}
+
+// The output files being written, shared by the save threads.  Chunks of a
+// file tend to be near each other in the image, so the most recently used few
+// are kept open.
+class OutputFiles {
+ public:
+  explicit OutputFiles(const SavePlan& plan) : plan_(plan), uses_(0) {}
+  ~OutputFiles() {
+    for (const auto& slot : slots_) {
+      close(slot.fd);
+    }
+    for (const auto& slot : folders_) {
+      close(slot.fd);
+    }
+  }
+
+  OutputFiles(const OutputFiles&) = delete;
+  OutputFiles& operator=(const OutputFiles&) = delete;
+
+  // Returns a descriptor to write the file through.  It stays open until
+  // release() is called for the file.
+  int acquire(uint32_t file) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    uses_++;
+    Slot* lru = nullptr;
+    for (auto& slot : slots_) {
+      if (slot.file == file) {
+        slot.users++;
+        slot.lastUse = uses_;
+        return slot.fd;
+      }
+      if (slot.users == 0 && (!lru || slot.lastUse < lru->lastUse)) {
+        lru = &slot;
+      }
+    }
+    TraceSpan span("open-output");
+    int folder = folderFd(plan_.files[file].folder);
+    std::string name = plan_.names->get(plan_.files[file].name);
+    int fd = folder < 0 ? -1 : openat(folder, name.c_str(), O_WRONLY);
+    if (fd < 0) throw std::runtime_error("Failed to write.");
+    if (slots_.size() < kOpenFiles || !lru) {
+      slots_.push_back({file, fd, uses_, 1});
+    } else {
+      close(lru->fd);
+      *lru = {file, fd, uses_, 1};
+    }
+    return fd;
+  }
+
+  void release(uint32_t file) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto& slot : slots_) {
+      if (slot.file == file) {
+        slot.users--;
+        return;
+      }
+    }
+  }
+
+ private:
+  static constexpr size_t kOpenFiles = 64;
+  static constexpr size_t kOpenFolders = 16;
+
+  struct Slot {
+    uint32_t file;
+    int fd;
+    uint64_t lastUse;
+    uint32_t users;
+  };
+
+  struct FolderSlot {
+    uint32_t folder;
+    int fd;
+    uint64_t lastUse;
+  };
+
+  // A descriptor of output folder folder, to open its files relative to.
+  // The most recently used folders are kept open.
+  int folderFd(uint32_t folder) {
+    FolderSlot* lru = nullptr;
+    for (auto& slot : folders_) {
+      if (slot.folder == folder) {
+        slot.lastUse = uses_;
+        return slot.fd;
+      }
+      if (!lru || slot.lastUse < lru->lastUse) lru = &slot;
+    }
+    int fd = open(plan_.folders[folder].c_str(), O_RDONLY|O_DIRECTORY);
+    if (fd < 0) return fd;
+    if (folders_.size() < kOpenFolders) {
+      folders_.push_back({folder, fd, uses_});
+    } else {
+      close(lru->fd);
+      *lru = {folder, fd, uses_};
+    }
+    return fd;
+  }
+
+  const SavePlan& plan_;
+  std::mutex mutex_;
+  std::vector<Slot> slots_;
+  std::vector<FolderSlot> folders_;
+  uint64_t uses_;
+};
+
+// A save thread's share of the plan, the chunks [next, end).  The owner works
+// forward from the front, idle threads steal the back half.
+struct SaveQueue {
+  std::mutex mutex;
+  size_t next = 0;
+  size_t end = 0;
+};
+
+// Takes the next chunk for thread self, stealing from another thread when it
+// has run out.  Returns false when there is nothing left anywhere.
+bool takeChunk(std::vector<SaveQueue>& queues, size_t self, size_t& chunk) {
+  {
+    std::lock_guard<std::mutex> lock(queues[self].mutex);
+    if (queues[self].next < queues[self].end) {
+      chunk = queues[self].next++;
+      return true;
+    }
+  }
+  for (size_t i = 1; i < queues.size(); i++) {
+    SaveQueue& victim = queues[(self + i) % queues.size()];
+    size_t begin, end;
+    {
+      std::lock_guard<std::mutex> lock(victim.mutex);
+      size_t left = victim.end - victim.next;
+      if (left == 0) continue;
+      begin = victim.next + left / 2;
+      end = victim.end;
+      victim.end = begin;
+    }
+    std::lock_guard<std::mutex> lock(queues[self].mutex);
+    queues[self].next = begin + 1;
+    queues[self].end = end;
+    chunk = begin;
+    return true;
+  }
+  return false;
+}
+
+// Saves every file.  Each thread starts on its own stretch of the image and
+// streams through it front to back, so with a single thread the image is read
+// in one forward pass.
+void save(RGS& env) {
+  SaveJournal journal(env);
+  SavePlan plan = planSave(env, journal);
+  if (plan.kept > 0) {
+    std::cout << "Keeping " << plan.kept << " files already saved."
+              << std::endl;
+  }
+  // Files are finished once their last chunk is.
+  std::unique_ptr<std::atomic<uint32_t>[]> chunksLeft(
+      new std::atomic<uint32_t>[plan.files.size()]);
+  for (size_t i = 0; i < plan.files.size(); i++) {
+    chunksLeft[i] = plan.files[i].chunks;
+    if (plan.files[i].chunks == 0) {
+      journal.finish(plan.files[i].fileID, 0);
+    }
+  }
+
+  int infd = open(env.options.infile, O_RDONLY);
+  if (infd < 0) throw std::runtime_error("Couldn't open image.");
+  OutputFiles outputs(plan);
+  FileCopier copier(env.options.copyEngine);
+
+  uint64_t threads = env.options.threads;
+  std::vector<SaveQueue> queues(threads);
+  for (uint64_t t = 0; t < threads; t++) {
+    queues[t].next = plan.chunks.size() * t / threads;
+    queues[t].end = plan.chunks.size() * (t + 1) / threads;
+  }
+
+  std::atomic<uint64_t> saved(0);
+  std::atomic<bool> failed(false);
+  std::vector<std::exception_ptr> errors(threads);
+  auto work = [&](uint64_t t) {
+    try {
+      CopyQueue queue(copier, env.options,
+                      env.metrics ? &env.metrics->readLatency() : nullptr);
+      size_t i;
+      while (!failed && takeChunk(queues, t, i)) {
+        const SaveChunk& chunk = plan.chunks[i];
+        queue.copy(infd, chunk.diskOffset, outputs.acquire(chunk.file),
+                   chunk.fileOffset, chunk.length, [&, i] {
+          uint32_t file = plan.chunks[i].file;
+          outputs.release(file);
+          saved += plan.chunks[i].length;
+          if (--chunksLeft[file] == 0) {
+            journal.finish(plan.files[file].fileID, plan.files[file].size);
+          }
+        });
+        if (t == 0) {
+          logInfo(env, [&]{
+            std::cout << "Saving: " << saved << " bytes of " << plan.bytes
+              << " bytes with " << threads << " threads" << std::endl;
+          });
+        }
+      }
+      queue.finish();
+    } catch (...) {
+      errors[t] = std::current_exception();
+      failed = true;
+    }
+  };
+  // The calling thread does its share too, and reports progress.
+  std::vector<std::thread> workers;
+  for (uint64_t t = 1; t < threads; t++) {
+    workers.emplace_back(work, t);
+  }
+  work(0);
+  for (auto& worker : workers) {
+    worker.join();
+  }
+  close(infd);
+  for (auto& error : errors) {
+    if (error) std::rethrow_exception(error);
+  }
+  journal.flush();
+
+  std::cout << "Saved " << plan.files.size() << " files" << std::endl
+            << "  " << copier.reflinked() << " bytes reflinked" << std::endl
+            << "  " << copier.copiedInKernel() << " bytes copied in kernel"
+            << std::endl
+            << "  " << copier.copiedThroughBuffer()
+            << " bytes copied through buffer" << std::endl;
+  if (env.metrics) {
+    env.metrics->addSaved(copier.reflinked(), copier.copiedInKernel(),
+                          copier.copiedThroughBuffer());
   }
 }
 
 }  // namespace
 ///////////////////////////////////////////////////////////////////////////////
 
-void recover(RGS& env) {
+bool indexCatalogNode(RGS& env, const char* buffer, size_t nodeSize) {
+  return parseCatalogNode(env, buffer, nodeSize);
+}
+
+bool indexExtentNode(RGS& env, const char* buffer, size_t nodeSize) {
+  return parseExtentNode(env, buffer, nodeSize);
+}
+
+void recoverVolumes(const std::vector<RGS*>& volumes) {
   std::cout << std::endl << "Beginning recovery." << std::endl;
 
-  std::ifstream file(env.options.infile, std::ios::in|std::ios::binary);
-  if (file.is_open()) {
-    scan(env, file);
+  std::ifstream file(volumes[0]->options.infile,
+                     std::ios::in|std::ios::binary);
+  if (!file.is_open()) {
+    throw std::runtime_error("Couldn't open image.");
+  }
+  bool several = volumes.size() > 1;
+  Metrics* metrics = volumes[0]->metrics;
+  auto heading = [&](const RGS& env) {
+    if (several) {
+      std::cout << std::endl << "Volume at " << env.options.volumeOffset
+                << ":" << std::endl;
+    }
+  };
+
+  // Each volume finds out what it needs scanned first, so they can all be
+  // scanned together.
+  std::vector<std::unique_ptr<ClaimedRanges>> claims(volumes.size());
+  std::vector<ScanPlan> plans(volumes.size());
+  std::vector<bool> scanned(volumes.size());
+  std::vector<bool> followed(volumes.size());
+  std::vector<bool> sharing(volumes.size());
+  std::vector<VolumeScan> shared;
+  for (size_t v = 0; v < volumes.size(); v++) {
+    RGS& env = *volumes[v];
+    heading(env);
+    if (env.options.loadIndex) {
+      Metrics::Phase phase(metrics, "load-snapshot");
+      loadSnapshot(env, env.options.loadIndex);
+      continue;
+    }
+    if (env.options.skipClaimed) {
+      claims[v] = claimRanges(env);
+      if (env.options.threads > 1 || several) {
+        warning("Skipping file data needs a single thread, scanning with "
+                "one.");
+      }
+    }
+    if (env.options.followBTrees) {
+      Metrics::Phase phase(metrics, "follow-btrees");
+      scanned[v] = followBTrees(env);
+    }
+    followed[v] = scanned[v];
+    if (!followed[v]) {
+      Metrics::Phase phase(metrics, "plan");
+      plans[v] = planScan(env);
+    }
+    env.claims = claims[v].get();
+    if (!scanned[v] && env.options.mmap && !claims[v] &&
+        (env.options.threads > 1 || several)) {
+      shared.push_back({&env, &plans[v]});
+      sharing[v] = true;
+    }
+  }
 
-    std::cout << std::endl << "Scanning done." << std::endl
-              << "Found:" << std::endl
+  {
+    Metrics::Phase phase(metrics, "scan");
+    bool mappable = true;
+    if (!shared.empty()) {
+      mappable = scanThreaded(shared);
+      if (!mappable) {
+        warning("Couldn't map image, falling back to reading it.");
+      }
+    }
+    for (size_t v = 0; v < volumes.size(); v++) {
+      RGS& env = *volumes[v];
+      if (env.options.loadIndex) continue;
+      if (sharing[v] && mappable) scanned[v] = true;
+      if (!scanned[v] && env.options.mmap && mappable) {
+        scanned[v] = scanMapped(env, plans[v]);
+        if (!scanned[v]) {
+          warning("Couldn't map image, falling back to reading it.");
+        }
+      }
+      if (!scanned[v]) {
+        scanned[v] = scanRead(env, plans[v]);
+        if (!scanned[v]) {
+          warning("Couldn't set up reading the image, streaming it instead.");
+        }
+      }
+      if (!scanned[v]) {
+        scanStream(env, plans[v]);
+      }
+    }
+  }
+  std::cout << std::endl << "Scanning done." << std::endl;
+
+  for (size_t v = 0; v < volumes.size(); v++) {
+    RGS& env = *volumes[v];
+    heading(env);
+    if (!env.options.loadIndex) {
+      if (!followed[v] && env.options.scanRanges) {
+        printScanPlan(plans[v]);
+      }
+      if (claims[v]) {
+        env.claims = nullptr;
+        std::cout << "Skipped " << claims[v]->skipped()
+                  << " bytes of file data." << std::endl;
+      }
+
+      if (env.options.saveIndex) {
+        Metrics::Phase phase(metrics, "save-snapshot");
+        saveSnapshot(env, env.options.saveIndex);
+        std::cout << "Saved snapshot to " << env.options.saveIndex
+                  << std::endl;
+      }
+    }
+
+    if (metrics) metrics->noteSizes(env);
+    std::cout << "Found:" << std::endl
               << "  " << env.files.size() << " files" << std::endl
               << "  " << env.folders.size() << " folders" << std::endl
-              << "  " << env.extents.size() << " fragment extents" << std::endl;
-
-    size_t fileNumber = 0;
-    for (auto& f : env.files) {
-      logInfo(env, [&]{
-        std::cout << "Defragmented: " << fileNumber << " files of "
-          << env.files.size() << " files"
-          << std::endl;
-      });
-      defragment(env, f);
-      fileNumber++;
+              << "  " << env.extents.size() << " fragment extents" << std::endl
+              << "  " << env.duplicateRecords << " duplicate records, "
+              << env.conflictingRecords << " conflicting" << std::endl;
+
+    {
+      Metrics::Phase phase(metrics, "defragment");
+      size_t fileNumber = 0;
+      for (auto& f : env.files) {
+        logInfo(env, [&]{
+          std::cout << "Defragmented: " << fileNumber << " files of "
+            << env.files.size() << " files"
+            << std::endl;
+        });
+        defragment(env, f);
+        fileNumber++;
+      }
     }
+    if (metrics) metrics->noteSizes(env);
 
     std::cout << "Defragmenting done." << std::endl;
 
-    fileNumber = 0;
-    for (auto const& f : env.files) {
-      logInfo(env, [&]{
-        std::cout << "Saving: " << fileNumber << " files of "
-          << env.files.size() << " files"
-          << std::endl;
-      });
-      save(env, file, f);
-      fileNumber++;
+    {
+      Metrics::Phase phase(metrics, "save");
+      save(env);
     }
 
     std::cout << "Saving done." << std::endl;
-
-    file.close();
-  } else {
-    throw std::runtime_error("Couldn't open image.");
   }
+
+  file.close();
+}
+
+void recover(RGS& env) {
+  recoverVolumes({&env});
 }
 
 void verify(RGS& env) {
-  std::ifstream file(env.options.infile, std::ios::in|std::ios::binary);
   HFSPlusVolumeHeader volHeader;
   HFSPlusVolumeHeader altHeader;
-  if (file.is_open()) {
-    file.seekg(2 * env.options.sectorSize);
-    file.read((char*)&volHeader, sizeof(HFSPlusVolumeHeader));
-    file.seekg(-2 * env.options.sectorSize, std::ios::end);
-    file.read((char*)&altHeader, sizeof(HFSPlusVolumeHeader));
-    file.close();
-
-    ConvertBigEndian(&volHeader);
-    ConvertBigEndian(&altHeader);
+  if (readVolumeHeaders(env.options, volHeader, altHeader)) {
     if (volHeader.signature != kHFSPlusSigWord) {
       warning("Main volume header reporting incorrect signature.");
     }
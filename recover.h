@@ -5,12 +5,19 @@
 
 #include "rgs.h"
 
+#include <vector>
+
 // Attempt to recover files.  Using a two phase approach:
 //   - Find blocks holding file, folder, and extent records.
 //   - Recover each file by chaining the folders to determine its location, and
 //     chaining the extents to find its location on the disk.
 void recover(RGS& env);
 
+// Recovers several volumes of the same image at once, each into its own
+// output folder.  Volumes that are scanned rather than followed or loaded
+// from a snapshot are scanned together, in one pass through the image.
+void recoverVolumes(const std::vector<RGS*>& volumes);
+
 // Verify the tags in the Volume blocks, and print out the block sizes.
 // Arguments:
 //   img: the filename to process.
@@ -3,14 +3,24 @@
 
 #pragma once
 
+#include "containers.h"
 #include "hfs/hfs_format.h"
 
 #include <array>
 #include <cstdint>
-#include <string>
-#include <unordered_map>
 #include <vector>
 
+class ClaimedRanges;
+class Metrics;
+
+// How recovered files are copied out of the image.
+enum CopyEngine {
+  kCopyAuto,      // The fastest of the below that works.
+  kCopyReflink,   // Share the image's blocks (btrfs, XFS).
+  kCopyRange,     // copy_file_range() in the kernel.
+  kCopyBuffered,  // Read and write through a buffer.
+};
+
 struct Options {
   char* infile;
   char* outdir;
@@ -21,21 +31,70 @@ struct Options {
   uint64_t bufferSize;
   uint64_t catalogNodeSize;
   uint64_t extentNodeSize;
+  bool mmap;
+  uint64_t mmapWindow;
+  uint64_t threads;
+  bool prefilter;
+  bool followBTrees;
+  uint64_t ioSize;
+  CopyEngine copyEngine;
+  uint64_t queueDepth;
+  bool ioUring;
+  bool skipClaimed;
+  // Parts of the image to scan, see --scan-ranges.
+  char* scanRanges;
+  // Snapshots of what scanning found, see snapshot.h.
+  char* saveIndex;
+  char* loadIndex;
+  // Where the HFS+ volume is in the image, see partitions.h.
+  uint64_t volumeOffset;
+  uint64_t volumeSize;
+  // How far apart the positions the scan tries are, 0 for the smaller node
+  // size.
+  uint64_t scanStride;
 };
 
+// Where block number block of the volume is in the image.
+inline uint64_t blockOffset(const Options& options, uint64_t block) {
+  return options.volumeOffset + block * options.blockSize;
+}
+
+// The first byte of the image past the volume.
+inline uint64_t volumeEnd(const Options& options) {
+  return options.volumeOffset + options.volumeSize;
+}
+
+// How far the scan steps past a position that doesn't hold a node.  Steps
+// are counted from the start of the volume, where its nodes line up.
+inline uint64_t scanStride(const Options& options) {
+  if (options.scanStride) return options.scanStride;
+  return options.catalogNodeSize < options.extentNodeSize ?
+      options.catalogNodeSize : options.extentNodeSize;
+}
+
+// The extent descriptors of one record in the extents overflow file.
+typedef std::array<HFSPlusExtentDescriptor, kHFSPlusExtentDensity>
+    ExtentRecord;
+
 struct FileInfo {
-  std::string name;
+  Name name;
   uint32_t parentID;
   uint32_t fileID;
+  uint32_t contentModDate;
   uint64_t logicalSize;
   uint32_t totalBlocks;
   uint32_t foundBlocks;
-  std::vector<HFSPlusExtentDescriptor> extents;
+  // The first kHFSPlusExtentDensity extents are kept here, any more are in
+  // RGS::overflowExtents from overflow on.
+  uint32_t extentCount;
+  uint32_t overflow;
+  HFSPlusExtentDescriptor extents[kHFSPlusExtentDensity];
 };
 
 struct FolderInfo {
-  std::string name;
+  Name name;
   uint32_t parentID;
+  uint32_t contentModDate;
 };
 
 union ExtentKey {
@@ -48,11 +107,39 @@ union ExtentKey {
 
 struct RGS {
   Options options;
+  StringArena names;
   std::vector<FileInfo> files;
-  std::unordered_map<uint32_t, FolderInfo> folders;
-  std::unordered_map<
-    uint64_t,
-    std::array<HFSPlusExtentDescriptor, kHFSPlusExtentDensity>
-  > extents;
-};
+  // Where each file is in files, by fileID.
+  FlatHashMap<uint32_t, uint32_t> fileIndex;
+  FlatHashMap<uint32_t, FolderInfo> folders;
+  FlatHashMap<uint64_t, ExtentRecord> extents;
+  std::vector<HFSPlusExtentDescriptor> overflowExtents;
+  // Records found again, from another copy of the catalog, and how many of
+  // those disagreed with the copy kept.
+  uint64_t duplicateRecords;
+  uint64_t conflictingRecords;
+  // Where the extents indexed are noted while a scan skips file data.
+  ClaimedRanges* claims;
+  // Where timings and progress are reported, if anywhere.
+  Metrics* metrics;
 
+  // The i'th extent of fi.
+  const HFSPlusExtentDescriptor& extent(const FileInfo& fi, uint32_t i) const {
+    if (i < kHFSPlusExtentDensity) return fi.extents[i];
+    return overflowExtents[fi.overflow + i - kHFSPlusExtentDensity];
+  }
+
+  // Adds an extent to the end of fi.  A file's overflow extents have to be
+  // appended together, before moving on to another file.
+  void appendExtent(FileInfo& fi, const HFSPlusExtentDescriptor& ed) {
+    if (fi.extentCount < kHFSPlusExtentDensity) {
+      fi.extents[fi.extentCount] = ed;
+    } else {
+      if (fi.extentCount == kHFSPlusExtentDensity) {
+        fi.overflow = overflowExtents.size();
+      }
+      overflowExtents.push_back(ed);
+    }
+    fi.extentCount++;
+  }
+};
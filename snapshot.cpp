@@ -0,0 +1,356 @@
+// HFFS (Help find files script)
+// Author: Michael O'Farrell
+
+#include "snapshot.h"
+
+#include "image.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+
+namespace {
+
+constexpr char kMagic[8] = {'H', 'F', 'F', 'S', 'I', 'D', 'X', '\n'};
+// Bump whenever anything written changes.
+constexpr uint32_t kVersion = 2;
+// Reads back differently on a machine of the other byte order.
+constexpr uint32_t kByteOrder = 0x01020304;
+
+typedef FlatHashMap<uint32_t, uint32_t> FileIndex;
+typedef FlatHashMap<uint32_t, FolderInfo> Folders;
+typedef FlatHashMap<uint64_t, ExtentRecord> Extents;
+
+// The tables, in the order they are written.  Hash tables are written as
+// their slots, plus the slot for key 0 when there is one.
+enum Section {
+  kFiles,
+  kNames,
+  kFileIndex,
+  kFileIndexKey0,
+  kFolders,
+  kFoldersKey0,
+  kExtents,
+  kExtentsKey0,
+  kOverflowExtents,
+  kSectionCount,
+};
+
+struct Header {
+  char magic[8];
+  uint32_t version;
+  uint32_t byteOrder;
+  // Of every byte in the file after this one.
+  uint64_t checksum;
+  // How this build lays out the tables.
+  uint32_t fileInfoSize;
+  uint32_t fileIndexSlotSize;
+  uint32_t folderSlotSize;
+  uint32_t extentSlotSize;
+  // The image and the options it was scanned with.
+  uint64_t imageSize;
+  uint64_t volumeOffset;
+  uint64_t volumeSize;
+  uint64_t sectorSize;
+  uint64_t blockSize;
+  uint64_t catalogNodeSize;
+  uint64_t extentNodeSize;
+  uint64_t stopBlock;
+  // What was found.
+  uint64_t fileIndexSize;
+  uint64_t folderCount;
+  uint64_t extentCount;
+  uint64_t duplicateRecords;
+  uint64_t conflictingRecords;
+  struct {
+    uint64_t offset;
+    uint64_t length;
+  } sections[kSectionCount];
+};
+
+// Where the checksummed bytes start.
+constexpr uint64_t kChecksumStart =
+    offsetof(Header, checksum) + sizeof(uint64_t);
+
+// A quick hash of length bytes, a word at a time.  Catches damage, not
+// tampering.
+uint64_t checksum(const char* data, uint64_t length) {
+  uint64_t hash = 0xCBF29CE484222325ull;
+  auto mix = [&hash](uint64_t word) {
+    hash = (hash ^ word) * 0x100000001B3ull;
+    hash = hash << 31 | hash >> 33;
+  };
+  uint64_t i = 0;
+  for (; i + sizeof(uint64_t) <= length; i += sizeof(uint64_t)) {
+    uint64_t word;
+    memcpy(&word, data + i, sizeof(word));
+    mix(word);
+  }
+  uint64_t tail = 0;
+  memcpy(&tail, data + i, length - i);
+  mix(tail ^ length);
+  return hash;
+}
+
+// A read only mapping of a whole file, unmapped when it goes.
+class MappedFile {
+ public:
+  MappedFile(int fd, uint64_t size) : size_(size) {
+    data_ = (char*)mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+  }
+  ~MappedFile() {
+    if (data_ != MAP_FAILED) munmap(data_, size_);
+  }
+
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  bool mapped() const { return data_ != MAP_FAILED; }
+  const char* data() const { return data_; }
+  uint64_t size() const { return size_; }
+
+ private:
+  char* data_;
+  uint64_t size_;
+};
+
+// Writes the sections of a snapshot one after another, each starting on an
+// eight byte boundary, noting where each went in the header.
+class SnapshotWriter {
+ public:
+  SnapshotWriter(int fd, Header& header)
+      : fd_(fd), header_(header), offset_(sizeof(Header)) {}
+
+  void begin(Section section) {
+    header_.sections[section].offset = offset_;
+  }
+  void write(const void* data, uint64_t length) {
+    const char* from = (const char*)data;
+    while (length > 0) {
+      ssize_t written = pwrite(fd_, from, length, offset_);
+      if (written < 0 && errno == EINTR) continue;
+      if (written <= 0) throw std::runtime_error("Couldn't write snapshot.");
+      from += written;
+      offset_ += written;
+      length -= written;
+    }
+  }
+  void end(Section section) {
+    header_.sections[section].length =
+        offset_ - header_.sections[section].offset;
+    const char padding[sizeof(uint64_t)] = {};
+    write(padding, (sizeof(uint64_t) - offset_ % sizeof(uint64_t)) %
+                   sizeof(uint64_t));
+  }
+
+  void section(Section section, const void* data, uint64_t length) {
+    begin(section);
+    write(data, length);
+    end(section);
+  }
+
+  template<typename Map>
+  void map(Section slots, Section key0, const Map& map) {
+    section(slots, map.slots(), map.slotCount() * sizeof(*map.slots()));
+    section(key0, map.emptyKeySlot(),
+            map.emptyKeySlot() ? sizeof(*map.slots()) : 0);
+  }
+
+  uint64_t size() const { return offset_; }
+
+ private:
+  int fd_;
+  Header& header_;
+  uint64_t offset_;
+};
+
+// The table held by section of the snapshot, as count records of type T.
+template<typename T>
+const T* table(const MappedFile& file, Section section, uint64_t& count) {
+  const Header& header = *(const Header*)file.data();
+  uint64_t offset = header.sections[section].offset;
+  uint64_t length = header.sections[section].length;
+  if (offset % sizeof(uint64_t) != 0 || offset > file.size() ||
+      length > file.size() - offset || length % sizeof(T) != 0) {
+    throw std::runtime_error("Snapshot is damaged.");
+  }
+  count = length / sizeof(T);
+  return (const T*)(file.data() + offset);
+}
+
+template<typename Map>
+void loadMap(const MappedFile& file, Section slots, Section key0,
+             uint64_t size, Map& map) {
+  typedef typename Map::Slot Slot;
+  uint64_t count;
+  const Slot* slotTable = table<Slot>(file, slots, count);
+  uint64_t hasKey0;
+  const Slot* key0Slot = table<Slot>(file, key0, hasKey0);
+  // Tables are empty or at least 16 slots, and no more than three quarters
+  // full, as FlatHashMap keeps them.
+  if ((count & (count - 1)) != 0 || (count != 0 && count < 16) ||
+      hasKey0 > 1 || size < hasKey0 || (size - hasKey0) * 4 > count * 3 ||
+      !map.assign(slotTable, count, size, hasKey0 ? key0Slot : nullptr)) {
+    throw std::runtime_error("Snapshot is damaged.");
+  }
+}
+
+uint64_t infileSize(const Options& options) {
+  int fd = open(options.infile, O_RDONLY);
+  if (fd < 0) throw std::runtime_error("Couldn't open image.");
+  uint64_t size = imageSize(fd);
+  close(fd);
+  return size;
+}
+
+}  // namespace
+///////////////////////////////////////////////////////////////////////////////
+
+void saveSnapshot(const RGS& env, const char* path) {
+  const Options& options = env.options;
+  Header header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.version = kVersion;
+  header.byteOrder = kByteOrder;
+  header.fileInfoSize = sizeof(FileInfo);
+  header.fileIndexSlotSize = sizeof(FileIndex::Slot);
+  header.folderSlotSize = sizeof(Folders::Slot);
+  header.extentSlotSize = sizeof(Extents::Slot);
+  header.imageSize = infileSize(options);
+  header.volumeOffset = options.volumeOffset;
+  header.volumeSize = options.volumeSize;
+  header.sectorSize = options.sectorSize;
+  header.blockSize = options.blockSize;
+  header.catalogNodeSize = options.catalogNodeSize;
+  header.extentNodeSize = options.extentNodeSize;
+  header.stopBlock = options.stopBlock;
+  header.fileIndexSize = env.fileIndex.size();
+  header.folderCount = env.folders.size();
+  header.extentCount = env.extents.size();
+  header.duplicateRecords = env.duplicateRecords;
+  header.conflictingRecords = env.conflictingRecords;
+
+  // Written beside the snapshot and moved over it once complete, so an
+  // interrupted write never leaves a snapshot behind.
+  std::string partial = std::string(path) + ".partial";
+  int fd = open(partial.c_str(), O_RDWR|O_CREAT|O_TRUNC, 0666);
+  if (fd < 0) {
+    std::cerr << "Failed to create " << partial << std::endl;
+    throw std::runtime_error("Couldn't write snapshot.");
+  }
+  try {
+    SnapshotWriter writer(fd, header);
+    writer.section(kFiles, env.files.data(),
+                   env.files.size() * sizeof(FileInfo));
+    writer.begin(kNames);
+    env.names.forEachChunk([&writer](const char* data, uint64_t length) {
+      writer.write(data, length);
+    });
+    writer.end(kNames);
+    writer.map(kFileIndex, kFileIndexKey0, env.fileIndex);
+    writer.map(kFolders, kFoldersKey0, env.folders);
+    writer.map(kExtents, kExtentsKey0, env.extents);
+    writer.section(kOverflowExtents, env.overflowExtents.data(),
+                   env.overflowExtents.size() *
+                   sizeof(HFSPlusExtentDescriptor));
+
+    // With everything else in place the checksum can be taken of the file.
+    if (pwrite(fd, &header, sizeof(header), 0) != sizeof(header)) {
+      throw std::runtime_error("Couldn't write snapshot.");
+    }
+    MappedFile written(fd, writer.size());
+    if (!written.mapped()) {
+      throw std::runtime_error("Couldn't write snapshot.");
+    }
+    header.checksum = checksum(written.data() + kChecksumStart,
+                               written.size() - kChecksumStart);
+    if (pwrite(fd, &header, sizeof(header), 0) != sizeof(header) ||
+        fsync(fd) < 0 || rename(partial.c_str(), path) < 0) {
+      throw std::runtime_error("Couldn't write snapshot.");
+    }
+  } catch (...) {
+    close(fd);
+    unlink(partial.c_str());
+    throw;
+  }
+  close(fd);
+}
+
+void loadSnapshot(RGS& env, const char* path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    std::cerr << "Failed to open " << path << std::endl;
+    throw std::runtime_error("Couldn't open snapshot.");
+  }
+  MappedFile file(fd, imageSize(fd));
+  close(fd);
+  if (file.size() < sizeof(Header) || !file.mapped()) {
+    throw std::runtime_error("Couldn't read snapshot.");
+  }
+
+  const Header& header = *(const Header*)file.data();
+  if (memcmp(header.magic, kMagic, sizeof(kMagic)) != 0) {
+    throw std::runtime_error("Not a snapshot.");
+  }
+  if (header.version != kVersion || header.byteOrder != kByteOrder ||
+      header.fileInfoSize != sizeof(FileInfo) ||
+      header.fileIndexSlotSize != sizeof(FileIndex::Slot) ||
+      header.folderSlotSize != sizeof(Folders::Slot) ||
+      header.extentSlotSize != sizeof(Extents::Slot)) {
+    throw std::runtime_error("Snapshot was written by another build.");
+  }
+  if (header.checksum != checksum(file.data() + kChecksumStart,
+                                  file.size() - kChecksumStart)) {
+    throw std::runtime_error("Snapshot is damaged.");
+  }
+  if (header.imageSize != infileSize(env.options)) {
+    throw std::runtime_error("Snapshot was taken of another image.");
+  }
+  if (header.volumeOffset != env.options.volumeOffset ||
+      header.volumeSize != env.options.volumeSize) {
+    throw std::runtime_error("Snapshot was taken of another volume at " +
+                             std::to_string(header.volumeOffset) + ".");
+  }
+
+  Options& options = env.options;
+  if (!options.blockSize) {
+    options.blockSize = header.blockSize;
+    // Reads while saving start on block boundaries, keep them that way.
+    options.ioSize = std::max(
+        (options.ioSize + options.blockSize - 1) / options.blockSize *
+        options.blockSize, options.blockSize);
+  } else if (options.blockSize != header.blockSize) {
+    throw std::runtime_error("Snapshot was taken with a block size of " +
+                             std::to_string(header.blockSize) + ".");
+  }
+
+  uint64_t count;
+  const FileInfo* files = table<FileInfo>(file, kFiles, count);
+  env.files.assign(files, files + count);
+  const char* names = table<char>(file, kNames, count);
+  env.names.assign(names, count);
+  loadMap(file, kFileIndex, kFileIndexKey0, header.fileIndexSize,
+          env.fileIndex);
+  loadMap(file, kFolders, kFoldersKey0, header.folderCount, env.folders);
+  loadMap(file, kExtents, kExtentsKey0, header.extentCount, env.extents);
+  const HFSPlusExtentDescriptor* overflow =
+      table<HFSPlusExtentDescriptor>(file, kOverflowExtents, count);
+  env.overflowExtents.assign(overflow, overflow + count);
+  env.duplicateRecords = header.duplicateRecords;
+  env.conflictingRecords = header.conflictingRecords;
+
+  std::cout << "Loaded snapshot taken with:" << std::endl
+            << "  sectorSize: " << header.sectorSize << std::endl
+            << "  blockSize: " << header.blockSize << std::endl
+            << "  catalogNodeSize: " << header.catalogNodeSize << std::endl
+            << "  extentNodeSize: " << header.extentNodeSize << std::endl;
+}
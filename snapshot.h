@@ -0,0 +1,22 @@
+// HFFS (Help find files script)
+// Author: Michael O'Farrell
+
+#pragma once
+
+#include "rgs.h"
+
+// Everything scanning finds can be written to a snapshot file and read back
+// in later, so a failed or repeated save doesn't mean scanning the whole image
+// again.  Snapshots hold the tables exactly as they are laid out in memory, so
+// loading one is a few large copies out of a mapping rather than a parse.  They
+// are checksummed, and only load into the same build of HFFS, on the same
+// machine, for the same image.
+
+// Writes the files, folders and extents found so far to path, along with the
+// options they were found with.  The file only appears once it is complete.
+void saveSnapshot(const RGS& env, const char* path);
+
+// Replaces what has been found with the snapshot at path.  Takes the block
+// size from the snapshot if none was given.  Throws if the snapshot is damaged
+// or doesn't match the image.
+void loadSnapshot(RGS& env, const char* path);
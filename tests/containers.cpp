@@ -0,0 +1,99 @@
+// HFFS (Help find files script)
+// Author: Michael O'Farrell
+
+// Checks of the containers at their edges, run by make check.  Built with
+// AddressSanitizer so reads and writes out of bounds fail too.
+
+#include "containers.h"
+
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace {
+
+// The size of StringArena's chunks.
+constexpr uint64_t kChunk = 1 << 20;
+
+int failures = 0;
+
+void check(bool ok, const char* what) {
+  if (!ok) {
+    std::cerr << "Failed: " << what << std::endl;
+    failures++;
+  }
+}
+
+// Names that fill a chunk exactly, then one more, which needs a new chunk.
+void exactFill() {
+  StringArena arena;
+  std::vector<Name> names;
+  for (uint64_t i = 0; i < kChunk / 256 + 1; i++) {
+    names.push_back(arena.add(std::string(256, 'a' + i % 26)));
+  }
+  bool same = true;
+  for (uint64_t i = 0; i < names.size(); i++) {
+    same = same && arena.get(names[i]) == std::string(256, 'a' + i % 26);
+  }
+  check(same, "names filling a chunk exactly read back");
+  check(names.back().offset == kChunk, "the next name starts a chunk");
+}
+
+// An arena assigned a whole number of chunks takes more names after them.
+void assignWholeChunks() {
+  std::string data(2 * kChunk, 'x');
+  StringArena arena;
+  arena.assign(data.data(), data.size());
+  Name name = arena.add("after", 5);
+  check(name.offset == 2 * kChunk,
+        "a name added after assign() starts a chunk");
+  check(arena.get(name) == "after", "a name added after assign() reads back");
+}
+
+// The gap a name too long for the rest of a chunk leaves is zeroed.
+void zeroedGap() {
+  StringArena arena;
+  std::string name(255, 'n');
+  while (arena.size() + name.size() <= kChunk) arena.add(name);
+  uint64_t gap = arena.size();
+  arena.add(name);
+  bool zero = true;
+  bool first = true;
+  arena.forEachChunk([&](const char* data, uint64_t length) {
+    if (first) {
+      check(length == kChunk, "the first chunk is written whole");
+      for (uint64_t i = gap; i < length; i++) zero = zero && data[i] == 0;
+    }
+    first = false;
+  });
+  check(zero, "the gap at the end of a chunk is zeroed");
+}
+
+// A table with no empty slot is turned down, one with room is taken.
+void assignFullTable() {
+  typedef FlatHashMap<uint32_t, uint32_t> Map;
+  std::vector<Map::Slot> slots(16);
+  for (uint32_t i = 0; i < slots.size(); i++) slots[i] = {i + 1, i};
+  Map map;
+  check(!map.assign(slots.data(), slots.size(), slots.size(), nullptr),
+        "a full table is turned down");
+  check(map.find(1) == nullptr, "a turned down table leaves the map empty");
+  slots[3].key = 0;
+  check(map.assign(slots.data(), slots.size(), slots.size() - 1, nullptr),
+        "a table with an empty slot is taken");
+  check(map.find(100) == nullptr, "a missing key isn't found");
+}
+
+}  // namespace
+///////////////////////////////////////////////////////////////////////////////
+
+int main() {
+  exactFill();
+  assignWholeChunks();
+  zeroedGap();
+  assignFullTable();
+  if (failures) return EXIT_FAILURE;
+  std::cout << "containers: ok" << std::endl;
+  return EXIT_SUCCESS;
+}
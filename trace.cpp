@@ -0,0 +1,123 @@
+// HFFS (Help find files script)
+// Author: Michael O'Farrell
+
+#include "trace.h"
+
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace {
+
+// Events each thread keeps, the oldest are overwritten past this.
+constexpr size_t kEventsPerThread = 1 << 16;
+
+struct Event {
+  const char* name;
+  // 'X' for a span, 'C' for a counter.
+  char kind;
+  uint64_t begin;
+  // How long a span took, or a counter's value.
+  int64_t value;
+};
+
+// A thread's events, kept once the thread is gone until they are written.
+struct Buffer {
+  int thread;
+  std::vector<Event> events;
+  // How many events were ever recorded, those past the capacity have
+  // overwritten the oldest.
+  uint64_t recorded;
+};
+
+struct Buffers {
+  std::mutex mutex;
+  std::vector<std::unique_ptr<Buffer>> buffers;
+};
+
+Buffers& buffers() {
+  static Buffers buffers;
+  return buffers;
+}
+
+thread_local Buffer* threadBuffer = nullptr;
+std::chrono::steady_clock::time_point traceStart;
+
+void record(const Event& event) {
+  if (!threadBuffer) {
+    Buffers& all = buffers();
+    std::lock_guard<std::mutex> lock(all.mutex);
+    all.buffers.emplace_back(new Buffer{(int)all.buffers.size() + 1, {}, 0});
+    threadBuffer = all.buffers.back().get();
+    threadBuffer->events.resize(kEventsPerThread);
+  }
+  threadBuffer->events[threadBuffer->recorded++ % kEventsPerThread] = event;
+}
+
+}  // namespace
+///////////////////////////////////////////////////////////////////////////////
+
+bool Trace::enabled_ = false;
+
+void Trace::start() {
+  traceStart = std::chrono::steady_clock::now();
+  enabled_ = true;
+}
+
+uint64_t Trace::now() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now() - traceStart).count() + 1;
+}
+
+void Trace::span(const char* name, uint64_t begin, uint64_t end) {
+  record({name, 'X', begin, (int64_t)(end - begin)});
+}
+
+void Trace::counter(const char* name, int64_t value) {
+  record({name, 'C', now(), value});
+}
+
+void Trace::write(const char* path) {
+  std::ofstream out(path, std::ios::out | std::ios::trunc);
+  if (!out) {
+    std::cerr << "Failed to write " << path << std::endl;
+    return;
+  }
+  Buffers& all = buffers();
+  std::lock_guard<std::mutex> lock(all.mutex);
+  uint64_t dropped = 0;
+  // Timestamps are in microseconds.
+  out.precision(3);
+  out << std::fixed << "{\"traceEvents\": [" << std::endl
+      << "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, "
+      << "\"args\": {\"name\": \"hffs\"}}";
+  for (const auto& buffer : all.buffers) {
+    out << "," << std::endl
+        << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": "
+        << buffer->thread << ", \"args\": {\"name\": \"thread "
+        << buffer->thread << "\"}}";
+    uint64_t first = 0;
+    if (buffer->recorded > kEventsPerThread) {
+      first = buffer->recorded - kEventsPerThread;
+      dropped += first;
+    }
+    for (uint64_t i = first; i < buffer->recorded; i++) {
+      const Event& event = buffer->events[i % kEventsPerThread];
+      out << "," << std::endl
+          << "{\"name\": \"" << event.name << "\", \"ph\": \"" << event.kind
+          << "\", \"pid\": 1, \"tid\": " << buffer->thread
+          << ", \"ts\": " << event.begin / 1e3;
+      if (event.kind == 'X') {
+        out << ", \"dur\": " << event.value / 1e3 << "}";
+      } else {
+        out << ", \"args\": {\"value\": " << event.value << "}}";
+      }
+    }
+  }
+  out << std::endl << "]," << std::endl
+      << "\"otherData\": {\"droppedEvents\": \"" << dropped << "\"}}"
+      << std::endl;
+}
@@ -0,0 +1,60 @@
+// HFFS (Help find files script)
+// Author: Michael O'Farrell
+
+#pragma once
+
+#include <cstdint>
+
+// Records a timeline of a recovery, to see where the time goes: spans of time
+// spent in parts of the code, and counters sampled along the way.  Each
+// thread records into a ring buffer of its own, keeping its most recent
+// events, and at the end they are written out as Chrome trace event JSON that
+// Perfetto or chrome://tracing can open.  Until tracing is started, spans and
+// counters cost a test of a flag.
+
+class Trace {
+ public:
+  // Starts recording.  Has to be called before any other thread starts.
+  static void start();
+
+  static bool enabled() { return enabled_; }
+
+  // Nanoseconds since an arbitrary start, never 0.
+  static uint64_t now();
+
+  // Records a span from begin to end, as given by now().  name has to live
+  // until the trace is written, a string literal in practice.
+  static void span(const char* name, uint64_t begin, uint64_t end);
+
+  // Records the value of a counter, name as for span().
+  static void counter(const char* name, int64_t value);
+
+  // Writes everything recorded to path.
+  static void write(const char* path);
+
+ private:
+  static bool enabled_;
+};
+
+// Records the time from construction to destruction as a span named name,
+// when tracing.
+class TraceSpan {
+ public:
+  explicit TraceSpan(const char* name)
+      : name_(name), begin_(Trace::enabled() ? Trace::now() : 0) {}
+  ~TraceSpan() {
+    if (begin_) Trace::span(name_, begin_, Trace::now());
+  }
+
+  TraceSpan(const TraceSpan&) = delete;
+  TraceSpan& operator=(const TraceSpan&) = delete;
+
+ private:
+  const char* name_;
+  uint64_t begin_;
+};
+
+// Records a counter's value, when tracing.
+inline void traceCounter(const char* name, int64_t value) {
+  if (Trace::enabled()) Trace::counter(name, value);
+}